@@ -0,0 +1,44 @@
+#ifndef AGENT_H_
+#define AGENT_H_
+
+#include <stdint.h>
+
+#include "dfc/types.h"
+
+#define AGENT_SOCK "./.dfc-agent.sock"  // next to the dfc.conf it serves
+#define AGENT_POOL_SETS 4  // CLIs served at once; more fall back to direct
+#define AGENT_HEALTH_SEC 5
+#define AGENT_LEASE_FDS 250  // servers per lease message, under SCM_MAX_FD
+
+// sent by the agent to a connecting CLI. n_servers == 0 means every set is
+// leased; otherwise a message per AGENT_LEASE_FDS servers follows, a
+// DFCAgentServer per server with an fd attached for each connected one
+// (SCM_RIGHTS, in server order)
+typedef struct {
+  uint32_t n_servers;
+  uint64_t stripe_unit;
+  int32_t compress_level;
+  uint64_t dedup_chunk;
+  uint32_t name_cache;
+  uint32_t catalog_ttl;
+  uint8_t ec_k, ec_m;
+  uint8_t auto_weight;
+  uint8_t hedge;
+} DFCAgentLease;
+
+typedef struct {
+  uint32_t weight;
+  uint8_t alive;  // connected, its fd attached
+} DFCAgentServer;
+
+// sent back by the CLI once its connections sit at a frame boundary again.
+// a CLI that exits without it returns a set the agent no longer trusts
+typedef struct {
+  uint32_t clean;
+} DFCAgentRelease;
+
+int agent_lease(DFCOperation **, int **);
+void agent_release(int, int);
+int agent_run(DFCOperation *);
+
+#endif  // AGENT_H_
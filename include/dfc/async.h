@@ -1,10 +1,26 @@
 #ifndef ASYNC_H_
 #define ASYNC_H_
 
-void *async_dfc_send(void *);
-void *get_handle(void *);
-void *list_handle(void *);
-void *put_handle(void *);
+#include <stdint.h>
+
+#include "dfc/types.h"
+
+int get_fetch(GetOperation *);
+int get_handle(GetOperation *);
+// get only bytes [off, off + len) of each file, from the servers holding
+// the stripe units they fall in; each file ends up holding just that slice
+int get_range(GetOperation *, uint64_t, uint64_t);
+// list the files whose names start with prefix ("" for all), a page at a
+// time from every server at once, merging the pages as they stream in (see
+// ListMerge). each file is printed once, in byte order, as soon as no server
+// can list it any more, with a note when some of its pieces have no copy on
+// a server that answered
+int list_handle(DFCOperation *, int *, const char *, ListTally *);
+char *list_names(int, size_t *);
+// the size one server has each file stored with, UINT64_MAX for one it does
+// not have; -1 when it did not answer them all
+int stored_sizes(int, char *const *, size_t, uint64_t *);
+int put_handle(PutOperation *);
 int handle_put(char *, int *, size_t);
 void print_socket_buffer(SocketBuffer *);
 
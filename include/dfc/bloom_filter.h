@@ -1,23 +1,45 @@
 #ifndef BLOOM_FILTER_H_
 #define BLOOM_FILTER_H_
 
-#define HASH_LEN 65536
+#include <stddef.h>
+#include <stdint.h>
 
+#define BLOOM_BLOCK_WORDS 8  // one 64-byte cache line per block
+#define BLOOM_BLOCK_BITS (64 * BLOOM_BLOCK_WORDS)
+#define BLOOM_K_MAX 16
+#define BLOOM_BLOCKS_MAX (1ull << 32)  // blocks are picked with 32 hash bits
+#define BLOOM_MAGIC 0x44464342u  // "DFCB"
+#define BLOOM_VERSION 1
+#define BLOOM_HDR_LEN 64  // keeps the blocks of a mapped file cache-aligned
+
+// a blocked Bloom filter: one 64-bit hash of an item picks a block, and k
+// bits derived from the same hash are set within that block, so an add or a
+// probe touches a single cache line. a saved filter is the header below
+// followed by the blocks, in host byte order, so it can be mapped as-is
 typedef struct {
-  unsigned int *data;
-  size_t size;
-  size_t capacity;
+  uint64_t *blocks;    // n_blocks x BLOOM_BLOCK_WORDS
+  uint64_t n_blocks;
+  uint32_t k;
+  uint64_t capacity;   // items it was sized for
+  uint64_t n_items;    // items added, counting repeats
+  uint64_t stamp;      // the caller's, kept across save and load
+  void *map;           // set when loaded from a file
+  size_t map_len;
 } BloomFilter;
 
 void add_bloom_filter(BloomFilter *, const char *);
-int check_bloom_filter(BloomFilter *, const char *);
-BloomFilter *create_bloom_filter(size_t);
+void add_bloom_filter_hash(BloomFilter *, uint64_t);
+int check_bloom_filter(const BloomFilter *, const char *);
+int check_bloom_filter_hash(const BloomFilter *, uint64_t);
+BloomFilter *create_bloom_filter(uint64_t, double);
 void destroy_bloom_filter(BloomFilter *);
+BloomFilter *load_bloom_filter(const char *);
+int save_bloom_filter(const BloomFilter *, const char *);
+int union_bloom_filter(BloomFilter *, const BloomFilter *);
 unsigned short double_hash(const char *);
+uint64_t hash64(const char *);
 unsigned short hash_djb2(const char *);
 unsigned short hash_fnv1a(const char *);
-void show_set_bits(BloomFilter *bf);
-void set_bit(BloomFilter *, size_t);
-int test_bit(BloomFilter *bf, size_t idx);
+void show_set_bits(const BloomFilter *);
 
 #endif  // BLOOM_FILTER_H_
@@ -0,0 +1,58 @@
+#ifndef CATALOG_H_
+#define CATALOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfc/types.h"
+
+// what this client knows of the remote files: name, size, the unit their
+// pieces were cut with and the servers last seen with them, so a ranged get
+// asks for exactly its units in one round, and a list is answered without
+// the servers while the last whole listing is recent enough. kept next to
+// the dfc.conf it serves, and only trusted for catalog_ttl seconds (see
+// read_config)
+#define CATALOG_FILE "./.dfc-catalog"
+#define CATALOG_MAGIC 0x44464354u  // "DFCT"
+#define CATALOG_VERSION 1
+#define CATALOG_HDR_LEN 64
+#define CATALOG_REC_LEN 48
+#define CATALOG_SLACK 1024  // superseded records kept before a rewrite
+
+// record flags. an erasure-coded file also carries its code as
+// DFC_PIECE_EC does
+#define CATALOG_MANIFEST 0x1  // stored as a dedup manifest
+#define CATALOG_ERASURE 0x2   // erasure-coded
+#define CATALOG_SHORT 0x4     // the last listing found pieces with no copy
+
+// on disk (host byte order), a header:
+//   magic:4 | version:4 | n_servers:4 | pad:4 | listed:8 | pad to
+//   CATALOG_HDR_LEN
+// then records, only ever appended, each 8-aligned:
+//   hash:8 | size:8 | unit:8 | etag:8 | stamp:8 | flags:4 | name_len:2 |
+//   pad:2 | holders:stride | name | pad
+// hash is hash64 of the name, so a record cut short by a writer dying ends
+// the catalog rather than being read as a file
+
+// map CATALOG_FILE, when catalog_ttl is on; a missing or foreign one is
+// started over at the first record
+void catalog_open(Catalog *, const DFCOperation *);
+// the latest record of the name while it is fresh; 0 when there is none
+int catalog_find(const Catalog *, const char *, CatalogEntry *);
+void catalog_add(Catalog *, const CatalogEntry *);
+// get the records added so far to the disk, before an operation they have
+// to outlive
+void catalog_sync(Catalog *);
+// whether the last whole listing is fresh enough to list from
+int catalog_listed(const Catalog *);
+// print the names starting with prefix, as list would; returns how many
+size_t catalog_print(const Catalog *, const char *);
+// a whole listing replaces the catalog with the files it prints, each
+// keeping what the catalog knew of its layout
+void catalog_relist(Catalog *);
+void catalog_relisted(Catalog *, const char *, const uint8_t *, uint64_t,
+                      int);
+void catalog_relist_done(Catalog *, int);
+void catalog_close(Catalog *);
+
+#endif  // CATALOG_H_
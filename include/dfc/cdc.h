@@ -0,0 +1,23 @@
+#ifndef CDC_H_
+#define CDC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CDC_AVG_MIN (4 * 1024)
+#define CDC_AVG_MAX (16 * 1024 * 1024)
+
+// content-defined chunking with a gear rolling hash (FastCDC): a cut falls
+// where the hash of the last 64 bytes has its top bits clear, so an edit only
+// moves the boundaries around it. chunks are at least avg / 4 and at most
+// avg * 4 bytes; the bits checked are harder to clear before avg bytes and
+// easier after, which keeps sizes close to avg
+typedef struct {
+  size_t min, avg, max;
+  uint64_t mask_s, mask_l;  // before and after avg bytes
+} CDCParams;
+
+void cdc_init(CDCParams *, size_t);
+size_t cdc_cut(const CDCParams *, const unsigned char *, size_t);
+
+#endif  // CDC_H_
@@ -0,0 +1,11 @@
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli), as computed by the SSE4.2 crc32 instruction. pass the
+// previous return value to continue a checksum over more bytes, 0 to start
+uint32_t crc32c(uint32_t, const void *, size_t);
+
+#endif  // CRC32C_H_
@@ -0,0 +1,26 @@
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include "dfc/sha256.h"
+#include "dfc/types.h"
+
+// a dedup put cuts each file into content-defined chunks (see cdc.h) and
+// stores every chunk the servers do not hold yet as a file of its own, named
+// after its SHA-256. the file itself is stored as a manifest listing its
+// chunks, whose pieces carry DFC_PIECE_MANIFEST. on the wire:
+//   magic:4 | version:4 | file_size:8 | n_chunks:4 |
+//   n_chunks x (len:4 | sha256:32)
+// with chunks in file order
+#define DEDUP_CHUNK_PREFIX ".dfc-chunk-"
+#define DEDUP_CHUNK_NAME_LEN (sizeof(DEDUP_CHUNK_PREFIX) - 1 + 2 * SHA256_LEN)
+#define DEDUP_MANIFEST_MAGIC 0x4446434du  // "DFCM"
+#define DEDUP_MANIFEST_VERSION 1
+#define DEDUP_MANIFEST_HDR_LEN 20
+#define DEDUP_ENTRY_LEN (4 + SHA256_LEN)
+#define DEDUP_BATCH 1024  // chunk files per put or get round
+
+int dedup_is_chunk(const char *);
+int dedup_put(PutOperation *);
+int dedup_restore(GetOperation *, FileTransfer *);
+
+#endif  // DEDUP_H_
@@ -3,6 +3,15 @@
 
 #include "dfc/types.h"
 
+#define CMD_FILTER_FP 1e-9  // a false positive runs list for a typo
+
+// remote names as of the last list, so a get of a name that is not there
+// fails without a round trip. kept next to the dfc.conf it serves, and only
+// trusted for name_cache seconds (see read_config)
+#define NAMES_FILTER "./.dfc-names.bloom"
+#define NAMES_FILTER_FP 0.01
+#define NAMES_FILTER_SLACK 1024  // room for puts before the next list
+
 int run_handler(int, char **);
 void usage(const char *);
 
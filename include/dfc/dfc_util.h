@@ -3,22 +3,28 @@
 
 #include "dfc/dfc.h"
 
-#define UINT_SZ sizeof(unsigned int)
 #define DFC_SERVER_NAME_MAX 128
 #define MAX_PORT_DIGITS 5
 
 char *alloc_buf(size_t);
-size_t attach_hdr(char *, DFCHeader *);
 int chk_alloc_err(void *, const char *, const char *, int);
+ssize_t decode_hdr(const char *, size_t, DFCHeader *);
+void decode_frame_hdr(const char *, DFCFrameHeader *);
+void decode_piece_hdr(const char *, DFCPieceHeader *);
+size_t encode_hdr(const DFCHeader *, char *);
+size_t encode_frame_hdr(const DFCFrameHeader *, char *);
+size_t encode_piece_hdr(const DFCPieceHeader *, char *);
 void free_buf(char *);
-void get_chunk_sizes(size_t, size_t, size_t *);
-void merge(char *, size_t, char *, size_t, char *);
+void init_hdr(DFCHeader *, uint8_t, const char *);
+ssize_t pwrite_all(int, const char *, size_t, off_t);
 DFCOperation *read_config(void);
-char *read_file(const char *, ssize_t *);
 ssize_t read_until(char *, size_t, char, char *, size_t);
 char *realloc_buf(char *, size_t);
-char **split_file(char *, size_t *, size_t);
+uint64_t stripe_unit(uint64_t, const PlaceMap *, uint64_t);
 
+void print_frame_header(DFCFrameHeader *);
+void print_transfer_stats(const char *, FileTransfer *, size_t,
+                          const struct timespec *, const struct timespec *);
 void print_header(DFCHeader *);
 
 #endif  // DFC_UTIL_H
@@ -0,0 +1,28 @@
+#ifndef ERASURE_H_
+#define ERASURE_H_
+
+#include <sys/types.h>
+
+#include "dfc/types.h"
+
+// the erasure-coded layout, instead of adjacent pairs: stripe s is k stripe
+// units of data (units s * k to s * k + k - 1) and m parity pieces computed
+// from them (see rs.h), and its piece j goes to server (g + j) % n_servers,
+// where g = place_group(place, key, s) (see place.h). each server holds
+// at most one piece of a stripe, so any m of them may be down and the
+// stripe still has k pieces to rebuild its data from.
+//   data piece:   index = unit,          offset = unit * stripe unit
+//   parity piece: index = s * m + r,     offset = where stripe s starts
+// a parity piece is as long as the stripe's first unit; shorter units count
+// as padded with zeros, and units past the end of the file as all zeros
+uint64_t erasure_unit(uint64_t, uint8_t, uint64_t);
+uint64_t erasure_count(const ServerTask *, const FileTransfer *, uint64_t,
+                       size_t, uint64_t *);
+char *erasure_next(ServerTask *, FileTransfer *, size_t, DFCPieceHeader *);
+int erasure_on_piece(ErasureSpool *, FileTransfer *, const DFCPieceHeader *,
+                     off_t *);
+void erasure_piece_done(FileTransfer *, const DFCPieceHeader *);
+int erasure_restore(ErasureSpool *, FileTransfer *);
+void erasure_free(FileTransfer *);
+
+#endif  // ERASURE_H_
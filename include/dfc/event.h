@@ -0,0 +1,125 @@
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dfc/types.h"
+
+#define EV_RXCHUNK (64 * 1024)
+#define EV_MAX_EVENTS 64
+#define EV_FAIR_SHARE (1024 * 1024)  // bytes moved per socket per wakeup
+
+typedef struct DFCConn DFCConn;
+typedef struct DFCEventLoop DFCEventLoop;
+
+// what a connection does with the frames it receives. every callback may be
+// NULL
+typedef struct {
+  // a frame header arrived: return the fd its pieces are written to, or -1
+  // to drop them
+  int (*on_frame)(DFCConn *, const DFCFrameHeader *);
+  // bytes of a frame's listing (payload after the pieces)
+  void (*on_payload)(DFCConn *, const char *, size_t);
+  // a piece header arrived in a frame that has an fd: return 0 to drop the
+  // piece. it may also send the piece elsewhere by setting rx_piece_fd and
+  // rx_base
+  int (*on_piece)(DFCConn *, const DFCPieceHeader *);
+  // a piece passed its checksum, and its raw bytes (how many is given) are
+  // in place
+  void (*on_piece_done)(DFCConn *, const DFCPieceHeader *, uint64_t);
+  // a piece failed its checksum (or did not inflate) and was not counted
+  void (*on_bad_piece)(DFCConn *, const DFCPieceHeader *);
+  // the whole frame has been received
+  void (*on_frame_done)(DFCConn *, const DFCFrameHeader *);
+  // a queued item carrying a tag has left the socket
+  void (*on_sent)(DFCConn *, void *);
+} DFCConnHandler;
+
+typedef struct {
+  char *buf;  // owned, a pool buffer
+  size_t len;
+  size_t done;
+  void *tag;
+} TxItem;
+
+typedef enum {
+  RX_FRAME_HDR,
+  RX_PIECE_HDR,
+  RX_PIECE_DATA,
+  RX_PAYLOAD,
+} RxState;
+
+// per-socket state machine: a queue of outgoing items, and where the current
+// incoming frame is in its header -> pieces -> payload progression
+struct DFCConn {
+  int epfd;
+  int sockfd;
+  size_t srv_id;
+  const DFCConnHandler *handler;
+  void *ctx;
+
+  TxItem *tx;
+  size_t tx_head, tx_tail, tx_cap;
+
+  RxState rx_state;
+  char rx_hdr[DFC_FRAME_HDR_LEN];
+  size_t rx_hdr_have;
+  char *rx_buf;
+  DFCFrameHeader frame_hdr;
+  DFCPieceHeader piece_hdr;
+  size_t pieces_left;
+  uint64_t piece_left;
+  uint64_t payload_left;
+  int rx_fd;
+  off_t rx_base;           // added to piece offsets, set by on_frame
+  int rx_piece_fd;         // rx_fd, or -1 while a piece is being dropped
+  uint32_t rx_crc;         // of the current piece's bytes so far
+  char *rx_zbuf;           // a compressed piece, gathered whole to inflate
+  uint64_t rx_file_bytes;  // file bytes the current frame has delivered
+
+  size_t n_expected;  // response frames still owed by the peer
+  unsigned int events;
+  int failed;
+  int cancelled;  // failed on purpose (ev_cancel), which is no error
+  int tx_busy;    // a send in flight reads the queued buffers (io_uring)
+};
+
+struct DFCEventLoop {
+  int epfd;  // -1 when the io_uring backend drives the loop
+  struct DFCUring *uring;
+  DFCConn *conns;
+  size_t n_conns;
+  size_t max_conns;
+  int timeout_ms;
+
+  // called after every wait, which lasts at most tick_ms (ev_set_tick)
+  int tick_ms;
+  void (*on_tick)(DFCEventLoop *, void *);
+  void *tick_ctx;
+};
+
+DFCConn *ev_add_conn(DFCEventLoop *, int, size_t, const DFCConnHandler *,
+                     void *);
+void ev_cancel(DFCConn *);
+void ev_destroy(DFCEventLoop *);
+void ev_expect(DFCConn *, size_t);
+void ev_fail(DFCConn *, const char *);
+int ev_init(DFCEventLoop *, size_t, int);
+void ev_queue_buf(DFCConn *, const char *, size_t, void *);
+void ev_queue_owned(DFCConn *, char *, size_t, void *);
+int ev_run(DFCEventLoop *);
+void ev_set_tick(DFCEventLoop *, int, void (*)(DFCEventLoop *, void *),
+                 void *);
+
+// shared by the backends: where the next received bytes go, and what
+// receiving/sending a number of bytes does to the connection state
+void ev_rx_advance(DFCConn *, const char *, size_t, int);
+int ev_rx_direct(DFCConn *);
+off_t ev_rx_offset(DFCConn *);
+size_t ev_rx_want(DFCConn *, char *, size_t, char **);
+void ev_tx_advance(DFCConn *, size_t);
+// give back every queued buffer, sent or not
+void ev_tx_drop(DFCConn *);
+
+#endif  // EVENT_H_
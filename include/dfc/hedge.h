@@ -0,0 +1,25 @@
+#ifndef HEDGE_H_
+#define HEDGE_H_
+
+#include <stdint.h>
+
+#include "dfc/types.h"
+
+#define HEDGE_LATENCY "./.dfc-latency"  // recent response latencies
+#define HEDGE_SAMPLES 512
+#define HEDGE_MIN_SAMPLES 32  // fewer say little about the tail
+#define HEDGE_PERCENTILE 95
+#define HEDGE_MIN_MS 10  // below this, hedges would chase scheduling noise
+#define HEDGE_TICK_MS 5
+
+// the latencies HEDGE_LATENCY kept from earlier operations
+void hedge_load(HedgeLog *);
+void hedge_add(HedgeLog *, uint64_t);
+// how long a server gets to start answering before its twins are asked,
+// in ns: the HEDGE_PERCENTILE of the log, 0 while it is too short to tell
+uint64_t hedge_deadline(const HedgeLog *);
+// keep the newest HEDGE_SAMPLES in HEDGE_LATENCY
+void hedge_save(const HedgeLog *);
+void hedge_free(HedgeLog *);
+
+#endif  // HEDGE_H_
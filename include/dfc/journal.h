@@ -0,0 +1,39 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfc/types.h"
+
+#define JOURNAL_PUT "./.dfc-put-journal"
+#define JOURNAL_GET "./.dfc-get-journal"
+
+// a transfer records what it got done as it goes, one line per entry, so
+// that when it dies partway, running it again with --resume moves only the
+// rest:
+//   put <srv> <size> <mtime> <fname>   server srv was sent the file's frame
+//   get <index> <offset> <len> <size> <fname>
+//                                      a piece passed its checksum, and its
+//                                      len raw bytes are at offset in fname
+// puts carry no response, so a frame only counts as stored once the server
+// says it has the file stored with the journaled size. a resumed get takes
+// the output file to still hold what was journaled, as long as the file is
+// still that size
+
+// start a journal at path, or with resume carry on the one there
+void journal_open(Journal *, const char *, int);
+void journal_put(Journal *, const FileTransfer *, size_t);
+void journal_piece(Journal *, const FileTransfer *, const DFCPieceHeader *,
+                   uint64_t);
+// put: keep the entries of files the servers have stored whole
+void journal_confirm(Journal *, const int *, size_t);
+// put: whether server srv has the file from the try being resumed
+int journal_stored(const Journal *, const FileTransfer *, size_t);
+// get: mark the units each file already holds; returns how many have some
+size_t journal_resume(Journal *, FileTransfer *, size_t);
+// the operation is over and nothing is left to resume
+void journal_discard(Journal *);
+void journal_close(Journal *);
+
+#endif  // JOURNAL_H_
@@ -0,0 +1,24 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LZ_LEVEL_DEFAULT 1  // greedy, one candidate per position
+#define LZ_LEVEL_MAX 9      // up to 256 candidates per position
+#define LZ_SAMPLE_LEN (4 * 1024)
+#define LZ_SAMPLE_SLICES 4
+
+// a compressed block is the raw length as a varint followed by sequences of
+//   token:1 | [literal length ext] | literals | offset:2 (LE) | [match ext]
+// with literal length in the token's high nibble and match length - 4 in its
+// low nibble; a nibble of 15 continues in bytes of 255 until a smaller one.
+// the last sequence has literals only
+
+size_t lz_bound(size_t);
+ssize_t lz_compress(const char *, size_t, char *, size_t, int);
+ssize_t lz_decompress(const char *, size_t, char *, size_t);
+ssize_t lz_raw_len(const char *, size_t);
+int lz_worth(const char *, size_t);
+
+#endif  // LZ_H_
@@ -0,0 +1,24 @@
+#ifndef PLACE_H_
+#define PLACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfc/types.h"
+
+#define PLACE_WEIGHT_MAX 1000
+#define PLACE_RATES "./.dfc-rates"  // measured throughput, for weights auto
+#define PLACE_RATE_MIN_BYTES (1024 * 1024)  // less is mostly round trips
+
+// the placement key of a file, from its name
+uint64_t place_key(const char *);
+// the group, in [0, n), of unit u of the file with key (see PlaceMap)
+size_t place_group(const PlaceMap *, uint64_t, uint64_t);
+// the map of the operation's servers: their dfc.conf weights, or with
+// weights auto the throughput they were last measured at
+void place_init(PlaceMap *, const DFCOperation *);
+void place_free(PlaceMap *);
+// fold what the map measured into PLACE_RATES
+void place_save_rates(const PlaceMap *);
+
+#endif  // PLACE_H_
@@ -0,0 +1,31 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfc/types.h"
+
+// every buffer a transfer reads into, inflates into or queues on a socket
+// comes from here: page-aligned, rounded up to a power of two pages, and
+// kept once it is given back for the next one of its class, so the steady
+// state of a transfer allocates nothing. what sits unused is held to
+// POOL_CACHE_MAX, and to the budget less what is in use
+#define POOL_PAGE 4096
+#define POOL_CACHE_MAX (64 * 1024 * 1024)
+
+char *pool_get(size_t);
+// hand back a buffer pool_get gave out for the same length
+void pool_put(char *, size_t);
+// cap the bytes in use at once (--max-memory), 0 for none
+void pool_budget(uint64_t);
+// what a buffer of the length takes out of the budget
+size_t pool_size(size_t);
+// whether buffers taking size bytes in all (see pool_size) still fit the
+// budget; work that can wait for one in use to come back does, rather than
+// going over it
+int pool_room(size_t);
+// free what is cached, reporting the peak when there was a budget
+void pool_drain(void);
+
+#endif  // POOL_H_
@@ -0,0 +1,23 @@
+#ifndef RS_H_
+#define RS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RS_SHARDS_MAX 255  // k + m, so every shard has its own point in GF(2^8)
+
+// systematic Reed-Solomon over GF(2^8): k data shards travel as they are and
+// m parity shards are sums of them weighted by a Cauchy matrix, so any k of
+// the k + m shards give back the data. every shard of a stripe has the same
+// length; callers pad short ones with zeros
+
+// dst ^= c * src, byte by byte
+void gf_mul_add(uint8_t, const uint8_t *, uint8_t *, size_t);
+// parity shard r of the k data shards
+void rs_encode(int, int, const uint8_t *const *, uint8_t *, size_t);
+// fill in the data shards of shards[0, k) that are not present[] from any k
+// that are; parity shards are shards[k, k + m). returns -1 when fewer than
+// k shards are present
+int rs_reconstruct(int, int, uint8_t **, const uint8_t *, size_t);
+
+#endif  // RS_H_
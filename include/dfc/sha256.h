@@ -0,0 +1,11 @@
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <stddef.h>
+
+#define SHA256_LEN 32
+
+// FIPS 180-4 SHA-256 of len bytes
+void sha256(const void *, size_t, unsigned char[SHA256_LEN]);
+
+#endif  // SHA256_H_
@@ -1,17 +1,22 @@
 #ifndef SK_UTIL_H_
 #define SK_UTIL_H_
 
+#include <sys/types.h>
+
+#include "dfc/types.h"
+
 #define CONNECTTIMEO_USEC 0
-#define CONNECTTIMEO_SEC 1
+#define CONNECTTIMEO_SEC 1  // per server, from the moment it resolved
+#define RESOLVETIMEO_SEC 2  // per server, from the start of the stage
+#define CONNECT_MAX_ADDRS 4  // addresses raced per server
 #define RCVTIMEO_SEC 5
 #define RCVTIMEO_USEC 0
-#define RCVCHUNK 1024
 
 int adjacent_failure(int *, size_t);
-int connection_sockfd(const char *, const char *);
-char *dfc_recv(int, ssize_t *);
+size_t count_down(const int *, size_t);
 ssize_t dfc_send(int, char *, size_t);
-void fill_sk_set(DFCOperation *, int *);
+void fill_sk_set(DFCOperation *, int *, const uint16_t *);
+ssize_t plan_get(const int *, size_t, size_t, uint16_t *);
 void set_timeout(int, long, long);
 
 #endif  // SK_UTIL_H_
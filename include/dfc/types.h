@@ -2,22 +2,72 @@
 #define TYPES_H_
 
 #include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 
 #define CONF_MAXLINE 1024
 #define DFC_CONF "./dfc.conf"
-#define MAX_SERVERS 10
+#define DFC_STRIPE_UNIT_DEFAULT (1024 * 1024)
+#define DFC_STRIPE_UNIT_MAX (64 * 1024 * 1024)  // and the most a piece holds
 #define MAX_FNAME SZ_ARG_MAX
 #define SZ_ARG_MAX 1024
 #define SZ_CMD_MAX 8
 
+#define DFC_HDR_MAGIC 0x44464351u  // "DFCQ"
+#define DFC_HDR_VERSION 1
+#define DFC_HDR_PREFIX_LEN 30
+#define DFC_HDR_MAX (DFC_HDR_PREFIX_LEN + PATH_MAX)
+
+#define DFC_OP_GET 1
+#define DFC_OP_LIST 2
+#define DFC_OP_PUT 3
+
+// get flags: which of its two stripe groups a server sends back. server i
+// holds group i first and group i + 1 second; no flag set means both
+#define DFC_GET_PIECE_FIRST 0x0001
+#define DFC_GET_PIECE_SECOND 0x0002
+#define DFC_GET_PIECE_BOTH (DFC_GET_PIECE_FIRST | DFC_GET_PIECE_SECOND)
+// get flag: only the pieces of stripe units chunk_offset to file_offset - 1
+// (by piece index). a server that ignores it sends them all, and the client
+// drops the rest
+#define DFC_GET_RANGE 0x0004
+
+// list flag: one page of the listing, in byte order: at most file_offset of
+// the names that start with the first chunk_offset bytes of fname (the
+// prefix) and sort at or after fname, or strictly after it with
+// DFC_LIST_AFTER (fname is then the cursor: the last name of the page
+// before). the response's file_size is 1 when more names follow the page. a
+// server that ignores it sends its whole listing, which the client filters
+// and takes as the last page
+#define DFC_LIST_PAGED 0x0001
+#define DFC_LIST_AFTER 0x0002
+
+// put flags: the frame holds compressed pieces. servers store it as-is; only
+// clients look inside
+#define DFC_PUT_COMPRESSED 0x0001
+
+// every request starts with a fixed prefix followed by name_len bytes of the
+// file name (no terminator). on the wire, in network byte order:
+//   magic:4 | version:1 | opcode:1 | flags:2 | name_len:2 | req_id:4 |
+//   chunk_offset:8 | file_offset:8 | fname:name_len
+//
+// req_id is echoed in the response frame, which is how responses to
+// pipelined requests are matched back to their files
+//
 // put: offset => where next file starts
-// get: offset => where next piece starts
-// list: offset => unused
+// get: offset => the stripe units wanted, with DFC_GET_RANGE
+// list: offset => the prefix length and page size, with DFC_LIST_PAGED
 typedef struct {
-  char cmd[SZ_CMD_MAX + 1];
+  uint8_t version;
+  uint8_t opcode;
+  uint16_t flags;
+  uint16_t name_len;
+  uint32_t req_id;
+  uint64_t chunk_offset;  // offset at which next chunk starts
+  uint64_t file_offset;   // offset at which next file starts
   char fname[PATH_MAX + 1];
-  size_t chunk_offset;  // offset at which next chunk starts
-  size_t file_offset;  // offset at which next file starts
 } DFCHeader;
 
 typedef struct {
@@ -25,24 +75,387 @@ typedef struct {
   unsigned short hash;
 } DFCCommand;
 
+#define DFC_FRAME_MAGIC 0x44464346u  // "DFCF"
+#define DFC_FRAME_VERSION 2  // 2: piece headers carry a CRC32C
+#define DFC_FRAME_HDR_LEN 28
+#define DFC_PIECE_HDR_LEN 28
+
+// piece flags
+#define DFC_PIECE_SECOND 0x1  // piece is from the group the server holds second
+#define DFC_PIECE_COMPRESSED 0x2  // len bytes of an lz block (see lz.h)
+#define DFC_PIECE_MANIFEST 0x4  // the file is a dedup manifest (see dedup.h)
+#define DFC_PIECE_ERASURE 0x8   // erasure-coded layout (see erasure.h)
+
+// an erasure-coded piece also carries its code, k data and m parity pieces
+// per stripe, in the flags' middle bytes. its parity pieces are the ones
+// with DFC_PIECE_SECOND, so servers hand them out as they would second copies
+#define DFC_PIECE_EC(k, m) ((uint32_t)(k) << 8 | (uint32_t)(m) << 16)
+#define DFC_PIECE_EC_K(flags) ((flags) >> 8 & 0xff)
+#define DFC_PIECE_EC_M(flags) ((flags) >> 16 & 0xff)
+
+#define DFC_STATUS_OK 0
+#define DFC_STATUS_NOT_FOUND 1
+
+// a frame is how pieces and listings travel: a put payload is one frame,
+// which the server stores as-is and hands back as its get response; a list
+// response is a frame without pieces. on the wire (network byte order):
+//   frame header | n_pieces x (piece header | piece bytes) | listing bytes
+// payload_len counts everything after the frame header, so a receiver knows
+// exactly where the frame ends without waiting for the peer to close. a
+// stored frame is returned with req_id rewritten to that of the get
+typedef struct {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t status;
+  uint16_t n_pieces;
+  uint32_t req_id;
+  uint64_t file_size;
+  uint64_t payload_len;
+} DFCFrameHeader;
+
+// files are cut into stripe units spread over groups by place_group (see
+// place.h): unit k belongs to group place_group(place, key, k), and group g
+// is stored on servers g and g - 1. each unit travels as one piece, whose
+// header is on the wire
+//   index:4 | flags:4 | offset:8 | len:8 | crc:4
+typedef struct {
+  uint32_t index;   // stripe unit number within the file
+  uint32_t flags;   // DFC_PIECE_*
+  uint64_t offset;  // where the piece starts in the file
+  uint64_t len;
+  uint32_t crc;  // CRC32C of the len bytes that follow, as they travel
+} DFCPieceHeader;
+
 typedef struct {
   char fname[PATH_MAX + 1];
   char **servers;
   size_t n_servers;
+  uint64_t stripe_unit;
+  int compress_level;  // 0: pieces travel raw
+  uint64_t dedup_chunk;  // average chunk of a dedup put, 0: put files whole
+  uint32_t name_cache;   // seconds NAMES_FILTER is trusted, 0: not used
+  uint32_t catalog_ttl;  // seconds CATALOG_FILE is trusted, 0: not used
+  uint8_t ec_k, ec_m;    // erasure code of a put, 0: adjacent pairs
+  uint32_t *weights;     // per server, NULL when dfc.conf gives none
+  int auto_weight;       // weigh servers by measured throughput instead
+  int hedge;             // get: ask the twins of a slow server as well
+  size_t n_cut;  // connections cut mid-response, not to be pooled again
 } DFCOperation;
 
+// where stripe units (or erasure stripes) live. each unit of a file is
+// hashed, with the file's 64-bit key, to one of the slots by jump consistent
+// hashing, and server g owns weight[g] consecutive slots, so it is the group
+// of its share of the units. growing the cluster moves only the units the
+// new slots take, all of them to the new group, and a lookup costs
+// O(log slots) whatever the cluster size. servers are appended to dfc.conf,
+// never renumbered, for this to hold; changing a weight moves the units of
+// the slots that shift
+typedef struct {
+  size_t n;          // groups, one per server
+  uint64_t n_slots;  // sum of the weights
+  uint64_t *ends;    // ends[g]: slots of groups 0 to g, NULL: all weigh 1
+  uint64_t max_pair;  // most slots of the two groups a server holds
+
+  // what the operation moved per server, to measure throughput with
+  uint64_t *moved;    // bytes
+  uint64_t *busy_ns;  // from the start of a round to its last byte
+} PlaceMap;
+
+// put: how one stripe unit travels, decided once per file and shared by the
+// two servers storing it
+typedef struct {
+  uint64_t zlen;  // compressed length, 0 when the unit goes raw
+  uint32_t zcrc;  // of the compressed bytes
+  char *zbuf;     // the compressed bytes, while cached
+  uint8_t refs;   // live holders that have yet to queue zbuf
+} UnitCodec;
+
+// get: which pieces of an erasure-coded file arrived intact, by index.
+// parity pieces wait in the operation's spool until the stripes missing data
+// have been rebuilt
+typedef struct {
+  uint8_t k, m;
+  uint64_t unit, n_units, n_stripes;
+  uint8_t *data, *parity;  // bitmaps, in one allocation
+  uint64_t spool_at;  // where the file's parity starts in the spool, 0
+                      // until the first parity piece
+} ErasureRx;
+
+// get: scratch file holding the parity pieces of every erasure-coded file
+// of a fetch, each in a region of its own
+typedef struct {
+  int fd;  // -1 until a parity piece arrives
+  uint64_t end;
+} ErasureSpool;
+
+// get: a piece that failed its checksum, and the group it came in as. the
+// server that sent it and the piece's flags tell the group, so asking the
+// other holder needs no knowledge of the layout it was put with
+typedef struct {
+  uint32_t index;
+  uint32_t group;
+} BadPiece;
+
+// get: a group of a file asked of both servers holding it, because the
+// first one was slow to answer. the first to start answering sends it
+typedef struct {
+  uint32_t group;
+  int32_t srv;  // -1 while neither has started
+} HedgeClaim;
+
+// one file of a (possibly multi-file) get or put
 typedef struct {
   char fname[PATH_MAX + 1];
+  int fd;
+  uint64_t base;  // where the file's bytes start in fd (a dedup chunk)
+  uint64_t file_size;
+  int64_t mtime;  // put: of the source in ns, to match journal entries to
+  int manifest;     // put: send as a dedup manifest; get: one arrived
+  size_t n_found;   // get: servers that returned the file
+  uint64_t n_recv;  // get: piece bytes written, to tell a complete file
+  BadPiece *bad_pieces;  // get: pieces that failed their checksum
+  size_t n_bad;
+  UnitCodec *units;  // put: per stripe unit, when compressing
+  uint64_t n_units;  // put: units planned so far (0 until the first header);
+                     // get: of a file resumed, cut with unit
+  ErasureRx *ec;     // get: NULL until an erasure-coded piece arrives
+  HedgeClaim *claims;  // get: groups hedged in the current round
+  size_t n_claims;
+
+  // get: a ranged fetch asks for stripe units [unit_lo, unit_hi) only,
+  // taking the file to be cut with unit, and leaves just bytes
+  // [range_off, range_off + range_len) in fd, from its start
+  int ranged;
+  int whole;  // it has to come whole (a manifest, or erasure-coded) first
+  uint64_t range_off, range_len;
+  uint64_t unit, unit_lo, unit_hi;
+  uint64_t unit_seen;  // the unit its pieces were cut with, when not unit
+  int has_head;        // the piece holding byte range_off starts before it,
+  uint64_t head;       // here, and is parked past the slice until the end
+
+  // get: the units fd already holds from an earlier try, by index, NULL for
+  // none (see journal.h)
+  uint8_t *have;
+  int restart;  // it changed since that try, and comes again from scratch
+  struct timespec end;  // when the last server finished with the file
+} FileTransfer;
+
+// what a put or get recorded as done. put entries name a server sent a
+// file's whole frame, get entries a piece that landed in the file
+typedef struct {
+  char *fname;
+  uint64_t size;    // of the file when the entry was made
+  int64_t mtime;    // put: of the source
+  uint32_t srv;     // put
+  uint32_t index;   // get: the piece's, and where its len raw bytes went
+  uint64_t offset, len;
+} JournalEntry;
+
+// an operation's journal (see journal.h): appended to as it goes, and with
+// the entries of the try it resumes, sorted by file
+typedef struct {
+  const char *path;
+  FILE *fp;
+  JournalEntry *entries;
+  size_t n_entries;
+} Journal;
+
+// a file as the catalog last recorded it (see catalog.h)
+typedef struct {
+  const char *name;  // name_len bytes, not NUL-terminated
+  size_t name_len;
+  uint64_t size;   // UINT64_MAX: not known, as while a put of it is going
+  uint64_t unit;   // the stripe unit it was cut with, 0: not known
+  uint64_t etag;   // put: the source's mtime in ns, 0: not known
+  int64_t stamp;   // when it was recorded
+  uint32_t flags;  // CATALOG_*
+  const uint8_t *holders;  // stride bytes: bit srv for each server last seen
+                           // with it, NULL for none
+} CatalogEntry;
+
+// the process's I/O buffers (see pool.h): the ones not in use wait on a
+// free list per size class for the next transfer to take them, linked
+// through their first bytes
+#define POOL_CLASSES 32  // a page << 31 is past any buffer asked for
+
+typedef struct {
+  char *free[POOL_CLASSES];
+  uint64_t in_use, cached;  // bytes, by class size
+  uint64_t peak;            // of in_use
+  uint64_t budget;          // for in_use, 0: none
+  size_t n_waits;           // times work held back for the budget
+} BufPool;
+
+// the local catalog (see catalog.h): CATALOG_FILE mapped as it was opened,
+// with an open-addressing table over its records in which the latest record
+// of a name wins. records made since go out through fp
+typedef struct {
+  char *map;
+  size_t map_len;
+  uint64_t *slots;  // where a record starts in map, 0: empty
+  size_t n_slots;   // a power of two, more than twice n_records
+  size_t n_records, n_live;
+  size_t n_servers, stride;
+  uint32_t ttl;
+  int64_t listed;  // when a whole listing last rebuilt it, 0: never
+  FILE *fp;        // appends, NULL until the first
+  FILE *relist;    // the catalog a whole listing is writing, NULL for none
+} Catalog;
+
+// list: one server's side of a merge. a name may be split between reads,
+// so its start is kept until the rest comes in
+typedef struct {
+  char partial[PATH_MAX + 1];
+  size_t n_partial;
+  char cursor[PATH_MAX + 1];  // the last name of its last page
+  size_t n_page;              // names in its last page
+  int more;                   // names follow its last page
+  int answered;
+  size_t *probe;  // entries whose size is asked of this server
+  size_t n_probe;
+} ListStream;
+
+// list: the names of every server's listing, each once, with a bitmap of
+// the servers that listed it. entries live in arrays grown by doubling, and
+// slots is an open-addressing table over them, so a name costs one probe
+// sequence and at most one copy however many servers list it. a listing
+// goes by pages, and entries leave the merge as soon as no server can add
+// to them, so it holds about a page per server
+typedef struct {
+  char *names;  // NUL-terminated, back to back
+  size_t len_names, cap_names;
+  size_t *at;          // per entry, where its name starts in names
+  uint64_t *hashes;    // per entry, hash64 of its name
+  uint8_t *holders;    // per entry, stride bytes: bit srv for each server
+  uint64_t *sizes;     // per entry once probed, UINT64_MAX: not known
+  size_t n, cap;       // entries
+  uint32_t *slots;     // entry + 1, 0: empty
+  size_t n_slots;      // a power of two, more than twice n
+  size_t n_servers, stride;
+  ListStream *streams;  // per server, while the listings come in
+  size_t *probes;       // the entries asked for their size, by server
+  const char *prefix;   // names without it are left out
+  size_t len_prefix;
+} ListMerge;
+
+// list: what a listing printed
+typedef struct {
+  size_t n_files, n_short;  // short: some pieces on no server that answered
+  int want_hashes;          // gather the hash64 of every name, as below
+  uint64_t *hashes;
+  size_t n_hashes, cap_hashes;
+  Catalog *catalog;  // rebuilt from a whole listing, NULL for none
+  const Catalog *layouts;  // how puts cut each file, NULL for no catalog
+} ListTally;
+
+// get: recent response latencies in microseconds, from a request falling
+// due (its predecessor answered) to its frame header arriving
+typedef struct {
+  uint32_t *us;  // a ring of HEDGE_SAMPLES (see hedge.h)
+  size_t n, next;
+  size_t n_new;  // added since loading
+} HedgeLog;
+
+typedef struct {
+  FileTransfer *files;
+  size_t n_files;
   int *sockfds;
+  uint16_t *piece_flags;  // per server, from plan_get; 0 leaves it out
   size_t n_servers;
+  DFCOperation *dfc_op;  // to reach servers outside the plan
+  PlaceMap *place;       // records throughput, NULL for none
+  HedgeLog *hedge;       // latencies for hedged reads, NULL for none
+  int ranged;            // the files want only their range (see get_range)
+  int resumed;           // some files have units from an earlier try
+  Journal *journal;      // records the pieces that land, NULL for none
+  Catalog *catalog;      // layouts to plan ranges by, NULL for none
 } GetOperation;
 
 typedef struct {
-  char fname[PATH_MAX + 1];
+  FileTransfer *files;
+  size_t n_files;
   int *sockfds;
   size_t n_servers;
+  uint64_t stripe_unit;
+  int compress_level;
+  uint64_t dedup_chunk;
+  uint8_t ec_k, ec_m;
+  PlaceMap *place;
+  Journal *journal;  // records the frames sent, NULL for none
 } PutOperation;
 
+// put: compression state shared by every connection of the operation
+typedef struct {
+  int level;
+  const int *sockfds;  // to tell which holders of a unit will send it
+  const PlaceMap *place;
+  UnitCodec *units;    // every file's table, in one allocation
+  size_t cached;       // bytes held in UnitCodec.zbuf
+  char *raw, *packed;  // scratch, cap bytes each (the largest unit)
+  size_t cap;
+  uint64_t n_units, n_packed;
+  uint64_t raw_bytes, wire_bytes;  // of the packed units
+} PutCodec;
+
+// get: a request with a file and groups of its own, rather than the
+// server's share of every file of the round
+typedef struct {
+  size_t file;
+  uint16_t flags;
+  uint64_t unit_lo, unit_hi;  // with DFC_GET_RANGE, when unit_hi > 0
+} GetRequest;
+
+typedef struct HedgeRound HedgeRound;
+
+// progress of an operation on one server connection: all requests are
+// pipelined on it and responses arrive in request order
+typedef struct {
+  FileTransfer *files;
+  size_t n_files;
+  size_t n_servers;
+  uint16_t piece_flags;  // get: DFC_GET_PIECE_* asked of this server
+  uint32_t *want;        // get: only these pieces (a retry), NULL for all
+  size_t n_want;
+  ErasureSpool *spool;   // get: where parity pieces go
+  size_t n_sent;         // requests queued
+  size_t n_done;         // responses received (get) or files sent (put)
+  uint64_t n_moved;      // frame bytes, to measure the server by
+  struct timespec last;  // when the last of them went or came
+  Journal *journal;      // NULL when nothing is recorded
+  size_t n_resumed;      // put: files it had from an earlier try
+
+  // get: requests past n_files are extra ones, in order: hedges sent for a
+  // slow server, or the units of a ranged fetch
+  GetRequest *extra;
+  size_t n_extra;
+  HedgeRound *hedge;  // NULL when reads are not hedged
+  struct timespec due;  // when the response awaited now fell due
+  uint16_t lost;        // groups of the current frame others sent first
+  int hedged;  // 1: requests before hedge_end were asked of its twins as
+               // well, -1: it has no twins to ask
+  size_t hedge_end;
+
+  // put: position in the stripe pipeline of file n_sent
+  const PlaceMap *place;
+  uint64_t stripe_unit;
+  uint64_t file_unit;   // stripe unit file n_sent is cut with
+  uint64_t file_key;    // and its placement key
+  uint64_t next_unit;   // next stripe unit to consider
+  uint64_t units_left;  // of this server's units, still to queue
+  int hdr_queued;
+  size_t n_in_flight;  // units queued but not yet sent
+  PutCodec *codec;     // NULL when pieces travel raw
+  uint8_t ec_k, ec_m;  // erasure code, 0 for adjacent pairs
+} ServerTask;
+
+// get: the hedging state of a round, which the event loop's tick works on
+struct HedgeRound {
+  GetOperation *get_op;
+  ServerTask *tasks;       // by server
+  struct DFCConn **conns;  // by server, NULL when not in the loop
+  uint64_t deadline_ns;    // how long a server has to start answering
+};
+
 #define N_CMD_SUPP sizeof(dfc_cmds) / sizeof(dfc_cmds[0])
 
 typedef struct {
@@ -51,4 +464,10 @@ typedef struct {
   ssize_t len_data;
 } SocketBuffer;
 
+// what one server answers to probes for the size it has n files stored with
+typedef struct {
+  uint64_t *sizes;  // UINT64_MAX: not stored, or not answered
+  size_t n;
+} SizeProbe;
+
 #endif  // TYPES_H_
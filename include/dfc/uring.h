@@ -0,0 +1,20 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <stddef.h>
+
+#include "dfc/event.h"
+
+#define URING_ENV "DFC_IO_BACKEND"     // "uring" opts in, anything else: epoll
+#define URING_BUFSZ (256 * 1024)       // registered buffer per direction
+#define URING_SQES_PER_CONN 4          // linked rx pair + linked tx pair
+#define URING_TX_IOV 64                // queued items one send covers
+#define URING_TX_COPY 4096             // items up to this are coalesced
+
+typedef struct DFCUring DFCUring;
+
+void uring_destroy(DFCUring *);
+DFCUring *uring_init(size_t);
+int uring_run(DFCEventLoop *);
+
+#endif  // URING_H_
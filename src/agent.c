@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dfc/agent.h"
+#include "dfc/dfc_util.h"
+#include "dfc/sk_util.h"
+
+// one connection to every configured server, lent to one CLI at a time
+typedef struct {
+  int *sockfds;
+  int client;  // unix socket of the CLI holding the set, -1 when idle
+} AgentSet;
+
+static volatile sig_atomic_t agent_stop;
+
+static void on_stop(int sig) {
+  (void)sig;
+  agent_stop = 1;
+}
+
+static void set_close(AgentSet *set, size_t n_servers) {
+  for (size_t i = 0; i < n_servers; ++i) {
+    if (set->sockfds[i] > 0) {
+      close(set->sockfds[i]);
+    }
+    set->sockfds[i] = 0;
+  }
+}
+
+// (re)connect the servers of an idle set that are not connected
+static void set_dial(DFCOperation *dfc_op, AgentSet *set) {
+  uint16_t want[dfc_op->n_servers];
+  size_t n_want;
+  int keepalive;
+
+  n_want = 0;
+  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+    want[i] = set->sockfds[i] <= 0;
+    n_want += want[i];
+  }
+
+  if (n_want == 0) {
+    return;
+  }
+
+  fill_sk_set(dfc_op, set->sockfds, want);
+
+  // let the kernel notice servers that vanish while the set sits idle
+  keepalive = 1;
+  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+    if (want[i] && set->sockfds[i] > 0) {
+      setsockopt(set->sockfds[i], SOL_SOCKET, SO_KEEPALIVE, &keepalive,
+                 sizeof(keepalive));
+    }
+  }
+}
+
+static int agent_listen(void) {
+  struct sockaddr_un addr;
+  int listen_fd, probe_fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, AGENT_SOCK, sizeof(addr.sun_path) - 1);
+
+  // a socket file nobody answers on is left over from an agent that died
+  if ((probe_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  if (connect(probe_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "[ERROR] an agent is already running on %s\n",
+            AGENT_SOCK);
+    close(probe_fd);
+    return -1;
+  }
+  close(probe_fd);
+  unlink(AGENT_SOCK);
+
+  if ((listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, AGENT_POOL_SETS * 4) == -1) {
+    perror("bind");
+    close(listen_fd);
+    return -1;
+  }
+
+  return listen_fd;
+}
+
+// one message of a lease, with n_fds descriptors attached
+static int lease_send(int client, const void *buf, size_t len, const int *fds,
+                      size_t n_fds) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cmsg_buf[CMSG_SPACE(sizeof(int) * AGENT_LEASE_FDS)];
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (void *)buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (n_fds > 0) {
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+  }
+
+  if ((cmsg = CMSG_FIRSTHDR(&msg)) != NULL) {
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+  }
+
+  return sendmsg(client, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+static void agent_accept(int listen_fd, DFCOperation *dfc_op, AgentSet *sets) {
+  DFCAgentLease lease;
+  DFCAgentServer servers[AGENT_LEASE_FDS];
+  int client, fds[AGENT_LEASE_FDS];
+  size_t n, n_fds;
+  AgentSet *set;
+
+  if ((client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+    if (errno != EINTR && errno != EAGAIN) {
+      perror("accept");
+    }
+    return;
+  }
+
+  set = NULL;
+  for (size_t i = 0; i < AGENT_POOL_SETS; ++i) {
+    if (sets[i].client == -1) {
+      set = &sets[i];
+      break;
+    }
+  }
+
+  memset(&lease, 0, sizeof(lease));
+  if (set != NULL) {
+    // servers dropped since the last health check get another chance
+    set_dial(dfc_op, set);
+
+    lease.n_servers = dfc_op->n_servers;
+    lease.stripe_unit = dfc_op->stripe_unit;
+    lease.compress_level = dfc_op->compress_level;
+    lease.dedup_chunk = dfc_op->dedup_chunk;
+    lease.name_cache = dfc_op->name_cache;
+    lease.catalog_ttl = dfc_op->catalog_ttl;
+    lease.ec_k = dfc_op->ec_k;
+    lease.ec_m = dfc_op->ec_m;
+    lease.auto_weight = dfc_op->auto_weight;
+    lease.hedge = dfc_op->hedge;
+  }
+
+  if (lease_send(client, &lease, sizeof(lease), NULL, 0) == -1) {
+    perror("sendmsg");
+    close(client);
+    return;
+  }
+
+  // the set's connections, AGENT_LEASE_FDS servers at a time
+  for (size_t at = 0; set != NULL && at < dfc_op->n_servers; at += n) {
+    n = dfc_op->n_servers - at < AGENT_LEASE_FDS ? dfc_op->n_servers - at
+                                                  : AGENT_LEASE_FDS;
+    n_fds = 0;
+    memset(servers, 0, sizeof(servers));
+    for (size_t i = 0; i < n; ++i) {
+      servers[i].weight = dfc_op->weights[at + i];
+      servers[i].alive = set->sockfds[at + i] > 0;
+      if (servers[i].alive) {
+        fds[n_fds++] = set->sockfds[at + i];
+      }
+    }
+
+    if (lease_send(client, servers, sizeof(DFCAgentServer) * n, fds,
+                   n_fds) == -1) {
+      perror("sendmsg");
+      close(client);
+      return;
+    }
+  }
+
+  if (set == NULL) {  // busy: the CLI goes direct
+    close(client);
+    return;
+  }
+
+  set->client = client;
+}
+
+// the CLI is done with its set: keep it if the CLI says the connections are
+// at a frame boundary, otherwise start the set over
+static void agent_reclaim(DFCOperation *dfc_op, AgentSet *set) {
+  DFCAgentRelease release;
+  ssize_t nb_recv;
+
+  nb_recv = recv(set->client, &release, sizeof(release), 0);
+  close(set->client);
+  set->client = -1;
+
+  if (nb_recv != sizeof(release) || !release.clean) {
+    fprintf(stderr, "[INFO] agent: client left without a clean release\n");
+    set_close(set, dfc_op->n_servers);
+  }
+
+  set_dial(dfc_op, set);
+}
+
+int agent_run(DFCOperation *dfc_op) {
+  AgentSet sets[AGENT_POOL_SETS];
+  struct pollfd pfds[1 + AGENT_POOL_SETS * (1 + dfc_op->n_servers)];
+  struct sigaction sa;
+  AgentSet *owner[1 + AGENT_POOL_SETS * (1 + dfc_op->n_servers)];
+  int server_of[1 + AGENT_POOL_SETS * (1 + dfc_op->n_servers)];
+  time_t last_health, now;
+  nfds_t n_pfds;
+  int listen_fd;
+  char probe;
+
+  if ((listen_fd = agent_listen()) == -1) {
+    return -1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (size_t i = 0; i < AGENT_POOL_SETS; ++i) {
+    if ((sets[i].sockfds = calloc(dfc_op->n_servers, sizeof(int))) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    sets[i].client = -1;
+    set_dial(dfc_op, &sets[i]);
+  }
+  last_health = time(NULL);
+
+  fprintf(stderr, "[INFO] agent: serving %zu servers on %s\n",
+          dfc_op->n_servers, AGENT_SOCK);
+
+  while (!agent_stop) {
+    // the listener, every leasing CLI, and every idle pooled connection: a
+    // server closing an idle connection shows up as readable
+    pfds[0].fd = listen_fd;
+    pfds[0].events = POLLIN;
+    n_pfds = 1;
+    for (size_t i = 0; i < AGENT_POOL_SETS; ++i) {
+      if (sets[i].client != -1) {
+        pfds[n_pfds].fd = sets[i].client;
+        pfds[n_pfds].events = POLLIN;
+        owner[n_pfds] = &sets[i];
+        server_of[n_pfds++] = -1;
+        continue;
+      }
+
+      for (size_t j = 0; j < dfc_op->n_servers; ++j) {
+        if (sets[i].sockfds[j] > 0) {
+          pfds[n_pfds].fd = sets[i].sockfds[j];
+          pfds[n_pfds].events = POLLIN | POLLRDHUP;
+          owner[n_pfds] = &sets[i];
+          server_of[n_pfds++] = (int)j;
+        }
+      }
+    }
+
+    if (poll(pfds, n_pfds, AGENT_HEALTH_SEC * 1000) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      perror("poll");
+      break;
+    }
+
+    for (nfds_t k = 1; k < n_pfds; ++k) {
+      if (pfds[k].revents == 0) {
+        continue;
+      }
+
+      if (server_of[k] == -1) {
+        agent_reclaim(dfc_op, owner[k]);
+        continue;
+      }
+
+      // an idle connection has nothing to say; anything readable is the
+      // server going away (or out of sync), so drop it for a redial
+      if (recv(pfds[k].fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) != -1 ||
+          errno != EAGAIN) {
+        fprintf(stderr, "[INFO] agent: server %d dropped an idle connection\n",
+                server_of[k]);
+        close(pfds[k].fd);
+        owner[k]->sockfds[server_of[k]] = -1;
+      }
+    }
+
+    // redial servers that were down or dropped
+    now = time(NULL);
+    if (now - last_health >= AGENT_HEALTH_SEC) {
+      for (size_t i = 0; i < AGENT_POOL_SETS; ++i) {
+        if (sets[i].client == -1) {
+          set_dial(dfc_op, &sets[i]);
+        }
+      }
+      last_health = now;
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      agent_accept(listen_fd, dfc_op, sets);
+    }
+  }
+
+  for (size_t i = 0; i < AGENT_POOL_SETS; ++i) {
+    if (sets[i].client != -1) {
+      close(sets[i].client);
+    }
+    set_close(&sets[i], dfc_op->n_servers);
+    free(sets[i].sockfds);
+  }
+
+  close(listen_fd);
+  unlink(AGENT_SOCK);
+
+  fprintf(stderr, "[INFO] agent: stopped\n");
+
+  return 0;
+}
+
+// one message of a lease; up to AGENT_LEASE_FDS descriptors attached to it
+// land in fds. returns the length of the message, or -1
+static ssize_t lease_recv(int agent_fd, void *buf, size_t len, int *fds,
+                          size_t *n_fds) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cmsg_buf[CMSG_SPACE(sizeof(int) * AGENT_LEASE_FDS)];
+  ssize_t nb_recv;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+
+  *n_fds = 0;
+  if ((nb_recv = recvmsg(agent_fd, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+    return -1;
+  }
+
+  if ((cmsg = CMSG_FIRSTHDR(&msg)) != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    *n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *n_fds);
+  }
+
+  return nb_recv;
+}
+
+// the operation a lease describes. it has no addresses: every server is
+// already connected or known to be down
+static DFCOperation *lease_op(const DFCAgentLease *lease, uint32_t *weights) {
+  DFCOperation *op;
+
+  if ((op = calloc(1, sizeof(DFCOperation))) == NULL ||
+      (op->servers = calloc(lease->n_servers, sizeof(char *))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  op->n_servers = lease->n_servers;
+  op->stripe_unit = lease->stripe_unit;
+  op->compress_level = lease->compress_level;
+  op->dedup_chunk = lease->dedup_chunk;
+  op->name_cache = lease->name_cache;
+  op->catalog_ttl = lease->catalog_ttl;
+  op->ec_k = lease->ec_k;
+  op->ec_m = lease->ec_m;
+  op->weights = weights;
+  op->auto_weight = lease->auto_weight;
+  op->hedge = lease->hedge;
+
+  return op;
+}
+
+// borrow a warm set of connections from a running agent, into a table of
+// *sockfds the caller frees. returns the unix socket to release them
+// through, or -1 (no agent, or all sets busy) for the caller to read
+// dfc.conf and connect itself
+int agent_lease(DFCOperation **dfc_op, int **sockfds) {
+  DFCAgentLease lease;
+  DFCAgentServer servers[AGENT_LEASE_FDS];
+  struct sockaddr_un addr;
+  int agent_fd, fds[AGENT_LEASE_FDS], *table;
+  uint32_t *weights;
+  size_t n, n_fds, k;
+
+  if ((agent_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, AGENT_SOCK, sizeof(addr.sun_path) - 1);
+
+  if (connect(agent_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(agent_fd);
+    return -1;
+  }
+
+  if (lease_recv(agent_fd, &lease, sizeof(lease), fds, &n_fds) !=
+          sizeof(lease) ||
+      lease.n_servers == 0) {
+    close(agent_fd);
+    return -1;
+  }
+
+  if ((table = calloc(lease.n_servers, sizeof(int))) == NULL ||
+      (weights = malloc(sizeof(uint32_t) * lease.n_servers)) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t at = 0; at < lease.n_servers; at += n) {
+    n = lease.n_servers - at < AGENT_LEASE_FDS ? lease.n_servers - at
+                                                : AGENT_LEASE_FDS;
+    if (lease_recv(agent_fd, servers, sizeof(DFCAgentServer) * n, fds,
+                   &n_fds) != (ssize_t)(sizeof(DFCAgentServer) * n)) {
+      for (size_t i = 0; i < n_fds; ++i) {
+        close(fds[i]);
+      }
+      for (size_t i = 0; i < at; ++i) {
+        if (table[i] > 0) {
+          close(table[i]);
+        }
+      }
+      free(table);
+      free(weights);
+      close(agent_fd);
+      return -1;
+    }
+
+    k = 0;
+    for (size_t i = 0; i < n; ++i) {
+      table[at + i] = servers[i].alive && k < n_fds ? fds[k++] : -1;
+      weights[at + i] = servers[i].weight;
+    }
+  }
+
+  *sockfds = table;
+  *dfc_op = lease_op(&lease, weights);
+
+  return agent_fd;
+}
+
+void agent_release(int agent_fd, int clean) {
+  DFCAgentRelease release;
+
+  release.clean = clean;
+  send(agent_fd, &release, sizeof(release), MSG_NOSIGNAL);
+  close(agent_fd);
+}
@@ -1,336 +1,2770 @@
-#include <assert.h>
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
-#include <pthread.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "dfc/types.h"
 #include "dfc/bloom_filter.h"
+#include "dfc/catalog.h"
+#include "dfc/crc32c.h"
+#include "dfc/dedup.h"
 #include "dfc/dfc_util.h"
+#include "dfc/erasure.h"
+#include "dfc/event.h"
+#include "dfc/hedge.h"
+#include "dfc/journal.h"
+#include "dfc/lz.h"
+#include "dfc/place.h"
+#include "dfc/pool.h"
 #include "dfc/sk_util.h"
 #include "dfc/async.h"
 
-#define MAX_GET (5 * 1024)
-#define MAX_LIST 64
+#define PIPELINE_DEPTH 32
+#define PUT_STRIPE_WINDOW 8  // stripe units queued per connection
+#define PUT_ZCACHE_MAX (64 * 1024 * 1024)  // compressed units kept for holders
+#define MOVE_BUF_LEN (1024 * 1024)
+#define LIST_SLOTS_MIN 1024
+#define LIST_NAMES_MIN (64 * 1024)
+#define LIST_PAGE_NAMES 1000  // asked of each server per round
+#define LIST_PROBE_UNIT ((uint64_t)UINT32_MAX + 1)  // past any piece index
+#define LIST_WHOLE_MAX ((uint64_t)1 << 30)  // a whole listing held at once
+
+static void mark_done(FileTransfer *file) {
+  struct timespec now;
 
-static pthread_mutex_t sk_mutex = PTHREAD_MUTEX_INITIALIZER;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-void *async_dfc_recv(void *arg) {
-  SocketBuffer *sk_buf;
+  if (now.tv_sec > file->end.tv_sec ||
+      (now.tv_sec == file->end.tv_sec && now.tv_nsec > file->end.tv_nsec)) {
+    file->end = now;
+  }
+}
 
-  sk_buf = (SocketBuffer *)arg;
+static uint64_t elapsed_ns(const struct timespec *from,
+                           const struct timespec *to) {
+  return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000 +
+         (uint64_t)to->tv_nsec - (uint64_t)from->tv_nsec;
+}
 
-  // recv data
-  pthread_mutex_lock(&sk_mutex);
-  sk_buf->data = dfc_recv(sk_buf->sockfd, &(sk_buf->len_data));
-  fprintf(stderr, "[%s] received %zd bytes over sfd=%d\n", __func__, sk_buf->len_data, sk_buf->sockfd);
-  pthread_mutex_unlock(&sk_mutex);
+// the file of request req, and the groups it asks for: past the task's own
+// files come its extra requests
+static FileTransfer *req_file(const ServerTask *task, size_t req,
+                              uint16_t *flags) {
+  if (req < task->n_files) {
+    *flags = task->piece_flags;
+    return &task->files[req];
+  }
 
-  return NULL;
+  *flags = task->extra[req - task->n_files].flags;
+  return &task->files[task->extra[req - task->n_files].file];
 }
 
-void *async_dfc_send(void *arg) {
-  SocketBuffer *sk_buf;
-  ssize_t bytes_sent;
+static void add_extra(ServerTask *task, size_t file, uint16_t flags,
+                      uint64_t unit_lo, uint64_t unit_hi) {
+  GetRequest *extra;
 
-  sk_buf = (SocketBuffer *)arg;
+  if ((extra = realloc(task->extra,
+                       sizeof(GetRequest) * (task->n_extra + 1))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  extra[task->n_extra].file = file;
+  extra[task->n_extra].flags = flags;
+  extra[task->n_extra].unit_lo = unit_lo;
+  extra[task->n_extra++].unit_hi = unit_hi;
+  task->extra = extra;
+}
 
-  // send data
-  if ((bytes_sent = dfc_send(sk_buf->sockfd, sk_buf->data, sk_buf->len_data)) !=
-      sk_buf->len_data) {
-    fprintf(stderr, "[ERROR] incomplete send\n");
+static void queue_get_request(DFCConn *conn, ServerTask *task) {
+  DFCHeader dfc_hdr;
+  char hdr_buf[DFC_HDR_MAX];
+  FileTransfer *file;
+  GetRequest *req;
+  uint16_t flags;
+
+  file = req_file(task, task->n_sent, &flags);
+  init_hdr(&dfc_hdr, DFC_OP_GET, file->fname);
+  dfc_hdr.req_id = task->n_sent;
+  dfc_hdr.flags = flags;
+  req = task->n_sent >= task->n_files ? &task->extra[task->n_sent -
+                                                      task->n_files]
+                                      : NULL;
+  if (req != NULL && req->unit_hi > 0) {
+    dfc_hdr.flags |= DFC_GET_RANGE;
+    dfc_hdr.chunk_offset = req->unit_lo;
+    dfc_hdr.file_offset = req->unit_hi;
+  } else if (file->ranged) {
+    dfc_hdr.flags |= DFC_GET_RANGE;
+    dfc_hdr.chunk_offset = file->unit_lo;
+    dfc_hdr.file_offset = file->unit_hi;
   }
 
-#ifdef DEBUG
-  fprintf(stderr, "[INFO] sent %zd bytes over socket %d (expected=%zd)\n",
-          bytes_sent, sk_buf->sockfd, sk_buf->len_data);
-  fflush(stderr);
-#endif
+  ev_queue_buf(conn, hdr_buf, encode_hdr(&dfc_hdr, hdr_buf), NULL);
+  ev_expect(conn, 1);
+  if (task->n_sent == task->n_done) {
+    clock_gettime(CLOCK_MONOTONIC, &task->due);
+  }
+  task->n_sent++;
+}
 
-  return NULL;
+// the bytes of a ranged file's range that the file has
+static uint64_t range_bytes(const FileTransfer *file) {
+  if (file->range_off >= file->file_size) {
+    return 0;
+  }
+
+  return file->range_len < file->file_size - file->range_off
+             ? file->range_len
+             : file->file_size - file->range_off;
 }
 
-void *get_handle(void *arg) {
-  GetOperation *get_op = (GetOperation *)arg;
+// a ranged fetch keeps the pieces of its units, each written where its
+// bytes fall in the slice. the one holding the slice's first byte starts
+// before it, so it is parked past everything else until the fetch is over
+static int range_piece(DFCConn *conn, FileTransfer *file,
+                       const DFCPieceHeader *piece_hdr) {
+  if (piece_hdr->flags & (DFC_PIECE_MANIFEST | DFC_PIECE_ERASURE)) {
+    file->whole = 1;
+    return 0;
+  }
 
-  unsigned int srv_alloc_start;
-  size_t srv_id;
+  if (piece_hdr->index < file->unit_lo || piece_hdr->index >= file->unit_hi) {
+    return 0;
+  }
 
-  DFCHeader dfc_hdr;
-  SocketBuffer hdr_sk_buf[get_op->n_servers];
-  SocketBuffer rcv_sk_buf[get_op->n_servers];
-  int ran[get_op->n_servers];
+  // cut with another unit: the range is asked for again once it is known.
+  // a raw first unit tells by its length; a compressed one cannot, and
+  // leaves the range short
+  if (piece_hdr->offset != piece_hdr->index * file->unit) {
+    if (piece_hdr->index > 0) {
+      file->unit_seen = piece_hdr->offset / piece_hdr->index;
+    }
+    return 0;
+  }
+  if (piece_hdr->index == 0 && !(piece_hdr->flags & DFC_PIECE_COMPRESSED) &&
+      piece_hdr->len != (file->unit < file->file_size ? file->unit
+                                                      : file->file_size)) {
+    file->unit_seen = piece_hdr->len;
+    return 0;
+  }
 
-  srv_alloc_start = hash_djb2(get_op->fname) % get_op->n_servers;
+  if (piece_hdr->offset >= file->range_off) {
+    conn->rx_base = -(off_t)file->range_off;
+  } else {
+    file->has_head = 1;
+    file->head = piece_hdr->offset;
+    conn->rx_base = (off_t)(range_bytes(file) + file->unit - file->head);
+  }
 
-  for (size_t i = 0; i < get_op->n_servers; ++i) {
-    srv_id = (srv_alloc_start + i) % get_op->n_servers;
+  return 1;
+}
 
-    if (get_op->sockfds[srv_id] <= 0) {  // acceptable, decided beforehand
-      continue;
-    }
+// up to PIPELINE_DEPTH requests in flight
+static void fill_pipeline(DFCConn *conn, ServerTask *task) {
+  while (task->n_sent < task->n_files + task->n_extra &&
+         task->n_sent - task->n_done < PIPELINE_DEPTH) {
+    queue_get_request(conn, task);
+  }
+}
 
-    if ((hdr_sk_buf[srv_id].data = alloc_buf(sizeof(DFCHeader))) == NULL) {
-      fprintf(stderr, "[FATAL] out of memory\n");
-      exit(EXIT_FAILURE);
-    }
+static int get_on_piece(DFCConn *conn, const DFCPieceHeader *piece_hdr) {
+  ServerTask *task = (ServerTask *)conn->ctx;
+  FileTransfer *file;
+  uint16_t flags;
+  off_t base;
+  int fd;
 
-    // form request
-    memset(&dfc_hdr, 0, sizeof(DFCHeader));
-    strncpy(dfc_hdr.cmd, "get", sizeof(dfc_hdr.cmd));
-    strncpy(dfc_hdr.fname, get_op->fname, sizeof(dfc_hdr.fname));
-    memcpy(hdr_sk_buf[srv_id].data, &dfc_hdr, sizeof(DFCHeader));
+  // a group the other holder started sending first
+  if (task->lost & (piece_hdr->flags & DFC_PIECE_SECOND
+                        ? DFC_GET_PIECE_SECOND
+                        : DFC_GET_PIECE_FIRST)) {
+    return 0;
+  }
 
-    // send request
-    hdr_sk_buf[srv_id].len_data = sizeof(dfc_hdr);
-    hdr_sk_buf[srv_id].sockfd = get_op->sockfds[srv_id];
-    if (write(hdr_sk_buf[srv_id].sockfd, hdr_sk_buf[srv_id].data, hdr_sk_buf[srv_id].len_data) == -1) {
-      perror("write");
-      exit(EXIT_FAILURE);
+  file = req_file(task, task->n_done, &flags);
+  if (file->ranged && !range_piece(conn, file, piece_hdr)) {
+    return 0;
+  }
+
+  // in the file since an earlier try
+  if (file->have != NULL &&
+      (piece_hdr->index >= file->n_units || file->have[piece_hdr->index])) {
+    return 0;
+  }
+
+  if (piece_hdr->flags & DFC_PIECE_MANIFEST) {
+    file->manifest = 1;
+  }
+
+  // parity is spooled until its stripe is known to need it
+  if (piece_hdr->flags & DFC_PIECE_ERASURE) {
+    if (task->spool == NULL ||
+        (fd = erasure_on_piece(task->spool, file, piece_hdr, &base)) == -1) {
+      return 0;
     }
+    conn->rx_piece_fd = fd;
+    conn->rx_base = base;
+    return 1;
+  }
 
-    ran[srv_id] = 1;
+  if (task->want == NULL) {
+    return 1;
   }
 
-  for (size_t i = 0; i < get_op->n_servers; ++i) {
-    srv_id = (srv_alloc_start + i) % get_op->n_servers;
-    // recv response
-    rcv_sk_buf[srv_id].sockfd = get_op->sockfds[srv_id];
-    if ((rcv_sk_buf[srv_id].data = dfc_recv(rcv_sk_buf[srv_id].sockfd,
-                                            &(rcv_sk_buf[srv_id].len_data)))
-         == NULL) {
-      exit(EXIT_FAILURE);
+  // a retry keeps each piece it asked for once, and crosses it off
+  for (size_t i = 0; i < task->n_want; ++i) {
+    if (task->want[i] == piece_hdr->index) {
+      task->want[i] = task->want[--task->n_want];
+      return 1;
     }
   }
 
-  // reassemble
-  size_t chunk_offset, next;
-  size_t chunk_sizes[get_op->n_servers];
-  char *chunks[get_op->n_servers];
-  for (size_t i = 0; i < get_op->n_servers; ++i) {
-    srv_id = (srv_alloc_start + i) % get_op->n_servers;
-    next = (srv_id + 1) % get_op->n_servers;
+  return 0;
+}
+
+// a piece is in place: an erasure-coded one now counts for its stripe, and
+// the journal has it unless it is part of a range, a manifest or an
+// erasure-coded stripe, which a resumed get fetches whole
+static void get_on_piece_done(DFCConn *conn, const DFCPieceHeader *piece_hdr,
+                              uint64_t len) {
+  ServerTask *task = (ServerTask *)conn->ctx;
+  FileTransfer *file;
+  uint16_t flags;
+
+  file = req_file(task, task->n_done, &flags);
+  if (piece_hdr->flags & DFC_PIECE_ERASURE) {
+    erasure_piece_done(file, piece_hdr);
+  }
+  if (task->journal != NULL && !file->ranged &&
+      !(piece_hdr->flags & (DFC_PIECE_MANIFEST | DFC_PIECE_ERASURE))) {
+    journal_piece(task->journal, file, piece_hdr, len);
+  }
+}
+
+static void add_bad_piece(FileTransfer *file, uint32_t index, size_t group) {
+  BadPiece *bad;
+
+  if ((bad = realloc(file->bad_pieces,
+                     sizeof(BadPiece) * (file->n_bad + 1))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  bad[file->n_bad].index = index;
+  bad[file->n_bad++].group = group;
+  file->bad_pieces = bad;
+}
+
+static void get_on_bad_piece(DFCConn *conn, const DFCPieceHeader *piece_hdr) {
+  ServerTask *task = (ServerTask *)conn->ctx;
+  FileTransfer *file;
+  uint16_t flags;
 
-    if (ran[srv_id]) {
-      memcpy(&chunk_offset, rcv_sk_buf[srv_id].data, sizeof(size_t));
+  file = req_file(task, task->n_done, &flags);
+  fprintf(stderr, "[ERROR] %s: piece %u from server %zu failed its checksum\n",
+          file->fname, piece_hdr->index, conn->srv_id);
 
-      fprintf(stderr, "current pieces = %zu and %zu\n", srv_id, next);
-      fprintf(stderr, "chunk offset = %zu\n", chunk_offset);
+  // left unmarked, and rebuilt from the rest of its stripe instead
+  if (piece_hdr->flags & DFC_PIECE_ERASURE) {
+    return;
+  }
+
+  // server g sends group g first and group g + 1 second
+  add_bad_piece(file, piece_hdr->index,
+                piece_hdr->flags & DFC_PIECE_SECOND
+                    ? (conn->srv_id + 1) % task->n_servers
+                    : conn->srv_id);
+}
 
-      chunks[srv_id] = rcv_sk_buf[srv_id].data + sizeof(size_t);
-      chunk_sizes[srv_id] = chunk_offset;
+// group of the file srv was asked for with flag: the first holder of a group
+// shares its number
+static size_t flag_group(size_t srv, uint16_t flag, size_t n) {
+  return flag == DFC_GET_PIECE_FIRST ? srv : (srv + 1) % n;
+}
 
-      chunks[next] = rcv_sk_buf[srv_id].data + sizeof(size_t) + chunk_offset;
-      chunk_sizes[next] = rcv_sk_buf[srv_id].len_data - sizeof(size_t) - chunk_offset;
+static HedgeClaim *find_claim(FileTransfer *file, size_t group) {
+  for (size_t i = 0; i < file->n_claims; ++i) {
+    if (file->claims[i].group == group) {
+      return &file->claims[i];
     }
   }
 
-  int fd;
-  ssize_t bytes_written;
+  return NULL;
+}
 
-  if ((fd = open(get_op->fname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IWUSR | S_IRUSR)) == -1) {
-    perror("open");
-    exit(EXIT_FAILURE);
+// the groups of a frame from srv that another server started sending first;
+// the rest, when hedged, are srv's from now on
+static uint16_t claim_groups(FileTransfer *file, size_t srv, uint16_t flags,
+                             size_t n, int take) {
+  HedgeClaim *claim;
+  uint16_t lost;
+
+  lost = 0;
+  for (uint16_t flag = DFC_GET_PIECE_FIRST; flag <= DFC_GET_PIECE_SECOND;
+       flag <<= 1) {
+    if (!(flags & flag) ||
+        (claim = find_claim(file, flag_group(srv, flag, n))) == NULL) {
+      continue;
+    }
+
+    if (claim->srv == -1 && take) {
+      claim->srv = (int32_t)srv;
+    } else if (claim->srv != -1 && (size_t)claim->srv != srv) {
+      lost |= flag;
+    }
   }
 
-  for (size_t i = 0; i < get_op->n_servers; ++i) {
-    if ((bytes_written = write(fd, chunks[i], chunk_sizes[i])) == -1) {
-      perror("write");
-      exit(EXIT_FAILURE);
+  return lost;
+}
+
+static int get_on_frame(DFCConn *conn, const DFCFrameHeader *frame_hdr) {
+  ServerTask *task = (ServerTask *)conn->ctx;
+  FileTransfer *file;
+  struct timespec now;
+  uint16_t flags;
+
+  if (frame_hdr->req_id != task->n_done) {
+    ev_fail(conn, "response out of order");
+    return -1;
+  }
+
+  if (task->hedge != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hedge_add(task->hedge->get_op->hedge, elapsed_ns(&task->due, &now) / 1000);
+  }
+
+  file = req_file(task, frame_hdr->req_id, &flags);
+  task->lost = 0;
+  if (frame_hdr->status != DFC_STATUS_OK) {
+    fprintf(stderr, "[%s] %s not found on server %zu\n", __func__, file->fname,
+            conn->srv_id);
+    return -1;
+  }
+
+  if (file->n_claims > 0 &&
+      (task->lost = claim_groups(file, conn->srv_id, flags, task->n_servers,
+                                 1)) == flags) {
+    return -1;
+  }
+
+  // a resumed file that changed since is fetched again from scratch
+  if (file->have != NULL && frame_hdr->file_size != file->file_size) {
+    file->restart = 1;
+    return -1;
+  }
+
+  // the first server to answer creates and sizes the output file, unless it
+  // is a dedup chunk headed for a file that is already open, or one resumed
+  if (file->n_found++ == 0) {
+    file->file_size = frame_hdr->file_size;
+  }
+  if (file->fd == -1) {
+    if ((file->fd = open(file->fname,
+                         O_RDWR | O_CREAT | (file->have != NULL ? 0 : O_TRUNC),
+                         S_IWUSR | S_IRUSR)) == -1) {
+      // get_handle finds the file never opened and counts it failed
+      fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, file->fname,
+              strerror(errno));
+      ev_fail(conn, "output file would not open");
+      return -1;
     }
 
-    fprintf(stderr, "[%s] wrote %zd bytes to %s\n", __func__, bytes_written, get_op->fname);
+    if (file->file_size > 0 && !file->ranged &&
+        fallocate(file->fd, 0, 0, file->file_size) == -1 &&
+        errno != EOPNOTSUPP) {
+      perror("fallocate");
+    }
   }
+  conn->rx_base = file->base;
 
-  if (close(fd) == -1) {
-    perror("close");
-    exit(EXIT_FAILURE);
+  return file->fd;
+}
+
+static void get_on_frame_done(DFCConn *conn, const DFCFrameHeader *frame_hdr) {
+  ServerTask *task = (ServerTask *)conn->ctx;
+  FileTransfer *file;
+  uint16_t flags;
+
+  file = req_file(task, frame_hdr->req_id, &flags);
+  if (frame_hdr->status == DFC_STATUS_OK) {
+    file->n_recv += conn->rx_file_bytes;
+    mark_done(file);
+    task->n_moved += conn->rx_file_bytes;
+    clock_gettime(CLOCK_MONOTONIC, &task->last);
   }
 
-  for (size_t i = 0; i < get_op->n_servers; ++i) {
-    if (hdr_sk_buf[i].data != NULL)
-      free(hdr_sk_buf[i].data);
-    
-    if (rcv_sk_buf[i].data != NULL)
-      free(rcv_sk_buf[i].data);
+  task->n_done++;
+  task->lost = 0;
+  if (task->n_sent > task->n_done) {
+    clock_gettime(CLOCK_MONOTONIC, &task->due);
   }
 
-  return NULL;
+  // keep the pipeline PIPELINE_DEPTH deep
+  if (task->n_sent < task->n_files + task->n_extra) {
+    queue_get_request(conn, task);
+  }
 }
 
-void *list_handle(void *arg) {
-  int list_fd = *(int *)arg;
+static const DFCConnHandler get_handler = {
+    .on_frame = get_on_frame,
+    .on_piece = get_on_piece,
+    .on_piece_done = get_on_piece_done,
+    .on_bad_piece = get_on_bad_piece,
+    .on_frame_done = get_on_frame_done,
+};
+
+// ask srv_id for one group of the file once more, keeping only the pieces in
+// want. returns -1 when the connection failed, otherwise the pieces it did
+// not send are left in want
+static int get_retry(GetOperation *get_op, FileTransfer *file, size_t srv_id,
+                     size_t group, uint32_t *want, size_t *n_want) {
+  DFCEventLoop loop;
+  DFCConn *conn;
+  ServerTask task;
+  int status;
+
+  if (ev_init(&loop, 1, RCVTIMEO_SEC * 1000) == -1) {
+    return -1;
+  }
 
-  DFCHeader dfc_hdr;
-  SocketBuffer hdr_sk_buf;
-  SocketBuffer rcv_sk_buf;
+  memset(&task, 0, sizeof(ServerTask));
+  task.files = file;
+  task.n_files = 1;
+  task.n_servers = get_op->n_servers;
+  task.piece_flags =
+      srv_id == group ? DFC_GET_PIECE_FIRST : DFC_GET_PIECE_SECOND;
+  task.want = want;
+  task.n_want = *n_want;
+  task.journal = get_op->journal;
+
+  if ((conn = ev_add_conn(&loop, get_op->sockfds[srv_id], srv_id,
+                          &get_handler, &task)) == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  queue_get_request(conn, &task);
 
-  pthread_t rcv_tid;
-  pthread_t snd_tid;
+  status = ev_run(&loop);
+  ev_destroy(&loop);
 
-  if ((hdr_sk_buf.data = alloc_buf(sizeof(DFCHeader))) == NULL) {
+  *n_want = task.n_want;
+
+  return status;
+}
+
+// every piece that failed its checksum comes again from the other server
+// holding its group. the plan asked server g for group g (first) or server
+// g - 1 for it (second), so the other holder is the one not asked
+static void get_refetch(GetOperation *get_op, FileTransfer *file) {
+  BadPiece *bad;
+  uint32_t *want;
+  size_t n_bad, n_want, n, group, asked, other;
+
+  bad = file->bad_pieces;
+  n_bad = file->n_bad;
+  file->bad_pieces = NULL;
+  file->n_bad = 0;
+  n = get_op->n_servers;
+
+  if ((want = malloc(sizeof(uint32_t) * n_bad)) == NULL) {
     fprintf(stderr, "[FATAL] out of memory\n");
     exit(EXIT_FAILURE);
   }
 
-  // form request
-  memset(&dfc_hdr, 0, sizeof(DFCHeader));
-  strncpy(dfc_hdr.cmd, "list", sizeof(dfc_hdr.cmd));
-  memcpy(hdr_sk_buf.data, &dfc_hdr, sizeof(DFCHeader));
+  for (size_t i = 0; i < n_bad; ++i) {
+    group = bad[i].group;
 
-  // send request
-  hdr_sk_buf.len_data = sizeof(dfc_hdr);
-  hdr_sk_buf.sockfd = list_fd;
-  if (pthread_create(&snd_tid, NULL, async_dfc_send, &hdr_sk_buf) < 0) {
-    fprintf(stderr, "[%s] could not create thread\n", __func__);
-    exit(EXIT_FAILURE);
+    // one request per group, for all of its bad pieces
+    size_t j = 0;
+    while (j < i && bad[j].group != group) {
+      j++;
+    }
+    if (j < i) {
+      continue;
+    }
+
+    n_want = 0;
+    for (j = i; j < n_bad; ++j) {
+      if (bad[j].group == group) {
+        want[n_want++] = bad[j].index;
+      }
+    }
+
+    asked = get_op->piece_flags[group] & DFC_GET_PIECE_FIRST
+                ? group
+                : (group + n - 1) % n;
+    other = asked == group ? (group + n - 1) % n : group;
+
+    // the plan left the other holder unconnected
+    if (other != asked && get_op->sockfds[other] == 0) {
+      uint16_t dial[n];
+
+      memset(dial, 0, sizeof(dial));
+      dial[other] = 1;
+      fill_sk_set(get_op->dfc_op, get_op->sockfds, dial);
+      if (get_op->sockfds[other] > 0) {
+        set_timeout(get_op->sockfds[other], RCVTIMEO_SEC, RCVTIMEO_USEC);
+      }
+    }
+
+    if (other != asked && get_op->sockfds[other] > 0) {
+      fprintf(stderr, "[INFO] %s: asking server %zu for group %zu again\n",
+              file->fname, other, group);
+
+      // whatever a failed retry delivered cannot be told apart
+      if (get_retry(get_op, file, other, group, want, &n_want) == -1) {
+        n_want = 0;
+        for (j = i; j < n_bad; ++j) {
+          if (bad[j].group == group) {
+            want[n_want++] = bad[j].index;
+          }
+        }
+      }
+    }
+
+    // no second copy to be had
+    for (j = 0; j < n_want; ++j) {
+      add_bad_piece(file, want[j], group);
+    }
   }
 
-  rcv_sk_buf.sockfd = list_fd;
-  if (pthread_create(&rcv_tid, NULL, async_dfc_recv, &rcv_sk_buf) < 0) {
-    fprintf(stderr, "[%s] failed to create thread\n", __func__);
-    exit(EXIT_FAILURE);
+  free(want);
+  free(bad);
+}
+
+// what each server of a round moved, and how long it took from the start
+static void add_measured(PlaceMap *place, const ServerTask *tasks,
+                         const struct timespec *start) {
+  for (size_t i = 0; i < place->n; ++i) {
+    if (tasks[i].n_moved == 0) {
+      continue;
+    }
+
+    place->moved[i] += tasks[i].n_moved;
+    place->busy_ns[i] += elapsed_ns(start, &tasks[i].last);
   }
+}
+
+// the other holder of the group srv was asked for with flag: server srv - 1
+// holds group srv second, server srv + 1 holds group srv + 1 first
+static size_t twin_of(size_t srv, uint16_t flag, size_t n) {
+  return flag == DFC_GET_PIECE_FIRST ? (srv + n - 1) % n : (srv + 1) % n;
+}
+
+// which twin holds each group srv was asked for, and as what; 0 when one of
+// them is down, slow itself, or srv
+static int twin_flags(const HedgeRound *round, size_t srv, uint16_t *flags) {
+  size_t n, t;
 
-  pthread_join(snd_tid, NULL);
-  pthread_join(rcv_tid, NULL);
+  n = round->get_op->n_servers;
+  memset(flags, 0, sizeof(uint16_t) * n);
 
-  size_t len_entry;
-  for (size_t i = 0; i < (size_t)rcv_sk_buf.len_data; ) {
-    len_entry = strlen(rcv_sk_buf.data + i) + 1;
-    printf("%s\n", rcv_sk_buf.data + i);
-    i += len_entry;
+  for (uint16_t flag = DFC_GET_PIECE_FIRST; flag <= DFC_GET_PIECE_SECOND;
+       flag <<= 1) {
+    if (!(round->tasks[srv].piece_flags & flag)) {
+      continue;
+    }
+
+    t = twin_of(srv, flag, n);
+    if (t == srv || round->conns[t] == NULL || round->conns[t]->failed ||
+        round->tasks[t].hedged == 1) {
+      return 0;
+    }
+    flags[t] |= DFC_GET_PIECE_BOTH & ~flag;
   }
 
-  return NULL;
+  return 1;
 }
 
-void *put_handle(void *arg) {
-  PutOperation *put_op = (PutOperation *)arg;
-  SocketBuffer data_sk_buf[put_op->n_servers];
-  SocketBuffer hdr_sk_buf[put_op->n_servers];
-  DFCHeader dfc_hdr;
-  pthread_t send_tids[put_op->n_servers];
-  int ran_threads[put_op->n_servers];
-  char **file_pieces, *file_content, *pair;
-  size_t len_pair, srv_id, chunk_sizes[put_op->n_servers];
-  ssize_t len_file;
-  unsigned srv_alloc_start;
+// ask srv's twins for its files from to to. with claim, srv was asked for
+// them as well, and each group goes to whichever server starts on it first
+static void ask_twins(HedgeRound *round, size_t srv, const uint16_t *flags,
+                      size_t from, size_t to, int claim) {
+  ServerTask *task, *twin;
+  FileTransfer *file;
+  HedgeClaim *claims;
+  size_t n;
+
+  n = round->get_op->n_servers;
+  task = &round->tasks[srv];
+
+  for (size_t f = from; claim && f < to; ++f) {
+    file = &task->files[f];
+    if ((claims = realloc(file->claims,
+                          sizeof(HedgeClaim) * (file->n_claims + 2))) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    file->claims = claims;
+
+    for (uint16_t flag = DFC_GET_PIECE_FIRST; flag <= DFC_GET_PIECE_SECOND;
+         flag <<= 1) {
+      if (task->piece_flags & flag) {
+        claims[file->n_claims].group = flag_group(srv, flag, n);
+        claims[file->n_claims++].srv = -1;
+      }
+    }
+  }
+
+  for (size_t t = 0; t < n && from < to; ++t) {
+    if (flags[t] == 0) {
+      continue;
+    }
 
-  srv_alloc_start = hash_djb2(put_op->fname) % put_op->n_servers;
+    twin = &round->tasks[t];
+    for (size_t f = from; f < to; ++f) {
+      add_extra(twin, f, flags[t], 0, 0);
+    }
+    fill_pipeline(round->conns[t], twin);
+  }
+}
 
-  if ((file_content = read_file(put_op->fname, &len_file)) == NULL) {
-    fprintf(stderr, "[ERROR] failed to read %s: %s\n", put_op->fname, strerror(errno));
-    return NULL;
+// a hedged server whose twins started every response it still owes first
+static int hedge_lost(const ServerTask *task, size_t srv) {
+  for (size_t r = task->n_done; r < task->n_sent; ++r) {
+    if (claim_groups(&task->files[r], srv, task->piece_flags, task->n_servers,
+                     0) != task->piece_flags) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// between waits: a server that has kept a response waiting past the
+// deadline has the requests it holds asked of its twins as well, and keeps
+// going. one its twins overtake on all of them is stuck: it is cut off, and
+// the twins get the rest of its files
+static void hedge_tick(DFCEventLoop *loop, void *ctx) {
+  HedgeRound *round = (HedgeRound *)ctx;
+  uint16_t flags[round->get_op->n_servers], *plan;
+  struct timespec now;
+  ServerTask *task;
+  DFCConn *conn;
+  uint64_t waited;
+  size_t srv, n;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  plan = round->get_op->piece_flags;
+  n = round->get_op->n_servers;
+
+  for (size_t i = 0; i < loop->n_conns; ++i) {
+    conn = &loop->conns[i];
+    task = (ServerTask *)conn->ctx;
+    srv = conn->srv_id;
+    if (conn->failed || conn->n_expected == 0) {
+      continue;
+    }
+
+    if (task->hedged == 1 && task->n_done >= task->hedge_end) {
+      task->hedged = 0;  // caught up
+    }
+
+    if (task->hedged == 1) {
+      if (!hedge_lost(task, srv) || !twin_flags(round, srv, flags)) {
+        continue;
+      }
+
+      fprintf(stderr, "[INFO] server %zu was overtaken by its twins\n", srv);
+      ev_cancel(conn);
+      ask_twins(round, srv, flags, task->n_sent, task->n_files, 0);
+
+      // later rounds of the operation go to the twins directly
+      for (uint16_t flag = DFC_GET_PIECE_FIRST; flag <= DFC_GET_PIECE_SECOND;
+           flag <<= 1) {
+        if (task->piece_flags & flag) {
+          plan[srv] &= ~flag;
+          plan[twin_of(srv, flag, n)] |= DFC_GET_PIECE_BOTH & ~flag;
+        }
+      }
+      continue;
+    }
+
+    // only a server's own requests are hedged, and only before the response
+    // has started. one with extra requests to send is nobody's to hedge
+    if (task->hedged == -1 || task->n_extra > 0 ||
+        task->n_done >= task->n_files || conn->rx_state != RX_FRAME_HDR ||
+        conn->rx_hdr_have > 0 ||
+        (waited = elapsed_ns(&task->due, &now)) < round->deadline_ns) {
+      continue;
+    }
+
+    if (!twin_flags(round, srv, flags)) {
+      task->hedged = -1;
+      continue;
+    }
+
+    fprintf(stderr,
+            "[INFO] server %zu has not answered in %.1f ms, asking its "
+            "twins\n",
+            srv, (double)waited / 1e6);
+    task->hedged = 1;
+    task->hedge_end = task->n_sent;
+    ask_twins(round, srv, flags, task->n_done, task->n_sent, 1);
+  }
+}
+
+// the server the plan asks for unit u of the file with key, and as which of
+// its groups: group g from server g when asked for it first, otherwise from
+// server g - 1
+static size_t plan_server(const GetOperation *get_op, const uint16_t *flags,
+                          uint64_t key, uint64_t u, uint16_t *flag) {
+  size_t g;
+
+  g = place_group(get_op->place, key, u);
+  if (flags[g] & DFC_GET_PIECE_FIRST) {
+    *flag = DFC_GET_PIECE_FIRST;
+    return g;
+  }
+
+  *flag = DFC_GET_PIECE_SECOND;
+  return (g + get_op->n_servers - 1) % get_op->n_servers;
+}
+
+// a narrowed round asks each server for just what it holds of each file:
+// the units of a ranged file's range, the units a resumed file is missing,
+// and the whole share of any other file (unless the round is ranged, when
+// those come afterwards). a unit whose group is not in flags is left out,
+// as when a retry asks only a failed server's twins. once every group in
+// flags has come up a range far longer than the file stops there. a resumed
+// file missing nothing is still asked for an empty span, to have its size
+// checked
+static void queue_narrowed(GetOperation *get_op, ServerTask *tasks,
+                           DFCConn **conns, FileTransfer *files,
+                           size_t n_files, const uint16_t *flags) {
+  uint16_t want[get_op->n_servers], flag;
+  uint64_t lo[get_op->n_servers], hi[get_op->n_servers], key;
+  size_t n, n_groups, n_seen, srv;
+  FileTransfer *file;
+
+  n = get_op->n_servers;
+  n_groups = 0;
+  for (size_t i = 0; i < n; ++i) {
+    n_groups += !!(flags[i] & DFC_GET_PIECE_FIRST) +
+                !!(flags[i] & DFC_GET_PIECE_SECOND);
   }
 
-  // get chunk sizes
-  get_chunk_sizes(len_file, put_op->n_servers, chunk_sizes);
-  file_pieces = split_file(file_content, chunk_sizes, put_op->n_servers);
+  for (size_t f = 0; f < n_files; ++f) {
+    file = &files[f];
+    key = place_key(file->fname);
+    memset(want, 0, sizeof(want));
+    memset(lo, 0, sizeof(lo));
+    memset(hi, 0, sizeof(hi));
+
+    if (file->ranged) {
+      n_seen = 0;
+      for (uint64_t u = file->unit_lo; u < file->unit_hi && n_seen < n_groups;
+           ++u) {
+        srv = plan_server(get_op, flags, key, u, &flag);
+        if (!(flags[srv] & flag)) {
+          continue;
+        }
+        n_seen += !(want[srv] & flag);
+        want[srv] |= flag;
+      }
+    } else if (file->have != NULL) {
+      for (uint64_t u = 0; u < file->n_units; ++u) {
+        if (file->have[u]) {
+          continue;
+        }
+        srv = plan_server(get_op, flags, key, u, &flag);
+        if (!(flags[srv] & flag)) {
+          continue;
+        }
+        lo[srv] = want[srv] == 0 ? u : lo[srv];
+        hi[srv] = u + 1;
+        want[srv] |= flag;
+      }
+
+      n_seen = 0;
+      for (size_t i = 0; i < n; ++i) {
+        n_seen += want[i] != 0;
+      }
+      srv = plan_server(get_op, flags, key, 0, &flag);
+      if (n_seen == 0 && (flags[srv] & flag)) {
+        want[srv] = flag;
+        lo[srv] = file->n_units;
+        hi[srv] = file->n_units + 1;
+      }
+    } else if (!get_op->ranged) {
+      memcpy(want, flags, sizeof(want));
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      if (want[i] != 0 && conns[i] != NULL) {
+        add_extra(&tasks[i], f, want[i], lo[i], hi[i]);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (conns[i] != NULL) {
+      fill_pipeline(conns[i], &tasks[i]);
+    }
+  }
+}
 
-  // last chunk size will always be maximum
-  if ((pair = alloc_buf(chunk_sizes[put_op->n_servers - 1] * 2)) == NULL) {
+// what the servers that failed mid-round still owed, per file, as the groups
+// their twins are to be asked for: retry[f * n + t] for file f and twin t.
+// NULL when there is nothing to ask. a group another server claimed was
+// sent by it, and an erasure-coded file is rebuilt from parity instead
+static uint16_t *twin_requests(GetOperation *get_op, const ServerTask *tasks,
+                               const FileTransfer *files, size_t n_files,
+                               const uint8_t *failed) {
+  FileTransfer *file;
+  uint16_t *retry, dial[get_op->n_servers], flags, lost;
+  size_t n, t, n_asked, n_dial;
+
+  n = get_op->n_servers;
+  if (get_op->dfc_op->ec_k > 0) {
+    return NULL;
+  }
+
+  if ((retry = calloc(n_files * n, sizeof(uint16_t))) == NULL) {
     fprintf(stderr, "[FATAL] out of memory\n");
     exit(EXIT_FAILURE);
   }
 
-  for (size_t i = 0; i < put_op->n_servers; ++i) {
-    srv_id = (srv_alloc_start + i) % put_op->n_servers;
-
-    if (put_op->sockfds[srv_id] <= 0) {  // acceptable, decided beforehand
+  memset(dial, 0, sizeof(dial));
+  n_dial = 0;
+  for (size_t srv = 0; srv < n; ++srv) {
+    if (!failed[srv]) {
       continue;
     }
 
-    fprintf(stderr, "[INFO] selected server %zu\n", srv_id);
+    for (size_t r = tasks[srv].n_done;
+         r < tasks[srv].n_files + tasks[srv].n_extra; ++r) {
+      file = req_file(&tasks[srv], r, &flags);
+      lost = file->n_claims > 0 ? claim_groups(file, srv, flags, n, 0) : 0;
+      for (uint16_t flag = DFC_GET_PIECE_FIRST; flag <= DFC_GET_PIECE_SECOND;
+           flag <<= 1) {
+        t = twin_of(srv, flag, n);
+        if (!(flags & flag & ~lost) || t == srv ||
+            get_op->sockfds[t] == -1) {
+          continue;
+        }
+
+        retry[(file - files) * n + t] |= DFC_GET_PIECE_BOTH & ~flag;
+        n_dial += get_op->sockfds[t] == 0 && !dial[t];
+        dial[t] |= get_op->sockfds[t] == 0;
+      }
+    }
+  }
 
-    len_pair =
-        chunk_sizes[srv_id] + chunk_sizes[(srv_id + 1) % put_op->n_servers];
+  // the plan left some twins unconnected
+  if (n_dial > 0) {
+    fill_sk_set(get_op->dfc_op, get_op->sockfds, dial);
+    for (t = 0; t < n; ++t) {
+      if (dial[t] && get_op->sockfds[t] > 0) {
+        set_timeout(get_op->sockfds[t], RCVTIMEO_SEC, RCVTIMEO_USEC);
+      }
+    }
+  }
 
-    if ((data_sk_buf[srv_id].data = alloc_buf(len_pair)) ==
-        NULL) {
-      fprintf(stderr, "[FATAL] out of memory\n");
-      exit(EXIT_FAILURE);
+  n_asked = 0;
+  for (size_t i = 0; i < n_files * n; ++i) {
+    if (get_op->sockfds[i % n] <= 0) {
+      retry[i] = 0;
     }
+    n_asked += retry[i] != 0;
+  }
 
-    if ((hdr_sk_buf[srv_id].data = alloc_buf(sizeof(DFCHeader))) == NULL) {
-      fprintf(stderr, "[FATAL] out of memory\n");
-      exit(EXIT_FAILURE);
+  if (n_asked == 0) {
+    free(retry);
+    return NULL;
+  }
+
+  return retry;
+}
+
+// one request per file to every server with flags, all in one loop. with
+// hedging, every server is in the loop so that a slow one's twins can be
+// asked for its share. ranged and resumed rounds are narrowed instead, and
+// not hedged
+static int get_round(GetOperation *get_op, FileTransfer *files, size_t n_files,
+                     const uint16_t *flags, ErasureSpool *spool) {
+  DFCEventLoop loop;
+  DFCConn *conn, *conns[get_op->n_servers];
+  ServerTask tasks[get_op->n_servers];
+  HedgeRound hedge;
+  GetOperation again;
+  uint8_t cut[get_op->n_servers], failed[get_op->n_servers];
+  uint16_t *retry, *plan;
+  struct timespec start;
+  unsigned int srv_alloc_start;
+  size_t srv_id, n, to, n_failed;
+  int narrowed, status;
+
+  narrowed = get_op->ranged || get_op->resumed;
+  hedge.get_op = get_op;
+  hedge.tasks = tasks;
+  hedge.conns = conns;
+  hedge.deadline_ns = get_op->hedge != NULL && !narrowed
+                          ? hedge_deadline(get_op->hedge)
+                          : 0;
+
+  if (hedge.deadline_ns > 0) {
+    uint16_t dial[get_op->n_servers];
+    size_t n_dial;
+
+    n_dial = 0;
+    for (size_t i = 0; i < get_op->n_servers; ++i) {
+      dial[i] = get_op->sockfds[i] == 0;
+      n_dial += dial[i];
+    }
+    if (n_dial > 0) {
+      fill_sk_set(get_op->dfc_op, get_op->sockfds, dial);
+    }
+    for (size_t i = 0; i < get_op->n_servers; ++i) {
+      if (dial[i] && get_op->sockfds[i] > 0) {
+        set_timeout(get_op->sockfds[i], RCVTIMEO_SEC, RCVTIMEO_USEC);
+      }
     }
+  }
+
+  if (ev_init(&loop, get_op->n_servers, RCVTIMEO_SEC * 1000) == -1) {
+    return -1;
+  }
+  if (hedge.deadline_ns > 0) {
+    ev_set_tick(&loop, HEDGE_TICK_MS, hedge_tick, &hedge);
+  }
 
-    merge(file_pieces[srv_id], chunk_sizes[srv_id],
-          file_pieces[(srv_id + 1) % put_op->n_servers],
-          chunk_sizes[(srv_id + 1) % put_op->n_servers], pair);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(tasks, 0, sizeof(tasks));
+  memset(conns, 0, sizeof(conns));
+  srv_alloc_start = place_key(files[0].fname) % get_op->n_servers;
+  for (size_t i = 0; i < get_op->n_servers; ++i) {
+    srv_id = (srv_alloc_start + i) % get_op->n_servers;
 
-    memset(&dfc_hdr, 0, sizeof(DFCHeader));
-    strncpy(dfc_hdr.cmd, "put", sizeof(dfc_hdr.cmd));
-    strncpy(dfc_hdr.fname, put_op->fname, sizeof(dfc_hdr.fname));
+    // down, or neither part of the plan nor a twin to hedge with
+    if (get_op->sockfds[srv_id] <= 0 ||
+        (flags[srv_id] == 0 && hedge.deadline_ns == 0)) {
+      continue;
+    }
 
-    // where next piece starts
-    dfc_hdr.chunk_offset = chunk_sizes[srv_id];
-    // where next file starts
-    dfc_hdr.file_offset = chunk_sizes[srv_id] + chunk_sizes[(srv_id + 1) % put_op->n_servers];
-    // attach_hdr(hdr_sk_buf[srv_id].data, &dfc_hdr);
-    memcpy(hdr_sk_buf[srv_id].data, &dfc_hdr, sizeof(DFCHeader));
+    memset(&tasks[srv_id], 0, sizeof(ServerTask));
+    tasks[srv_id].files = files;
+    tasks[srv_id].n_files = n_files;
+    tasks[srv_id].n_servers = get_op->n_servers;
+    tasks[srv_id].piece_flags = flags[srv_id];
+    tasks[srv_id].spool = spool;
+    tasks[srv_id].hedge = get_op->hedge != NULL ? &hedge : NULL;
+    tasks[srv_id].journal = get_op->journal;
+    if (flags[srv_id] == 0 || narrowed) {  // only extra requests
+      tasks[srv_id].n_sent = tasks[srv_id].n_done = n_files;
+    }
 
-    ssize_t bytes_written;
-    hdr_sk_buf[srv_id].sockfd = put_op->sockfds[srv_id];
-    if ((bytes_written = write(hdr_sk_buf[srv_id].sockfd, hdr_sk_buf[srv_id].data, sizeof(dfc_hdr))) == -1) {
-      perror("send");
+    if ((conn = ev_add_conn(&loop, get_op->sockfds[srv_id], srv_id,
+                            &get_handler, &tasks[srv_id])) == NULL) {
       exit(EXIT_FAILURE);
     }
-    fprintf(stderr, "wrote %zd bytes of header to sfd=%d\n", bytes_written, hdr_sk_buf[srv_id].sockfd);
+    conns[srv_id] = conn;
 
-    data_sk_buf[srv_id].sockfd = put_op->sockfds[srv_id];
-    data_sk_buf[srv_id].len_data = len_pair;
-    memcpy(data_sk_buf[srv_id].data, pair, len_pair);
+    fill_pipeline(conn, &tasks[srv_id]);
+  }
 
-    fprintf(stderr, "[INFO] sending pieces %zu, %zu of %s\n",
-            srv_id, (srv_id + 1) % put_op->n_servers, put_op->fname);
+  if (narrowed) {
+    queue_narrowed(get_op, tasks, conns, files, n_files, flags);
+  }
 
-    if (pthread_create(&send_tids[srv_id], NULL, async_dfc_send,
-                       &data_sk_buf[srv_id])) {
-      fprintf(stderr, "[%s] could not create thread %zu\n", __func__, i);
-      exit(EXIT_FAILURE);
+  status = ev_run(&loop);
+
+  n = get_op->n_servers;
+  memset(cut, 0, sizeof(cut));
+  memset(failed, 0, sizeof(failed));
+  n_failed = 0;
+  for (size_t i = 0; i < loop.n_conns; ++i) {
+    cut[loop.conns[i].srv_id] = loop.conns[i].failed;
+    failed[loop.conns[i].srv_id] =
+        loop.conns[i].failed && !loop.conns[i].cancelled;
+    n_failed += failed[loop.conns[i].srv_id];
+  }
+  ev_destroy(&loop);
+
+  // a cancelled or failed connection may be mid-response, good for nothing
+  // but closing
+  for (size_t i = 0; i < n; ++i) {
+    if (cut[i]) {
+      close(get_op->sockfds[i]);
+      get_op->sockfds[i] = -1;
+      get_op->dfc_op->n_cut++;
     }
+  }
 
-    ran_threads[srv_id] = 1;
+  // a server that failed leaves what it was sending short: the pieces that
+  // passed their checksum are in place, but its frame is not counted
+  retry = n_failed > 0
+              ? twin_requests(get_op, tasks, files, n_files, failed)
+              : NULL;
+  for (size_t i = 0; i < n; ++i) {
+    free(tasks[i].extra);
+  }
+  for (size_t i = 0; i < n_files; ++i) {
+    free(files[i].claims);
+    files[i].claims = NULL;
+    files[i].n_claims = 0;
   }
 
-  for (size_t i = 0; i < put_op->n_servers; ++i) {
-    if (ran_threads[i] == 1) {
-      pthread_join(send_tids[i], NULL);
+  if (get_op->place != NULL) {
+    add_measured(get_op->place, tasks, &start);
+  }
+
+  if (status == -1 && n_failed == 0) {
+    return -1;
+  }
+
+  // later rounds of the operation go to a failed server's twins, and so
+  // does what it still owed this one, a round per run of files wanting the
+  // same of them. an erasure-coded file is left to erasure_restore
+  plan = get_op->piece_flags;
+  for (size_t i = 0; i < n && get_op->dfc_op->ec_k == 0; ++i) {
+    for (uint16_t flag = DFC_GET_PIECE_FIRST;
+         failed[i] && flag <= DFC_GET_PIECE_SECOND; flag <<= 1) {
+      if (plan[i] & flag) {
+        plan[i] &= ~flag;
+        plan[twin_of(i, flag, n)] |= DFC_GET_PIECE_BOTH & ~flag;
+      }
     }
   }
 
-  for (size_t i = 0; i < put_op->n_servers; ++i) {
-    if (hdr_sk_buf[i].data != NULL)
-      free(hdr_sk_buf[i].data);
+  again = *get_op;
+  again.hedge = NULL;
+  for (size_t f = 0; retry != NULL && f < n_files; f = to) {
+    for (to = f + 1; to < n_files && memcmp(&retry[to * n], &retry[f * n],
+                                            sizeof(uint16_t) * n) == 0;
+         ++to) {
+    }
+
+    for (size_t t = 0; t < n; ++t) {
+      if (retry[f * n + t] != 0) {
+        fprintf(stderr, "[INFO] asking twins for what a failed server owed "
+                        "of %zu files\n", to - f);
+        if (get_round(&again, &files[f], to - f, &retry[f * n], spool) ==
+            -1) {
+          free(retry);
+          return -1;
+        }
+        break;
+      }
+    }
+  }
+  free(retry);
+
+  return 0;
+}
+
+// an erasure-coded file short of pieces: ask every server for what the plan
+// did not, which is parity from the servers asked for data and everything
+// from the ones left out. returns what the round does
+static int get_parity(GetOperation *get_op, FileTransfer *file,
+                      ErasureSpool *spool) {
+  uint16_t dial[get_op->n_servers], flags[get_op->n_servers];
+  size_t n_dial, n_asked;
+
+  n_dial = 0;
+  for (size_t i = 0; i < get_op->n_servers; ++i) {
+    dial[i] = get_op->sockfds[i] == 0;
+    n_dial += dial[i];
+  }
+  if (n_dial > 0) {
+    fill_sk_set(get_op->dfc_op, get_op->sockfds, dial);
+  }
 
-    if (data_sk_buf[i].data != NULL)
-      free(data_sk_buf[i].data);
+  n_asked = 0;
+  for (size_t i = 0; i < get_op->n_servers; ++i) {
+    flags[i] = 0;
+    if (get_op->sockfds[i] > 0) {
+      if (dial[i]) {
+        set_timeout(get_op->sockfds[i], RCVTIMEO_SEC, RCVTIMEO_USEC);
+      }
+      flags[i] = DFC_GET_PIECE_BOTH & ~get_op->piece_flags[i];
+    }
+    n_asked += flags[i] != 0;
+  }
 
-    if (file_pieces[i] != NULL)
-      free(file_pieces[i]);
+  if (n_asked == 0) {
+    return 0;
   }
 
-  free(file_pieces);
-  free(file_content);
-  free(pair);
+  fprintf(stderr, "[INFO] %s: asking for parity\n", file->fname);
+  return get_round(get_op, file, 1, flags, spool);
+}
+
+// the bytes of the units a ranged fetch asked for that the file has
+static uint64_t range_cover(const FileTransfer *file) {
+  uint64_t lo, hi;
 
-  return NULL;
+  lo = file->unit_lo * file->unit;
+  hi = file->unit_hi * file->unit;
+  lo = lo < file->file_size ? lo : file->file_size;
+  hi = hi < file->file_size ? hi : file->file_size;
+
+  return hi - lo;
+}
+
+// the units covering a ranged file's range, were it cut with unit
+static void range_units(FileTransfer *file, uint64_t unit) {
+  file->unit = unit;
+  file->unit_lo = file->range_off / unit;
+  file->unit_hi = file->range_len == 0
+                      ? file->unit_lo
+                      : (file->range_off + file->range_len - 1) / unit + 1;
+  file->unit_seen = 0;
+  file->has_head = 0;
+}
+
+// a ranged fetch asks for the units covering each file's range as if it was
+// cut with the unit the catalog recorded, or else the configured one, then
+// again for the files whose size or pieces say otherwise. erasure-coded
+// files and dedup manifests come whole, to be cut down to their range
+// afterwards
+static int get_fetch_ranges(GetOperation *get_op) {
+  GetOperation whole;
+  FileTransfer *file;
+  CatalogEntry entry;
+  uint64_t unit;
+  size_t n_ranged;
+  int known;
+
+  n_ranged = 0;
+  for (size_t i = 0; i < get_op->n_files; ++i) {
+    file = &get_op->files[i];
+    known = get_op->catalog != NULL &&
+            catalog_find(get_op->catalog, file->fname, &entry) &&
+            entry.size != UINT64_MAX;
+    range_units(file, known && entry.unit > 0 ? entry.unit
+                                              : get_op->dfc_op->stripe_unit);
+    if (known) {
+      file->whole =
+          (entry.flags & (CATALOG_MANIFEST | CATALOG_ERASURE)) != 0;
+    } else {
+      // a manifest is found by its first piece, which a range may not cover
+      file->whole =
+          get_op->dfc_op->ec_k > 0 || get_op->dfc_op->dedup_chunk > 0;
+    }
+    file->ranged = !file->whole;
+    n_ranged += file->ranged;
+  }
+
+  if (n_ranged > 0 && get_round(get_op, get_op->files, get_op->n_files,
+                                get_op->piece_flags, NULL) == -1) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < get_op->n_files; ++i) {
+    file = &get_op->files[i];
+    if (!file->ranged || file->n_found == 0 || file->whole) {
+      continue;
+    }
+
+    // the catalog's unit holds while the file is the size it recorded
+    if ((unit = file->unit_seen) == 0 &&
+        (get_op->catalog == NULL ||
+         !catalog_find(get_op->catalog, file->fname, &entry) ||
+         entry.size != file->file_size || (unit = entry.unit) == 0)) {
+      unit = stripe_unit(file->file_size, get_op->place,
+                         get_op->dfc_op->stripe_unit);
+    }
+    if (unit != file->unit) {
+      range_units(file, unit);
+      file->n_recv = 0;
+      free(file->bad_pieces);
+      file->bad_pieces = NULL;
+      file->n_bad = 0;
+      if (get_round(get_op, file, 1, get_op->piece_flags, NULL) == -1) {
+        return -1;
+      }
+    }
+
+    if (file->n_bad > 0) {
+      get_refetch(get_op, file);
+    }
+
+    // still short, with a unit nothing in the range gave away
+    if (file->n_bad == 0 && file->n_recv < range_cover(file)) {
+      file->whole = 1;
+    }
+  }
+
+  whole = *get_op;
+  whole.ranged = 0;
+  whole.n_files = 1;
+  for (size_t i = 0; i < get_op->n_files; ++i) {
+    file = &get_op->files[i];
+    if (!file->whole) {
+      continue;
+    }
+
+    file->ranged = 0;
+    file->manifest = 0;
+    file->n_found = 0;
+    file->n_recv = 0;
+    free(file->bad_pieces);
+    file->bad_pieces = NULL;
+    file->n_bad = 0;
+    whole.files = file;
+    if (get_fetch(&whole) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// receive every file of the operation into its fd, have pieces that failed
+// their checksum sent again, and rebuild erasure-coded files from their
+// parity where they need it. files are left open
+int get_fetch(GetOperation *get_op) {
+  GetOperation again;
+  ErasureSpool spool;
+  FileTransfer *file;
+  int status;
+
+  if (get_op->ranged) {
+    return get_fetch_ranges(get_op);
+  }
+
+  spool.fd = -1;
+  spool.end = 0;
+
+  if (get_round(get_op, get_op->files, get_op->n_files, get_op->piece_flags,
+                &spool) == -1) {
+    return -1;
+  }
+
+  // every file's erasure state goes, whether or not a parity round failed
+  status = 0;
+  for (size_t i = 0; i < get_op->n_files; ++i) {
+    file = &get_op->files[i];
+    if (file->n_bad > 0) {
+      get_refetch(get_op, file);
+    }
+
+    if (file->ec != NULL && erasure_restore(&spool, file) == -1) {
+      if (get_parity(get_op, file, &spool) == -1) {
+        status = -1;
+      } else {
+        erasure_restore(&spool, file);
+      }
+    }
+    erasure_free(file);
+  }
+
+  if (spool.fd != -1) {
+    close(spool.fd);
+  }
+  if (status == -1) {
+    return -1;
+  }
+
+  again = *get_op;
+  again.resumed = 0;
+  again.n_files = 1;
+  for (size_t i = 0; i < get_op->n_files; ++i) {
+    file = &get_op->files[i];
+    if (!file->restart) {
+      continue;
+    }
+
+    fprintf(stderr, "[INFO] %s changed since it was journaled\n", file->fname);
+    free(file->have);
+    file->have = NULL;
+    file->restart = 0;
+    file->n_recv = 0;
+    again.files = file;
+    if (get_fetch(&again) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// move len bytes of fd from offset from down to offset to
+static int move_bytes(int fd, uint64_t from, uint64_t to, uint64_t len) {
+  char *buf;
+  size_t n;
+  ssize_t nb_read;
+  int status;
+
+  if (len == 0 || from == to) {
+    return 0;
+  }
+  buf = pool_get(MOVE_BUF_LEN);
+
+  status = 0;
+  for (uint64_t done = 0; done < len; done += n) {
+    n = len - done < MOVE_BUF_LEN ? len - done : MOVE_BUF_LEN;
+    if ((nb_read = pread(fd, buf, n, from + done)) != (ssize_t)n ||
+        pwrite_all(fd, buf, n, to + done) == -1) {
+      status = -1;
+      break;
+    }
+  }
+
+  pool_put(buf, MOVE_BUF_LEN);
+
+  return status;
+}
+
+// leave just the range at the start of a ranged or whole-fetched file: the
+// rest of a whole file goes, and a parked first piece moves down into place
+static int range_cut(FileTransfer *file) {
+  uint64_t n, head_len;
+  int status;
+
+  n = range_bytes(file);
+  status = 0;
+  if (file->whole) {
+    status = move_bytes(file->fd, file->range_off, 0, n);
+  } else if (file->has_head) {
+    head_len = file->head + file->unit - file->range_off;
+    status = move_bytes(file->fd, n + file->unit + file->range_off - file->head,
+                        0, head_len < n ? head_len : n);
+  }
+  file->file_size = n;
+
+  return status;
+}
+
+// what a get learned of a file that came whole, for the next ranged get of
+// it to plan by. the unit is only known when it was cut to a range
+static void get_note(GetOperation *get_op, const FileTransfer *file) {
+  CatalogEntry entry, old;
+  int have;
+
+  if (get_op->catalog == NULL) {
+    return;
+  }
+
+  memset(&entry, 0, sizeof(CatalogEntry));
+  entry.name = file->fname;
+  entry.name_len = strlen(file->fname);
+  entry.size = file->file_size;
+  entry.unit = file->ranged ? file->unit : 0;
+  entry.flags = file->manifest ? CATALOG_MANIFEST
+                : get_op->dfc_op->ec_k > 0
+                    ? CATALOG_ERASURE | DFC_PIECE_EC(get_op->dfc_op->ec_k,
+                                                     get_op->dfc_op->ec_m)
+                    : 0;
+
+  // a record that still holds is kept as it is, holders and all
+  if ((have = catalog_find(get_op->catalog, file->fname, &old)) &&
+      old.size == entry.size && old.flags == entry.flags &&
+      (entry.unit == 0 || old.unit == entry.unit)) {
+    return;
+  }
+  if (have && old.size == entry.size) {
+    entry.unit = entry.unit > 0 ? entry.unit : old.unit;
+    entry.etag = old.etag;
+    entry.holders = old.holders;
+  }
+
+  catalog_add(get_op->catalog, &entry);
+}
+
+int get_handle(GetOperation *get_op) {
+  FileTransfer *file;
+  struct timespec start, end;
+  uint64_t size;
+  size_t n_ok;
+  int ok;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (get_fetch(get_op) == -1) {
+    return -1;
+  }
+
+  n_ok = 0;
+  for (size_t i = 0; i < get_op->n_files; ++i) {
+    file = &get_op->files[i];
+    if (file->n_found == 0) {
+      fprintf(stderr, "[ERROR] %s not found\n", file->fname);
+      continue;
+    }
+    if (file->fd == -1) {
+      fprintf(stderr, "[ERROR] %s could not be opened\n", file->fname);
+      continue;
+    }
+
+    ok = 0;
+    if (file->n_bad > 0) {
+      fprintf(stderr,
+              "[ERROR] %s is corrupt: %zu pieces failed their checksum on "
+              "every server holding them\n",
+              file->fname, file->n_bad);
+      free(file->bad_pieces);
+    } else if (file->n_recv <
+               (size = file->ranged ? range_cover(file) : file->file_size)) {
+      // the plan asks for each stripe unit once, so a server missing the
+      // file leaves a hole
+      fprintf(stderr,
+              "[ERROR] %s is incomplete (%" PRIu64 " of %" PRIu64 " bytes)\n",
+              file->fname, file->n_recv, size);
+    } else if (file->manifest) {
+      // what arrived is the list of chunks the file is made of
+      if (dedup_restore(get_op, file) == -1) {
+        fprintf(stderr, "[ERROR] %s could not be rebuilt from its chunks\n",
+                file->fname);
+      } else {
+        mark_done(file);
+        get_note(get_op, file);
+        ok = 1;
+      }
+    } else {
+      get_note(get_op, file);
+      ok = 1;
+    }
+
+    if ((file->ranged || file->whole) && range_cut(file) == -1) {
+      fprintf(stderr, "[ERROR] %s could not be cut to its range\n",
+              file->fname);
+      ok = 0;
+    }
+
+    // fallocate may have extended the file when the servers disagree
+    if (ftruncate(file->fd, file->file_size) == -1) {
+      fprintf(stderr, "[ERROR] %s could not be truncated: %s\n", file->fname,
+              strerror(errno));
+      ok = 0;
+    }
+
+    if (close(file->fd) == -1) {
+      fprintf(stderr, "[ERROR] %s could not be closed: %s\n", file->fname,
+              strerror(errno));
+      ok = 0;
+    }
+    file->fd = -1;
+    n_ok += ok;
+  }
+
+  // every file whole: nothing is left to resume
+  if (get_op->journal != NULL && n_ok == get_op->n_files) {
+    journal_discard(get_op->journal);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  print_transfer_stats("get", get_op->files, get_op->n_files, &start, &end);
+
+  // the caller's exit status tells a script to try again
+  if (n_ok < get_op->n_files) {
+    if (get_op->journal != NULL) {
+      fprintf(stderr, "[INFO] get --resume fetches only what is missing\n");
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+int get_range(GetOperation *get_op, uint64_t off, uint64_t len) {
+  PlaceMap place;
+  int own, status;
+
+  // the units are found where the put placed them
+  if ((own = get_op->place == NULL)) {
+    place_init(&place, get_op->dfc_op);
+    get_op->place = &place;
+  }
+
+  len = len < UINT64_MAX / 2 - off ? len : UINT64_MAX / 2 - off;
+  for (size_t i = 0; i < get_op->n_files; ++i) {
+    get_op->files[i].range_off = off;
+    get_op->files[i].range_len = len;
+  }
+
+  get_op->ranged = 1;
+  status = get_handle(get_op);
+  get_op->ranged = 0;
+
+  if (own) {
+    place_free(&place);
+    get_op->place = NULL;
+  }
+
+  return status;
+}
+
+static int list_on_frame(DFCConn *conn, const DFCFrameHeader *frame_hdr) {
+  SocketBuffer *rcv_sk_buf = (SocketBuffer *)conn->ctx;
+
+  // the frame says how long the listing is, so it lands in one allocation.
+  // the length comes off the wire, and is held below LIST_WHOLE_MAX before
+  // anything is added to it
+  if (frame_hdr->payload_len > LIST_WHOLE_MAX) {
+    ev_fail(conn, "listing too long");
+    return -1;
+  }
+
+  rcv_sk_buf->len_data = 0;
+  if ((rcv_sk_buf->data = alloc_buf((size_t)frame_hdr->payload_len + 1)) ==
+      NULL) {
+    ev_fail(conn, "out of memory for the listing");
+    return -1;
+  }
+
+  return -1;
+}
+
+static void list_on_payload(DFCConn *conn, const char *buf, size_t len) {
+  SocketBuffer *rcv_sk_buf = (SocketBuffer *)conn->ctx;
+
+  memcpy(rcv_sk_buf->data + rcv_sk_buf->len_data, buf, len);
+  rcv_sk_buf->len_data += len;
+}
+
+static const DFCConnHandler list_handler = {
+    .on_frame = list_on_frame,
+    .on_payload = list_on_payload,
+};
+
+// the listing of one server: len bytes of NUL-terminated names, or NULL when
+// the request failed
+char *list_names(int list_fd, size_t *len) {
+  DFCEventLoop loop;
+  DFCConn *conn;
+  DFCHeader dfc_hdr;
+  SocketBuffer rcv_sk_buf;
+  char hdr_buf[DFC_HDR_MAX];
+  int status;
+
+  if (ev_init(&loop, 1, RCVTIMEO_SEC * 1000) == -1) {
+    return NULL;
+  }
+
+  rcv_sk_buf.sockfd = list_fd;
+  rcv_sk_buf.data = NULL;
+  rcv_sk_buf.len_data = 0;
+  if ((conn = ev_add_conn(&loop, list_fd, 0, &list_handler, &rcv_sk_buf)) ==
+      NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  // form request
+  init_hdr(&dfc_hdr, DFC_OP_LIST, NULL);
+
+  // send request
+  ev_queue_buf(conn, hdr_buf, encode_hdr(&dfc_hdr, hdr_buf), NULL);
+  ev_expect(conn, 1);
+
+  status = ev_run(&loop);
+  ev_destroy(&loop);
+
+  if (status == -1 || rcv_sk_buf.data == NULL) {
+    free(rcv_sk_buf.data);
+    return NULL;
+  }
+
+  rcv_sk_buf.data[rcv_sk_buf.len_data] = '\0';
+  *len = rcv_sk_buf.len_data;
+
+  return rcv_sk_buf.data;
+}
+
+// a get for a range past any piece, so that only the frame header comes back,
+// with the size the file was stored with
+static void queue_probe(DFCConn *conn, const char *fname, uint32_t req_id) {
+  DFCHeader dfc_hdr;
+  char hdr_buf[DFC_HDR_MAX];
+
+  init_hdr(&dfc_hdr, DFC_OP_GET, fname);
+  dfc_hdr.req_id = req_id;
+  dfc_hdr.flags = DFC_GET_PIECE_BOTH | DFC_GET_RANGE;
+  dfc_hdr.chunk_offset = LIST_PROBE_UNIT;
+  dfc_hdr.file_offset = LIST_PROBE_UNIT + 1;
+  ev_queue_buf(conn, hdr_buf, encode_hdr(&dfc_hdr, hdr_buf), NULL);
+}
+
+static void sizes_on_frame_done(DFCConn *conn,
+                                const DFCFrameHeader *frame_hdr) {
+  SizeProbe *probe = (SizeProbe *)conn->ctx;
+
+  if (frame_hdr->status == DFC_STATUS_OK && frame_hdr->req_id < probe->n) {
+    probe->sizes[frame_hdr->req_id] = frame_hdr->file_size;
+  }
+}
+
+// pieces a server sends anyway are dropped, as there is no fd for them
+static const DFCConnHandler sizes_handler = {
+    .on_frame_done = sizes_on_frame_done,
+};
+
+// the size server fd has each of n files stored with, into sizes:
+// UINT64_MAX for one it does not have. -1 when the server did not answer
+// them all, whose connection is then good for nothing but closing
+int stored_sizes(int fd, char *const *fnames, size_t n, uint64_t *sizes) {
+  DFCEventLoop loop;
+  DFCConn *conn;
+  SizeProbe probe;
+  int status;
+
+  for (size_t i = 0; i < n; ++i) {
+    sizes[i] = UINT64_MAX;
+  }
+  if (n == 0) {
+    return 0;
+  }
+
+  if (ev_init(&loop, 1, RCVTIMEO_SEC * 1000) == -1) {
+    return -1;
+  }
+
+  probe.sizes = sizes;
+  probe.n = n;
+  if ((conn = ev_add_conn(&loop, fd, 0, &sizes_handler, &probe)) == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    queue_probe(conn, fnames[i], i);
+  }
+  ev_expect(conn, n);
+
+  status = ev_run(&loop);
+  ev_destroy(&loop);
+
+  return status;
+}
+
+static int list_held(const ListMerge *merge, size_t e, size_t srv) {
+  return merge->holders[e * merge->stride + srv / 8] >> (srv % 8) & 1;
+}
+
+// put every entry in an empty table
+static void list_reslot(ListMerge *merge) {
+  size_t mask, i;
+
+  mask = merge->n_slots - 1;
+  for (size_t e = 0; e < merge->n; ++e) {
+    for (i = merge->hashes[e] & mask; merge->slots[i] != 0;
+         i = (i + 1) & mask) {
+    }
+    merge->slots[i] = e + 1;
+  }
+}
+
+// a new entry for name, len bytes followed by a NUL, with hash h and no
+// holders yet, growing the entries twice as big when they are full. the
+// table is left to the caller
+static size_t list_entry(ListMerge *merge, const char *name, size_t len,
+                         uint64_t h) {
+  char *names;
+  size_t *at;
+  uint64_t *hashes;
+  uint8_t *holders;
+  size_t e, cap;
+
+  if (merge->n == merge->cap) {
+    cap = merge->cap > 0 ? 2 * merge->cap : LIST_SLOTS_MIN / 2;
+    if ((at = realloc(merge->at, sizeof(size_t) * cap)) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    merge->at = at;
+    if ((hashes = realloc(merge->hashes, sizeof(uint64_t) * cap)) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    merge->hashes = hashes;
+    if ((holders = realloc(merge->holders, merge->stride * cap)) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    merge->holders = holders;
+    merge->cap = cap;
+  }
+  if (merge->len_names + len + 1 > merge->cap_names) {
+    cap = merge->cap_names > 0 ? merge->cap_names : LIST_NAMES_MIN;
+    while (merge->len_names + len + 1 > cap) {
+      cap *= 2;
+    }
+    if ((names = realloc(merge->names, cap)) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    merge->names = names;
+    merge->cap_names = cap;
+  }
+
+  e = merge->n++;
+  memcpy(merge->names + merge->len_names, name, len + 1);
+  merge->at[e] = merge->len_names;
+  merge->len_names += len + 1;
+  merge->hashes[e] = h;
+  memset(merge->holders + e * merge->stride, 0, merge->stride);
+
+  return e;
+}
+
+// server srv listed name, len bytes followed by a NUL. the entries are
+// spread over a table twice as big before it gets half full
+static void list_add(ListMerge *merge, const char *name, size_t len,
+                     size_t srv) {
+  uint32_t *slots;
+  uint64_t h;
+  size_t n_slots, mask, i, e;
+
+  if (2 * (merge->n + 1) > merge->n_slots) {
+    n_slots = 2 * merge->n_slots;
+    if ((slots = calloc(n_slots, sizeof(uint32_t))) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    free(merge->slots);
+    merge->slots = slots;
+    merge->n_slots = n_slots;
+    list_reslot(merge);
+  }
+
+  h = hash64(name);
+  mask = merge->n_slots - 1;
+  for (i = h & mask; merge->slots[i] != 0; i = (i + 1) & mask) {
+    e = merge->slots[i] - 1;
+    if (merge->hashes[e] == h &&
+        strcmp(merge->names + merge->at[e], name) == 0) {
+      merge->holders[e * merge->stride + srv / 8] |= 1 << (srv % 8);
+      return;
+    }
+  }
+
+  e = list_entry(merge, name, len, h);
+  merge->slots[i] = e + 1;
+  merge->holders[e * merge->stride + srv / 8] |= 1 << (srv % 8);
+}
+
+// move the entries no server can add to any more, those that sort up to
+// frontier (all of them when it is NULL), from pending to batch, and close
+// the gaps they leave
+static void list_settle(ListMerge *pending, ListMerge *batch,
+                        const char *frontier) {
+  const char *name;
+  size_t n, at, len, b;
+
+  n = at = 0;
+  for (size_t e = 0; e < pending->n; ++e) {
+    name = pending->names + pending->at[e];
+    len = strlen(name);
+    if (frontier == NULL || strcmp(name, frontier) <= 0) {
+      b = list_entry(batch, name, len, pending->hashes[e]);
+      memcpy(batch->holders + b * batch->stride,
+             pending->holders + e * pending->stride, pending->stride);
+      continue;
+    }
+
+    memmove(pending->names + at, name, len + 1);
+    pending->at[n] = at;
+    pending->hashes[n] = pending->hashes[e];
+    memmove(pending->holders + n * pending->stride,
+            pending->holders + e * pending->stride, pending->stride);
+    at += len + 1;
+    n++;
+  }
+
+  pending->n = n;
+  pending->len_names = at;
+  memset(pending->slots, 0, sizeof(uint32_t) * pending->n_slots);
+  list_reslot(pending);
+}
+
+static void list_merge_free(ListMerge *merge) {
+  free(merge->streams);
+  free(merge->probes);
+  free(merge->names);
+  free(merge->at);
+  free(merge->hashes);
+  free(merge->holders);
+  free(merge->sizes);
+  free(merge->slots);
+  memset(merge, 0, sizeof(ListMerge));
+}
+
+// keep the start of a name the next read finishes. a name longer than any
+// path is dropped
+static void list_hold(ListStream *stream, const char *buf, size_t len) {
+  if (stream->n_partial + len <= PATH_MAX) {
+    memcpy(stream->partial + stream->n_partial, buf, len);
+  }
+  stream->n_partial += len;
+}
+
+// server srv listed name, len bytes followed by a NUL: the cursor its next
+// page starts after, whether or not it has the prefix a server that ignores
+// paging does not filter by
+static void list_name(ListMerge *merge, size_t srv, const char *name,
+                      size_t len) {
+  ListStream *stream = &merge->streams[srv];
+
+  stream->n_page++;
+  if (len <= PATH_MAX) {
+    memcpy(stream->cursor, name, len + 1);
+  }
+
+  if (len >= merge->len_prefix &&
+      memcmp(name, merge->prefix, merge->len_prefix) == 0) {
+    list_add(merge, name, len, srv);
+  }
+}
+
+static void list_flush(ListMerge *merge, size_t srv) {
+  ListStream *stream = &merge->streams[srv];
+
+  if (stream->n_partial > 0 && stream->n_partial <= PATH_MAX) {
+    stream->partial[stream->n_partial] = '\0';
+    list_name(merge, srv, stream->partial, stream->n_partial);
+  }
+  stream->n_partial = 0;
+}
+
+// names go into the merge straight from the read, unless split by it
+static void merge_on_payload(DFCConn *conn, const char *buf, size_t len) {
+  ListMerge *merge = (ListMerge *)conn->ctx;
+  ListStream *stream = &merge->streams[conn->srv_id];
+  const char *end;
+  size_t n;
+
+  while (len > 0) {
+    if ((end = memchr(buf, '\0', len)) == NULL) {
+      list_hold(stream, buf, len);
+      return;
+    }
+
+    n = end - buf;
+    if (stream->n_partial > 0) {
+      list_hold(stream, buf, n);
+      list_flush(merge, conn->srv_id);
+    } else if (n > 0) {
+      list_name(merge, conn->srv_id, buf, n);
+    }
+
+    buf += n + 1;
+    len -= n + 1;
+  }
+}
+
+static void merge_on_frame_done(DFCConn *conn,
+                                const DFCFrameHeader *frame_hdr) {
+  ListMerge *merge = (ListMerge *)conn->ctx;
+  ListStream *stream = &merge->streams[conn->srv_id];
+
+  list_flush(merge, conn->srv_id);  // a last name without its NUL
+  if (frame_hdr->status == DFC_STATUS_OK) {
+    stream->answered = 1;
+    // an empty page ends the listing whatever it says, or it could go on
+    // asking for the same one
+    stream->more = frame_hdr->file_size != 0 && stream->n_page > 0;
+  }
+}
+
+static const DFCConnHandler merge_handler = {
+    .on_payload = merge_on_payload,
+    .on_frame_done = merge_on_frame_done,
+};
+
+static void probe_on_frame_done(DFCConn *conn,
+                                const DFCFrameHeader *frame_hdr) {
+  ListMerge *merge = (ListMerge *)conn->ctx;
+  ListStream *stream = &merge->streams[conn->srv_id];
+
+  if (frame_hdr->status == DFC_STATUS_OK &&
+      frame_hdr->req_id < stream->n_probe) {
+    merge->sizes[stream->probe[frame_hdr->req_id]] = frame_hdr->file_size;
+  }
+}
+
+// pieces a server sends anyway are dropped, as there is no fd for them
+static const DFCConnHandler probe_handler = {
+    .on_frame_done = probe_on_frame_done,
+};
+
+// a connection that failed mid-frame is good for nothing but closing
+static void list_cut(DFCOperation *dfc_op, int *sockfds,
+                     const DFCEventLoop *loop) {
+  for (size_t i = 0; i < loop->n_conns; ++i) {
+    if (loop->conns[i].failed) {
+      close(sockfds[loop->conns[i].srv_id]);
+      sockfds[loop->conns[i].srv_id] = -1;
+      dfc_op->n_cut++;
+    }
+  }
+}
+
+// whether the servers that did not list entry e can hold the only copies of
+// some of its pieces: a group neither of whose servers listed it, or k + m
+// servers in a row (where an erasure stripe may lie) of which more than m
+// did not
+static int list_at_risk(const ListMerge *merge, size_t e, uint8_t k,
+                        uint8_t m) {
+  size_t n, missing;
+
+  n = merge->n_servers;
+  for (size_t g = 0; g < n; ++g) {
+    if (k == 0) {
+      if (!list_held(merge, e, g) && !list_held(merge, e, (g + n - 1) % n)) {
+        return 1;
+      }
+      continue;
+    }
+
+    missing = 0;
+    for (size_t j = 0; j < (size_t)k + m; ++j) {
+      missing += !list_held(merge, e, (g + j) % n);
+    }
+    if (missing > m) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// the layout a put recorded in the catalog for entry e, size bytes long
+// (UINT64_MAX while that is not known): 1 with its unit and code, or 0 with
+// the configured code when there is no record to go by. a dedup manifest is
+// cut as its manifest is, which is not recorded
+static int list_layout(const DFCOperation *dfc_op, const ListTally *tally,
+                       const ListMerge *merge, size_t e, uint64_t size,
+                       uint64_t *unit, uint8_t *k, uint8_t *m) {
+  CatalogEntry entry;
+
+  *unit = 0;
+  *k = dfc_op->ec_k;
+  *m = dfc_op->ec_m;
+  if (tally->layouts == NULL ||
+      !catalog_find(tally->layouts, merge->names + merge->at[e], &entry) ||
+      entry.unit == 0 || (entry.flags & CATALOG_MANIFEST) ||
+      (size != UINT64_MAX && entry.size != size)) {
+    return 0;
+  }
+
+  *unit = entry.unit;
+  *k = entry.flags & CATALOG_ERASURE ? DFC_PIECE_EC_K(entry.flags) : 0;
+  *m = entry.flags & CATALOG_ERASURE ? DFC_PIECE_EC_M(entry.flags) : 0;
+
+  return 1;
+}
+
+// the units (erasure stripes) of entry e, size bytes long and cut with unit
+// under a k + m code, that no server which listed it can give back, out of
+// *n_total
+static uint64_t list_lost(const ListMerge *merge, size_t e,
+                          const PlaceMap *place, uint64_t unit, uint8_t k,
+                          uint8_t m, uint64_t size, uint64_t *n_total) {
+  uint64_t key, n_units, lost;
+  size_t n, g, held;
+
+  n = merge->n_servers;
+  key = place_key(merge->names + merge->at[e]);
+  n_units = (size + unit - 1) / unit;
+  *n_total = k > 0 ? (n_units + k - 1) / k : n_units;
+
+  lost = 0;
+  for (uint64_t u = 0; u < *n_total; ++u) {
+    g = place_group(place, key, u);
+    if (k == 0) {
+      lost += !list_held(merge, e, g) && !list_held(merge, e, (g + n - 1) % n);
+      continue;
+    }
+
+    held = 0;
+    for (size_t j = 0; j < (size_t)k + m; ++j) {
+      held += list_held(merge, e, (g + j) % n);
+    }
+    lost += held < k;
+  }
+
+  return lost;
+}
+
+// ask the size of each entry at risk of a server that listed it: only with
+// the size is it known which groups the entry's units fall in
+static void list_probe(DFCOperation *dfc_op, int *sockfds, ListMerge *merge,
+                       const ListTally *tally) {
+  DFCEventLoop loop;
+  DFCConn *conn;
+  ListStream *stream;
+  uint64_t *sizes, unit;
+  size_t *probes, n_probe, srv;
+  uint8_t k, m;
+
+  // the batches of a listing reuse what the first one allocated
+  if ((sizes = realloc(merge->sizes, sizeof(uint64_t) * merge->cap)) ==
+      NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  merge->sizes = sizes;
+  for (srv = 0; srv < merge->n_servers; ++srv) {
+    merge->streams[srv].n_probe = 0;
+  }
+
+  // which server each entry is asked of, kept in its size until the probes
+  // are laid out by server
+  n_probe = 0;
+  for (size_t e = 0; e < merge->n; ++e) {
+    merge->sizes[e] = UINT64_MAX;
+    if (dedup_is_chunk(merge->names + merge->at[e])) {
+      continue;
+    }
+    list_layout(dfc_op, tally, merge, e, UINT64_MAX, &unit, &k, &m);
+    if (!list_at_risk(merge, e, k, m)) {
+      continue;
+    }
+
+    for (srv = 0; srv < merge->n_servers &&
+                  (!list_held(merge, e, srv) || sockfds[srv] <= 0);
+         ++srv) {
+    }
+    if (srv < merge->n_servers) {
+      merge->sizes[e] = srv;
+      merge->streams[srv].n_probe++;
+      n_probe++;
+    }
+  }
+
+  if (n_probe == 0) {
+    return;
+  }
+
+  if ((probes = realloc(merge->probes, sizeof(size_t) * merge->cap)) ==
+      NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  merge->probes = probes;
+  n_probe = 0;
+  for (srv = 0; srv < merge->n_servers; ++srv) {
+    merge->streams[srv].probe = merge->probes + n_probe;
+    n_probe += merge->streams[srv].n_probe;
+    merge->streams[srv].n_probe = 0;
+  }
+  for (size_t e = 0; e < merge->n; ++e) {
+    if (merge->sizes[e] != UINT64_MAX) {
+      stream = &merge->streams[merge->sizes[e]];
+      stream->probe[stream->n_probe++] = e;
+      merge->sizes[e] = UINT64_MAX;
+    }
+  }
+
+  if (ev_init(&loop, dfc_op->n_servers, RCVTIMEO_SEC * 1000) == -1) {
+    return;
+  }
+
+  for (srv = 0; srv < dfc_op->n_servers; ++srv) {
+    stream = &merge->streams[srv];
+    if (stream->n_probe == 0) {
+      continue;
+    }
+
+    if ((conn = ev_add_conn(&loop, sockfds[srv], srv, &probe_handler,
+                            merge)) == NULL) {
+      exit(EXIT_FAILURE);
+    }
+    for (size_t j = 0; j < stream->n_probe; ++j) {
+      queue_probe(conn, merge->names + merge->at[stream->probe[j]], j);
+    }
+    ev_expect(conn, stream->n_probe);
+  }
+
+  ev_run(&loop);  // what is not answered stays unknown
+  list_cut(dfc_op, sockfds, &loop);
+  ev_destroy(&loop);
+}
+
+// the names of a batch, in byte order
+static int cmp_batch(const void *a, const void *b, void *arg) {
+  const ListMerge *batch = arg;
+
+  return strcmp(batch->names + batch->at[*(const size_t *)a],
+                batch->names + batch->at[*(const size_t *)b]);
+}
+
+// print the files of a batch, each with a note when some of its pieces have
+// no copy on a server that answered, and count them into tally
+static void list_print(DFCOperation *dfc_op, int *sockfds, ListMerge *batch,
+                       const PlaceMap *place, ListTally *tally) {
+  const char *name;
+  uint64_t lost, n_total, *hashes, unit;
+  size_t *order, e, cap, n_short;
+  uint8_t k, m;
+  int known;
+
+  list_probe(dfc_op, sockfds, batch, tally);
+
+  if ((order = malloc(sizeof(size_t) * batch->n)) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for (e = 0; e < batch->n; ++e) {
+    order[e] = e;
+  }
+  qsort_r(order, batch->n, sizeof(size_t), cmp_batch, batch);
+
+  // dedup chunks are only reachable through the manifests naming them
+  for (size_t j = 0; j < batch->n; ++j) {
+    e = order[j];
+    name = batch->names + batch->at[e];
+    if (dedup_is_chunk(name)) {
+      continue;
+    }
+    tally->n_files++;
+
+    if (tally->want_hashes) {
+      if (tally->n_hashes == tally->cap_hashes) {
+        cap = tally->cap_hashes > 0 ? 2 * tally->cap_hashes : 1024;
+        if ((hashes = realloc(tally->hashes, sizeof(uint64_t) * cap)) ==
+            NULL) {
+          fprintf(stderr, "[FATAL] out of memory\n");
+          exit(EXIT_FAILURE);
+        }
+        tally->hashes = hashes;
+        tally->cap_hashes = cap;
+      }
+      tally->hashes[tally->n_hashes++] = batch->hashes[e];
+    }
+
+    // which pieces are lost depends on how the file was cut, which only
+    // the catalog knows; the configuration may have changed since
+    n_short = tally->n_short;
+    known = list_layout(dfc_op, tally, batch, e, batch->sizes[e], &unit, &k,
+                        &m);
+    if (!list_at_risk(batch, e, k, m)) {
+      printf("%s\n", name);
+    } else if (batch->sizes[e] == UINT64_MAX) {
+      printf("%s (may be incomplete)\n", name);
+      tally->n_short++;
+    } else if (!known) {
+      printf("%s (may be incomplete: layout unknown)\n", name);
+      tally->n_short++;
+    } else if ((lost = list_lost(batch, e, place, unit, k, m, batch->sizes[e],
+                                 &n_total)) == 0) {
+      printf("%s\n", name);
+    } else {
+      printf("%s (incomplete: %" PRIu64 " of %" PRIu64 " %s)\n", name, lost,
+             n_total, k > 0 ? "stripes lost" : "units lost");
+      tally->n_short++;
+    }
+
+    if (tally->catalog != NULL) {
+      catalog_relisted(tally->catalog, name,
+                       batch->holders + e * batch->stride, batch->sizes[e],
+                       tally->n_short > n_short);
+    }
+  }
+  fflush(stdout);  // a page is out before the next is asked for
+
+  free(order);
+  batch->n = 0;
+  batch->len_names = 0;
+}
+
+// ask the next page of every server that has one and whose last page is
+// all out of the merge. returns how many were asked
+static size_t list_pages(DFCOperation *dfc_op, int *sockfds,
+                         ListMerge *pending, const char *frontier) {
+  DFCEventLoop loop;
+  DFCConn *conn;
+  DFCHeader dfc_hdr;
+  ListStream *stream;
+  char hdr_buf[DFC_HDR_MAX];
+  size_t n_asked;
+
+  if (ev_init(&loop, dfc_op->n_servers, RCVTIMEO_SEC * 1000) == -1) {
+    return 0;
+  }
+
+  n_asked = 0;
+  for (size_t srv = 0; srv < dfc_op->n_servers; ++srv) {
+    stream = &pending->streams[srv];
+    if (sockfds[srv] <= 0) {
+      stream->more = 0;  // down, or cut off mid-page
+    }
+    if (!stream->more ||
+        (frontier != NULL && strcmp(stream->cursor, frontier) > 0)) {
+      continue;
+    }
+
+    // the first page starts at the prefix, the rest after the cursor
+    init_hdr(&dfc_hdr, DFC_OP_LIST,
+             stream->answered ? stream->cursor : pending->prefix);
+    dfc_hdr.flags = DFC_LIST_PAGED | (stream->answered ? DFC_LIST_AFTER : 0);
+    dfc_hdr.chunk_offset = pending->len_prefix;
+    dfc_hdr.file_offset = LIST_PAGE_NAMES;
+
+    if ((conn = ev_add_conn(&loop, sockfds[srv], srv, &merge_handler,
+                            pending)) == NULL) {
+      exit(EXIT_FAILURE);
+    }
+    ev_queue_buf(conn, hdr_buf, encode_hdr(&dfc_hdr, hdr_buf), NULL);
+    ev_expect(conn, 1);
+
+    stream->more = 0;
+    stream->n_page = 0;
+    n_asked++;
+  }
+
+  // a server that fails to answer counts as down: it holds nothing live
+  ev_run(&loop);
+  list_cut(dfc_op, sockfds, &loop);
+  ev_destroy(&loop);
+
+  return n_asked;
+}
+
+// the last name every server that has more pages has already sent: the
+// names up to it are complete. NULL when no server has more
+static const char *list_frontier(const ListMerge *pending) {
+  const char *frontier;
+
+  frontier = NULL;
+  for (size_t srv = 0; srv < pending->n_servers; ++srv) {
+    if (pending->streams[srv].more &&
+        (frontier == NULL ||
+         strcmp(pending->streams[srv].cursor, frontier) < 0)) {
+      frontier = pending->streams[srv].cursor;
+    }
+  }
+
+  return frontier;
+}
+
+int list_handle(DFCOperation *dfc_op, int *sockfds, const char *prefix,
+                ListTally *tally) {
+  ListMerge pending, batch;
+  PlaceMap place;
+  const char *frontier;
+  size_t n_answered;
+
+  // it travels as the start of a name
+  if (strlen(prefix) > PATH_MAX) {
+    fprintf(stderr, "[%s] prefix longer than a path\n", __func__);
+    return -1;
+  }
+
+  memset(&pending, 0, sizeof(ListMerge));
+  pending.n_servers = dfc_op->n_servers;
+  pending.stride = (dfc_op->n_servers + 7) / 8;
+  pending.prefix = prefix;
+  pending.len_prefix = strlen(prefix);
+  pending.n_slots = LIST_SLOTS_MIN;
+  // a batch is only printed from, never looked up in: it has no table
+  memset(&batch, 0, sizeof(ListMerge));
+  batch.n_servers = pending.n_servers;
+  batch.stride = pending.stride;
+
+  if ((pending.slots = calloc(pending.n_slots, sizeof(uint32_t))) == NULL ||
+      (pending.streams = calloc(dfc_op->n_servers, sizeof(ListStream))) ==
+          NULL ||
+      (batch.streams = calloc(dfc_op->n_servers, sizeof(ListStream))) ==
+          NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t srv = 0; srv < dfc_op->n_servers; ++srv) {
+    pending.streams[srv].more = 1;
+  }
+
+  // the units are found where the put placed them
+  place_init(&place, dfc_op);
+
+  // each round takes a page from the servers the merge has caught up with,
+  // and prints what no server can add to any more
+  frontier = NULL;
+  while (list_pages(dfc_op, sockfds, &pending, frontier) > 0) {
+    frontier = list_frontier(&pending);
+    list_settle(&pending, &batch, frontier);
+    if (batch.n > 0) {
+      list_print(dfc_op, sockfds, &batch, &place, tally);
+    }
+  }
+
+  n_answered = 0;
+  for (size_t srv = 0; srv < dfc_op->n_servers; ++srv) {
+    n_answered += pending.streams[srv].answered;
+  }
+  if (n_answered > 0 && n_answered < dfc_op->n_servers) {
+    fprintf(stderr, "[INFO] %zu of %zu servers listed their files\n",
+            n_answered, dfc_op->n_servers);
+  }
+  if (tally->n_short > 0) {
+    fprintf(stderr,
+            "[INFO] %zu of %zu files cannot be read whole from the servers "
+            "that answered\n",
+            tally->n_short, tally->n_files);
+  }
+
+  place_free(&place);
+  list_merge_free(&pending);
+  list_merge_free(&batch);
+
+  return n_answered > 0 ? 0 : -1;
+}
+
+// read stripe unit k into codec->raw and compress it into codec->packed.
+// returns the compressed length, or 0 when the unit should go raw: the
+// sample says it will not shrink, or it shrank by less than a sixteenth
+static uint64_t pack_unit(PutCodec *codec, FileTransfer *file, uint64_t unit,
+                          uint64_t k) {
+  uint64_t offset, len;
+  ssize_t n;
+
+  offset = k * unit;
+  len = file->file_size - offset < unit ? file->file_size - offset : unit;
+
+  if (pread(file->fd, codec->raw, len, file->base + offset) != (ssize_t)len ||
+      !lz_worth(codec->raw, len)) {
+    return 0;
+  }
+
+  n = lz_compress(codec->raw, len, codec->packed, len - len / 16,
+                  codec->level);
+
+  return n == -1 ? 0 : (uint64_t)n;
+}
+
+// decide how each stripe unit of the file travels before any server's frame
+// header goes out, since the header states the frame's length. each unit is
+// compressed once; the result is kept for the servers that store it while
+// the cache and the memory budget have room, and compressed again at its
+// turn otherwise
+static void plan_compress(PutCodec *codec, FileTransfer *file, uint64_t key,
+                          uint64_t unit) {
+  UnitCodec *uc;
+  uint64_t len;
+  size_t first, second;
+
+  file->n_units = (file->file_size + unit - 1) / unit;
+  codec->n_units += file->n_units;
+
+  for (uint64_t k = 0; k < file->n_units; ++k) {
+    uc = &file->units[k];
+    if ((uc->zlen = pack_unit(codec, file, unit, k)) == 0) {
+      continue;
+    }
+    uc->zcrc = crc32c(0, codec->packed, uc->zlen);
+
+    len = file->file_size - k * unit < unit ? file->file_size - k * unit
+                                            : unit;
+    codec->n_packed++;
+    codec->raw_bytes += len;
+    codec->wire_bytes += uc->zlen;
+
+    // servers down from the start never come for their copy
+    first = place_group(codec->place, key, k);
+    second = (first + codec->place->n - 1) % codec->place->n;
+    uc->refs = (codec->sockfds[first] > 0) +
+               (second != first && codec->sockfds[second] > 0);
+
+    if (uc->refs == 0 || codec->cached + uc->zlen > PUT_ZCACHE_MAX ||
+        !pool_room(pool_size(uc->zlen))) {
+      continue;
+    }
+
+    uc->zbuf = pool_get(uc->zlen);
+    memcpy(uc->zbuf, codec->packed, uc->zlen);
+    codec->cached += uc->zlen;
+  }
+}
+
+// the frame for one file on one server: its header says how many of the
+// file's stripe units this server holds and how many bytes they add up to
+static void queue_put_hdr(DFCConn *conn, ServerTask *task, FileTransfer *file) {
+  DFCHeader dfc_hdr;
+  DFCFrameHeader frame_hdr;
+  char hdr_buf[DFC_HDR_MAX + DFC_FRAME_HDR_LEN];
+  size_t len_hdr, second, group;
+  uint64_t unit, n_units, n_bytes;
+
+  init_hdr(&dfc_hdr, DFC_OP_PUT, file->fname);
+  dfc_hdr.req_id = task->n_sent;
+  task->file_key = place_key(file->fname);
+
+  if (task->ec_k > 0) {
+    unit = erasure_unit(file->file_size, task->ec_k, task->stripe_unit);
+    task->units_left =
+        erasure_count(task, file, unit, conn->srv_id, &n_bytes);
+  } else {
+    unit = stripe_unit(file->file_size, task->place, task->stripe_unit);
+    n_units = (file->file_size + unit - 1) / unit;
+
+    // whichever server gets to the file first compresses it for all of them
+    if (file->units != NULL && file->n_units == 0) {
+      plan_compress(task->codec, file, task->file_key, unit);
+    }
+
+    // the units of this server's two groups: only the file's last unit may
+    // be short, and compressed ones count their compressed length
+    second = (conn->srv_id + 1) % task->n_servers;
+    task->units_left = 0;
+    n_bytes = 0;
+    for (uint64_t k = 0; k < n_units; ++k) {
+      group = place_group(task->place, task->file_key, k);
+      if (group != conn->srv_id && group != second) {
+        continue;
+      }
+
+      task->units_left++;
+      if (file->units != NULL && file->units[k].zlen > 0) {
+        n_bytes += file->units[k].zlen;
+        dfc_hdr.flags |= DFC_PUT_COMPRESSED;
+      } else {
+        n_bytes += k == n_units - 1 ? file->file_size - k * unit : unit;
+      }
+    }
+  }
+
+  // where next piece starts
+  dfc_hdr.chunk_offset = unit;
+  // where next file starts: the frame carrying this server's units
+  dfc_hdr.file_offset =
+      DFC_FRAME_HDR_LEN + task->units_left * DFC_PIECE_HDR_LEN + n_bytes;
+  len_hdr = encode_hdr(&dfc_hdr, hdr_buf);
+
+  frame_hdr.magic = DFC_FRAME_MAGIC;
+  frame_hdr.version = DFC_FRAME_VERSION;
+  frame_hdr.status = DFC_STATUS_OK;
+  frame_hdr.n_pieces = task->units_left;
+  frame_hdr.req_id = task->n_sent;
+  frame_hdr.file_size = file->file_size;
+  frame_hdr.payload_len = dfc_hdr.file_offset - DFC_FRAME_HDR_LEN;
+  len_hdr += encode_frame_hdr(&frame_hdr, hdr_buf + len_hdr);
+
+#ifdef DEBUG
+  fprintf(stderr, "[INFO] queued %u stripe units of %s\n", frame_hdr.n_pieces,
+          file->fname);
+#endif
+
+  task->n_moved += len_hdr + frame_hdr.payload_len;
+  task->file_unit = unit;
+  task->next_unit = 0;
+
+  // a file too small to reach this server's groups is just the header
+  if (task->units_left == 0) {
+    ev_queue_buf(conn, hdr_buf, len_hdr, file);
+    task->n_in_flight++;
+    task->n_sent++;
+    return;
+  }
+
+  ev_queue_buf(conn, hdr_buf, len_hdr, NULL);
+  task->hdr_queued = 1;
+}
+
+// keep up to PUT_STRIPE_WINDOW stripe units queued on the connection. each
+// unit is read into its own buffer and checksummed there while it is still
+// in cache, and the next ones are only queued as earlier ones leave, so a
+// file of any size costs the same client memory. units are not sent from
+// the file (sendfile, or a mapping): the checksum reads every byte anyway,
+// and bytes sent from the file could differ from the ones it saw, were the
+// file written to in between
+static void put_fill(DFCConn *conn, ServerTask *task) {
+  FileTransfer *file;
+  DFCPieceHeader piece_hdr;
+  UnitCodec *uc;
+  char hdr_buf[DFC_PIECE_HDR_LEN], *buf;
+  size_t second, group, need;
+  void *tag;
+
+  second = (conn->srv_id + 1) % task->n_servers;
+  while (task->n_in_flight < PUT_STRIPE_WINDOW &&
+         task->n_sent < task->n_files) {
+    file = &task->files[task->n_sent];
+    if (!task->hdr_queued && task->journal != NULL &&
+        journal_stored(task->journal, file, conn->srv_id)) {
+      mark_done(file);
+      task->n_resumed++;
+      task->n_sent++;
+      task->n_done++;
+      continue;
+    }
+    if (!task->hdr_queued) {
+      queue_put_hdr(conn, task, file);
+      continue;
+    }
+
+    // what the next unit allocates: a parity piece reads its stripe into
+    // scratch first, and a compressed unit is copied unless its last
+    // holder takes the cached one over
+    if (task->ec_k > 0) {
+      need = pool_size(task->ec_k * task->file_unit) +
+             pool_size(task->file_unit);
+    } else {
+      // next unit in one of this server's two groups
+      while ((group = place_group(task->place, task->file_key,
+                                  task->next_unit)) != conn->srv_id &&
+             group != second) {
+        task->next_unit++;
+      }
+      piece_hdr.flags = group != conn->srv_id ? DFC_PIECE_SECOND : 0;
+
+      uc = file->units != NULL ? &file->units[task->next_unit] : NULL;
+      if (uc == NULL || uc->zlen == 0) {
+        need = pool_size(task->file_unit);
+      } else {
+        need = uc->zbuf != NULL && uc->refs == 1 ? 0 : pool_size(uc->zlen);
+      }
+    }
+
+    // over the memory budget, units wait for the ones in flight to leave.
+    // a connection with none in flight goes ahead, so every server keeps
+    // moving and the budget is overshot by a unit per server at most
+    if (task->n_in_flight > 0 && !pool_room(need)) {
+      break;
+    }
+
+    buf = NULL;
+    if (task->ec_k > 0) {
+      // next piece of a stripe this server holds
+      if ((buf = erasure_next(task, file, conn->srv_id, &piece_hdr)) ==
+          NULL) {
+        ev_fail(conn, "source file truncated");
+        return;
+      }
+    } else {
+      piece_hdr.index = task->next_unit;
+      piece_hdr.offset = task->next_unit * task->file_unit;
+      piece_hdr.len = file->file_size - piece_hdr.offset < task->file_unit
+                          ? file->file_size - piece_hdr.offset
+                          : task->file_unit;
+      task->next_unit++;
+    }
+    piece_hdr.flags |= file->manifest ? DFC_PIECE_MANIFEST : 0;
+
+    // the last unit reports the file, the others only free up the window
+    tag = --task->units_left == 0 ? (void *)file : (void *)task;
+
+    uc = file->units != NULL ? &file->units[piece_hdr.index] : NULL;
+    if (uc == NULL || uc->zlen == 0) {
+      if (buf == NULL) {
+        buf = pool_get(piece_hdr.len);
+      }
+
+      if (task->ec_k == 0 &&
+          pread(file->fd, buf, piece_hdr.len,
+                file->base + piece_hdr.offset) != (ssize_t)piece_hdr.len) {
+        pool_put(buf, piece_hdr.len);
+        ev_fail(conn, "source file truncated");
+        return;
+      }
+
+      piece_hdr.crc = crc32c(0, buf, piece_hdr.len);
+      ev_queue_buf(conn, hdr_buf, encode_piece_hdr(&piece_hdr, hdr_buf),
+                   NULL);
+      ev_queue_owned(conn, buf, piece_hdr.len, tag);
+    } else {
+      piece_hdr.flags |= DFC_PIECE_COMPRESSED;
+      piece_hdr.len = uc->zlen;
+      piece_hdr.crc = uc->zcrc;
+
+      if (uc->zbuf == NULL &&
+          (pack_unit(task->codec, file, task->file_unit, piece_hdr.index) !=
+               uc->zlen ||
+           crc32c(0, task->codec->packed, uc->zlen) != uc->zcrc)) {
+        // the frame header promised a length this unit no longer has
+        ev_fail(conn, "source file changed");
+        return;
+      }
+
+      ev_queue_buf(conn, hdr_buf, encode_piece_hdr(&piece_hdr, hdr_buf),
+                   NULL);
+      if (uc->zbuf == NULL) {
+        ev_queue_buf(conn, task->codec->packed, uc->zlen, tag);
+      } else if (--uc->refs > 0) {
+        ev_queue_buf(conn, uc->zbuf, uc->zlen, tag);
+      } else {
+        // the last holder sends the cached copy itself
+        ev_queue_owned(conn, uc->zbuf, uc->zlen, tag);
+        uc->zbuf = NULL;
+        task->codec->cached -= uc->zlen;
+      }
+    }
+    task->n_in_flight++;
+
+    if (task->units_left == 0) {
+      task->n_sent++;
+      task->hdr_queued = 0;
+    }
+  }
+}
+
+static void put_on_sent(DFCConn *conn, void *tag) {
+  ServerTask *task = (ServerTask *)conn->ctx;
+
+  task->n_in_flight--;
+  if (tag != task) {
+    mark_done((FileTransfer *)tag);
+    if (task->journal != NULL) {
+      journal_put(task->journal, (FileTransfer *)tag, conn->srv_id);
+    }
+    task->n_done++;
+    clock_gettime(CLOCK_MONOTONIC, &task->last);
+  }
+
+  put_fill(conn, task);
+}
+
+static const DFCConnHandler put_handler = {
+    .on_sent = put_on_sent,
+};
+
+int put_handle(PutOperation *put_op) {
+  DFCEventLoop loop;
+  DFCConn *conn;
+  FileTransfer *file;
+  ServerTask tasks[put_op->n_servers];
+  PutCodec codec;
+  struct timespec start, end;
+  uint64_t unit, n_units;
+  unsigned int srv_alloc_start;
+  size_t srv_id, n_resumed;
+  int status;
+
+  // a unit grows with the file so frames stay within n_pieces, but no get
+  // takes a piece over DFC_STRIPE_UNIT_MAX
+  for (size_t i = 0; i < put_op->n_files; ++i) {
+    file = &put_op->files[i];
+    unit = put_op->ec_k > 0 ? erasure_unit(file->file_size, put_op->ec_k,
+                                           put_op->stripe_unit)
+                            : stripe_unit(file->file_size, put_op->place,
+                                          put_op->stripe_unit);
+    if (unit > DFC_STRIPE_UNIT_MAX) {
+      fprintf(stderr, "[%s] %s is too large for %zu servers\n", __func__,
+              file->fname, put_op->n_servers);
+      return -1;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (ev_init(&loop, put_op->n_servers, RCVTIMEO_SEC * 1000) == -1) {
+    return -1;
+  }
+
+  // erasure-coded pieces travel raw: parity is computed over the stripe as
+  // it is on disk
+  memset(tasks, 0, sizeof(tasks));
+  memset(&codec, 0, sizeof(PutCodec));
+  codec.level = put_op->ec_k > 0 ? 0 : put_op->compress_level;
+  codec.sockfds = put_op->sockfds;
+  codec.place = put_op->place;
+
+  // room for every file's unit table and for its largest unit, up front
+  n_units = 0;
+  for (size_t i = 0; codec.level > 0 && i < put_op->n_files; ++i) {
+    file = &put_op->files[i];
+    unit = stripe_unit(file->file_size, put_op->place, put_op->stripe_unit);
+    n_units += (file->file_size + unit - 1) / unit;
+    codec.cap = unit > codec.cap ? unit : codec.cap;
+  }
+
+  if (n_units > 0) {
+    if ((codec.units = calloc(n_units, sizeof(UnitCodec))) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    n_units = 0;
+    for (size_t i = 0; i < put_op->n_files; ++i) {
+      file = &put_op->files[i];
+      unit = stripe_unit(file->file_size, put_op->place,
+                         put_op->stripe_unit);
+      if (file->file_size > 0) {
+        file->units = codec.units + n_units;
+        n_units += (file->file_size + unit - 1) / unit;
+      }
+    }
+  }
+
+  if (codec.cap > 0) {
+    codec.raw = pool_get(codec.cap);
+    codec.packed = pool_get(codec.cap);
+  }
+
+  srv_alloc_start = place_key(put_op->files[0].fname) % put_op->n_servers;
+  for (size_t i = 0; i < put_op->n_servers; ++i) {
+    srv_id = (srv_alloc_start + i) % put_op->n_servers;
+
+    if (put_op->sockfds[srv_id] <= 0) {  // acceptable, decided beforehand
+      continue;
+    }
+
+    memset(&tasks[srv_id], 0, sizeof(ServerTask));
+    tasks[srv_id].files = put_op->files;
+    tasks[srv_id].n_files = put_op->n_files;
+    tasks[srv_id].n_servers = put_op->n_servers;
+    tasks[srv_id].place = put_op->place;
+    tasks[srv_id].stripe_unit = put_op->stripe_unit;
+    tasks[srv_id].codec = codec.level > 0 ? &codec : NULL;
+    tasks[srv_id].ec_k = put_op->ec_k;
+    tasks[srv_id].ec_m = put_op->ec_m;
+    tasks[srv_id].journal = put_op->journal;
+
+    if ((conn = ev_add_conn(&loop, put_op->sockfds[srv_id], srv_id,
+                            &put_handler, &tasks[srv_id])) == NULL) {
+      exit(EXIT_FAILURE);
+    }
+
+    // puts carry no response, so files stream back to back on each
+    // connection, refilled as units leave
+    put_fill(conn, &tasks[srv_id]);
+  }
+
+  status = ev_run(&loop);
+  ev_destroy(&loop);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  add_measured(put_op->place, tasks, &start);
+  n_resumed = 0;
+  for (size_t i = 0; i < put_op->n_servers; ++i) {
+    n_resumed += tasks[i].n_resumed;
+  }
+  if (n_resumed > 0) {
+    fprintf(stderr, "[INFO] %zu file copies were stored by an earlier try\n",
+            n_resumed);
+  }
+
+  // copies left for servers that failed along the way
+  for (size_t i = 0; i < put_op->n_files; ++i) {
+    file = &put_op->files[i];
+    for (uint64_t k = 0; k < file->n_units; ++k) {
+      pool_put(file->units[k].zbuf, file->units[k].zlen);
+    }
+  }
+
+  if (codec.n_units > 0) {
+    fprintf(stderr,
+            "[INFO] compressed %" PRIu64 " of %" PRIu64
+            " stripe units: %" PRIu64 " -> %" PRIu64 " bytes\n",
+            codec.n_packed, codec.n_units, codec.raw_bytes, codec.wire_bytes);
+  }
+  free(codec.units);
+  pool_put(codec.raw, codec.cap);
+  pool_put(codec.packed, codec.cap);
+
+  // the caller reports the failure, once it has closed the journal
+  if (status == -1) {
+    if (put_op->journal != NULL) {
+      fprintf(stderr, "[INFO] put --resume sends only what is missing\n");
+    }
+    return -1;
+  }
+
+  print_transfer_stats("put", put_op->files, put_op->n_files, &start, &end);
+
+  return 0;
 }
 
 void print_socket_buffer(SocketBuffer *sb) {
   fputs("SocketBuffer {\n", stderr);
   fprintf(stderr, "  sockfd = %d\n===\n", sb->sockfd);
-  fwrite(sb->data + sizeof(DFCHeader), sizeof(*sb->data), sb->len_data, stderr);
+  fwrite(sb->data, sizeof(*sb->data), sb->len_data, stderr);
   fprintf(stderr, "\n===\n  len = %zu\n", sb->len_data);
   fputs("}\n", stderr);
 }
@@ -1,68 +1,338 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "dfc/types.h"
 #include "dfc/dfc_util.h"
 #include "dfc/bloom_filter.h"
 
+#define BLOOM_ALIGN 64
+
+typedef int (*BloomProbe)(const uint64_t *, const uint64_t *);
+
+static BloomProbe probe_impl;
+
+// the block an item lands in, and the bits it sets there. the block comes
+// from the high half of the hash scaled to n_blocks, the bits from all 64
+// bits of it
+static const uint64_t *block_mask(const BloomFilter *bf, uint64_t h,
+                                  uint64_t mask[BLOOM_BLOCK_WORDS]) {
+  uint64_t block, g;
+  uint32_t bit;
+
+  block = ((h >> 32) * bf->n_blocks) >> 32;
+
+  // each bit is the top 9 bits of the next step of an LCG seeded with the
+  // hash; plain double hashing within 512 bits repeats masks too often
+  g = h;
+  memset(mask, 0, sizeof(uint64_t) * BLOOM_BLOCK_WORDS);
+  for (uint32_t i = 0; i < bf->k; ++i) {
+    g = g * 6364136223846793005ull + 1442695040888963407ull;
+    bit = g >> (64 - 9);  // log2(BLOOM_BLOCK_BITS)
+    mask[bit / 64] |= 1ull << (bit % 64);
+  }
+
+  return bf->blocks + block * BLOOM_BLOCK_WORDS;
+}
+
+static int probe_sw(const uint64_t *block, const uint64_t *mask) {
+  uint64_t missing;
+
+  missing = 0;
+  for (int i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+    missing |= mask[i] & ~block[i];
+  }
+
+  return missing == 0;
+}
+
+#if defined(__x86_64__)
+// the whole line in two 256-bit tests: testc is set when every mask bit is
+// also set in the block
+__attribute__((target("avx2"))) static int probe_avx2(const uint64_t *block,
+                                                      const uint64_t *mask) {
+  __m256i b0, b1, m0, m1;
+
+  b0 = _mm256_loadu_si256((const __m256i *)block);
+  b1 = _mm256_loadu_si256((const __m256i *)(block + 4));
+  m0 = _mm256_loadu_si256((const __m256i *)mask);
+  m1 = _mm256_loadu_si256((const __m256i *)(mask + 4));
+
+  return _mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1);
+}
+#endif
+
+static void probe_init(void) {
+  probe_impl = probe_sw;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    probe_impl = probe_avx2;
+  }
+#endif
+}
+
+void add_bloom_filter_hash(BloomFilter *bf, uint64_t h) {
+  uint64_t mask[BLOOM_BLOCK_WORDS], *block;
+
+  block = (uint64_t *)block_mask(bf, h, mask);
+  for (int i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+    block[i] |= mask[i];
+  }
+  bf->n_items++;
+}
+
 void add_bloom_filter(BloomFilter *bf, const char *s) {
-  unsigned short h1, h2;
+  add_bloom_filter_hash(bf, hash64(s));
+}
+
+// 0 when the item was certainly never added
+int check_bloom_filter_hash(const BloomFilter *bf, uint64_t h) {
+  uint64_t mask[BLOOM_BLOCK_WORDS];
+  const uint64_t *block;
 
-  h1 = hash_djb2(s);
-  h2 = hash_fnv1a(s);
+  if (probe_impl == NULL) {
+    probe_init();
+  }
+
+  block = block_mask(bf, h, mask);
 
-  set_bit(bf, h1);
-  set_bit(bf, h2);
+  return probe_impl(block, mask);
 }
 
-int check_bloom_filter(BloomFilter *bf, const char *s) {
-  unsigned short h1, h2;
+int check_bloom_filter(const BloomFilter *bf, const char *s) {
+  return check_bloom_filter_hash(bf, hash64(s));
+}
 
-  h1 = hash_djb2(s);
-  h2 = hash_fnv1a(s);
+// false positive rate of a blocked filter of n_blocks blocks holding n items:
+// the number of items in the probed block is Poisson distributed, and each
+// count has the classic rate of a filter the size of one block
+static double blocked_fp_rate(uint64_t n, uint64_t n_blocks, uint32_t k) {
+  double lambda, p_j, fp, hi;
 
-  if (test_bit(bf, h1) && test_bit(bf, h2)) {
-    return 1;
+  lambda = (double)n / n_blocks;
+  hi = lambda + 10 * sqrt(lambda) + 10;
+  p_j = exp(-lambda);
+  fp = 0;
+  for (uint64_t j = 0; j <= hi; ++j) {
+    fp += p_j * pow(1 - pow(1 - 1.0 / BLOOM_BLOCK_BITS, (double)k * j), k);
+    p_j *= lambda / (j + 1);
   }
 
-  return 0;
+  return fp;
 }
 
-BloomFilter *create_bloom_filter(size_t capacity) {
+// sized for capacity items at a false positive rate of fp_rate. the classic
+// m and k are a starting point: keeping each item in one block costs some
+// accuracy, so blocks are added until the blocked rate is met too
+BloomFilter *create_bloom_filter(uint64_t capacity, double fp_rate) {
   BloomFilter *bf;
-  size_t num_uints;
+  double m;
 
-  bf = (BloomFilter *)malloc(sizeof(BloomFilter));
-  if (chk_alloc_err(bf, "malloc", __func__, __LINE__ - 1) == -1) {
+  if (capacity == 0) {
+    capacity = 1;
+  }
+  if (!(fp_rate > 0 && fp_rate < 1)) {
+    fprintf(stderr, "[%s] false positive rate %g outside (0, 1)\n", __func__,
+            fp_rate);
     return NULL;
   }
 
-  num_uints = (capacity + UINT_SZ - 1) / UINT_SZ;
+  bf = (BloomFilter *)calloc(1, sizeof(BloomFilter));
+  if (chk_alloc_err(bf, "calloc", __func__, __LINE__ - 1) == -1) {
+    return NULL;
+  }
 
-  bf->size = 0;
+  m = -(double)capacity * log(fp_rate) / (M_LN2 * M_LN2);
+  bf->k = (uint32_t)lround(m / capacity * M_LN2);
+  bf->k = bf->k < 1 ? 1 : bf->k > BLOOM_K_MAX ? BLOOM_K_MAX : bf->k;
+  bf->n_blocks = (uint64_t)ceil(m / BLOOM_BLOCK_BITS);
+  while (bf->n_blocks <= BLOOM_BLOCKS_MAX &&
+         blocked_fp_rate(capacity, bf->n_blocks, bf->k) > fp_rate) {
+    bf->n_blocks += bf->n_blocks / 16 + 1;
+  }
   bf->capacity = capacity;
 
-  bf->data = (unsigned int *)calloc(num_uints, UINT_SZ);
-  if (chk_alloc_err(bf->data, "calloc", __func__, __LINE__ - 1) == -1) {
+  if (bf->n_blocks > BLOOM_BLOCKS_MAX) {
+    fprintf(stderr, "[%s] %lu items at %g is too large a filter\n", __func__,
+            (unsigned long)capacity, fp_rate);
+    free(bf);
+
+    return NULL;
+  }
+
+  bf->blocks = aligned_alloc(BLOOM_ALIGN, bf->n_blocks * BLOOM_ALIGN);
+  if (chk_alloc_err(bf->blocks, "aligned_alloc", __func__, __LINE__ - 1) ==
+      -1) {
     free(bf);
 
     return NULL;
   }
+  memset(bf->blocks, 0, bf->n_blocks * BLOOM_ALIGN);
 
   return bf;
 }
 
 void destroy_bloom_filter(BloomFilter *bf) {
-  if (bf != NULL) {
-    free(bf->data);
-    free(bf);
+  if (bf == NULL) {
+    return;
+  }
+
+  if (bf->map != NULL) {
+    munmap(bf->map, bf->map_len);
+  } else {
+    free(bf->blocks);
+  }
+  free(bf);
+}
+
+// header on disk (host byte order):
+//   magic:4 | version:4 | k:4 | pad:4 | n_blocks:8 | capacity:8 |
+//   n_items:8 | stamp:8 | pad to BLOOM_HDR_LEN
+static void encode_bloom_hdr(const BloomFilter *bf, char *buf) {
+  uint32_t u32;
+
+  memset(buf, 0, BLOOM_HDR_LEN);
+  u32 = BLOOM_MAGIC;
+  memcpy(buf, &u32, 4);
+  u32 = BLOOM_VERSION;
+  memcpy(buf + 4, &u32, 4);
+  memcpy(buf + 8, &bf->k, 4);
+  memcpy(buf + 16, &bf->n_blocks, 8);
+  memcpy(buf + 24, &bf->capacity, 8);
+  memcpy(buf + 32, &bf->n_items, 8);
+  memcpy(buf + 40, &bf->stamp, 8);
+}
+
+// write the filter next to path and rename it into place, so a reader maps
+// either the old filter or the new one
+int save_bloom_filter(const BloomFilter *bf, const char *path) {
+  char hdr[BLOOM_HDR_LEN], tmp[PATH_MAX];
+  int fd;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >=
+      (int)sizeof(tmp)) {
+    return -1;
+  }
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) ==
+      -1) {
+    fprintf(stderr, "[%s] %s: %s\n", __func__, tmp, strerror(errno));
+    return -1;
+  }
+
+  encode_bloom_hdr(bf, hdr);
+  if (pwrite_all(fd, hdr, BLOOM_HDR_LEN, 0) == -1 ||
+      pwrite_all(fd, (const char *)bf->blocks, bf->n_blocks * BLOOM_ALIGN,
+                 BLOOM_HDR_LEN) == -1 ||
+      close(fd) == -1 || rename(tmp, path) == -1) {
+    fprintf(stderr, "[%s] %s: %s\n", __func__, path, strerror(errno));
+    unlink(tmp);
+    return -1;
   }
+
+  return 0;
+}
+
+// map a saved filter. the mapping is private, so adds stay in this process
+// until the filter is saved again. NULL when there is no valid filter at path
+BloomFilter *load_bloom_filter(const char *path) {
+  BloomFilter *bf;
+  struct stat st;
+  char *map;
+  uint32_t magic, version;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return NULL;
+  }
+
+  if (fstat(fd, &st) == -1 || st.st_size < BLOOM_HDR_LEN ||
+      (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                  0)) == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  bf = (BloomFilter *)calloc(1, sizeof(BloomFilter));
+  if (chk_alloc_err(bf, "calloc", __func__, __LINE__ - 1) == -1) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  memcpy(&magic, map, 4);
+  memcpy(&version, map + 4, 4);
+  memcpy(&bf->k, map + 8, 4);
+  memcpy(&bf->n_blocks, map + 16, 8);
+  memcpy(&bf->capacity, map + 24, 8);
+  memcpy(&bf->n_items, map + 32, 8);
+  memcpy(&bf->stamp, map + 40, 8);
+  bf->blocks = (uint64_t *)(map + BLOOM_HDR_LEN);
+  bf->map = map;
+  bf->map_len = st.st_size;
+
+  if (magic != BLOOM_MAGIC || version != BLOOM_VERSION || bf->k == 0 ||
+      bf->k > BLOOM_K_MAX || bf->n_blocks == 0 ||
+      bf->n_blocks > BLOOM_BLOCKS_MAX ||
+      bf->n_blocks != (uint64_t)(st.st_size - BLOOM_HDR_LEN) / BLOOM_ALIGN ||
+      (st.st_size - BLOOM_HDR_LEN) % BLOOM_ALIGN != 0) {
+    fprintf(stderr, "[%s] %s is not a filter, ignoring it\n", __func__, path);
+    destroy_bloom_filter(bf);
+    return NULL;
+  }
+
+  return bf;
+}
+
+// add every item of src to dst; both have to have been created alike
+int union_bloom_filter(BloomFilter *dst, const BloomFilter *src) {
+  if (dst->n_blocks != src->n_blocks || dst->k != src->k) {
+    fprintf(stderr, "[%s] filters differ in shape\n", __func__);
+    return -1;
+  }
+
+  for (uint64_t i = 0; i < dst->n_blocks * BLOOM_BLOCK_WORDS; ++i) {
+    dst->blocks[i] |= src->blocks[i];
+  }
+  dst->n_items += src->n_items;
+
+  return 0;
 }
 
 unsigned short double_hash(const char *s) {
   return hash_djb2(s) & hash_fnv1a(s);
 }
 
+// 64-bit FNV-1a, finished with the murmur3 mixer so that every input bit
+// reaches the high bits the block is picked with
+uint64_t hash64(const char *s) {
+  uint64_t hash = 14695981039346656037ull;
+
+  while (*s) {
+    hash ^= (unsigned char)*s++;
+    hash *= 1099511628211ull;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
 unsigned short hash_fnv1a(const char *s) {
   unsigned int hash = 2166136261u;
   int c;
@@ -86,28 +356,10 @@ unsigned short hash_djb2(const char *s) {
   return (unsigned short)hash;
 }
 
-void show_set_bits(BloomFilter *bf) {
-  for (size_t i = 0; i < bf->capacity; ++i) {
-    if (test_bit(bf, i)) {
-      fprintf(stderr, "[INFO] bit %zu is set\n", i);
-      continue;
+void show_set_bits(const BloomFilter *bf) {
+  for (uint64_t i = 0; i < bf->n_blocks * BLOOM_BLOCK_BITS; ++i) {
+    if (bf->blocks[i / 64] & (1ull << (i % 64))) {
+      fprintf(stderr, "[INFO] bit %lu is set\n", (unsigned long)i);
     }
   }
 }
-
-void set_bit(BloomFilter *bf, size_t idx) {
-  if (idx >= bf->capacity) {
-    return;
-  }
-
-  bf->data[idx / UINT_SZ] |= (1u << (idx % UINT_SZ));
-  bf->size++;
-}
-
-int test_bit(BloomFilter *bf, size_t idx) {
-  if (idx >= bf->capacity) {
-    return 1;
-  }
-
-  return (bf->data[idx / UINT_SZ] & (1u << (idx % UINT_SZ))) != 0;
-}
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dfc/bloom_filter.h"
+#include "dfc/catalog.h"
+
+// bytes a record takes with a name len bytes long
+static size_t rec_len(const Catalog *catalog, size_t len) {
+  return (CATALOG_REC_LEN + catalog->stride + len + 7) & ~(size_t)7;
+}
+
+// the record at off; 0 when it would run past the end of the map
+static int decode(const Catalog *catalog, size_t off, CatalogEntry *entry) {
+  const char *rec;
+  uint16_t len;
+
+  if (catalog->map_len - off < CATALOG_REC_LEN) {
+    return 0;
+  }
+
+  rec = catalog->map + off;
+  memcpy(&len, rec + 44, 2);
+  if (len == 0 || len > PATH_MAX ||
+      catalog->map_len - off < rec_len(catalog, len)) {
+    return 0;
+  }
+
+  memcpy(&entry->size, rec + 8, 8);
+  memcpy(&entry->unit, rec + 16, 8);
+  memcpy(&entry->etag, rec + 24, 8);
+  memcpy(&entry->stamp, rec + 32, 8);
+  memcpy(&entry->flags, rec + 40, 4);
+  entry->holders = (const uint8_t *)rec + CATALOG_REC_LEN;
+  entry->name = rec + CATALOG_REC_LEN + catalog->stride;
+  entry->name_len = len;
+
+  return 1;
+}
+
+// a record decoded from a writer that died partway is cut short, and what
+// follows it is not a name
+static int intact(const Catalog *catalog, size_t off,
+                  const CatalogEntry *entry) {
+  char name[PATH_MAX + 1];
+  uint64_t hash;
+
+  if (memchr(entry->name, '\0', entry->name_len) != NULL) {
+    return 0;
+  }
+  memcpy(name, entry->name, entry->name_len);
+  name[entry->name_len] = '\0';
+  memcpy(&hash, catalog->map + off, 8);
+
+  return hash == hash64(name);
+}
+
+// the slot holding the latest record of the name, or the empty one it
+// would go in
+static uint64_t *lookup(const Catalog *catalog, const char *name, size_t len,
+                        uint64_t hash) {
+  const char *rec;
+  uint64_t h;
+  uint16_t l;
+  size_t mask, i;
+
+  mask = catalog->n_slots - 1;
+  for (i = hash & mask; catalog->slots[i] != 0; i = (i + 1) & mask) {
+    rec = catalog->map + catalog->slots[i];
+    memcpy(&h, rec, 8);
+    memcpy(&l, rec + 44, 2);
+    if (h == hash && l == len &&
+        memcmp(rec + CATALOG_REC_LEN + catalog->stride, name, len) == 0) {
+      break;
+    }
+  }
+
+  return &catalog->slots[i];
+}
+
+// where the latest record of the name starts, however old; 0 for none
+static uint64_t latest(const Catalog *catalog, const char *name) {
+  if (catalog->map == NULL) {
+    return 0;
+  }
+
+  return *lookup(catalog, name, strlen(name), hash64(name));
+}
+
+static void put_record(FILE *fp, const Catalog *catalog,
+                       const CatalogEntry *entry) {
+  char rec[CATALOG_REC_LEN], pad[8];
+  uint64_t hash;
+  uint16_t len;
+  size_t n_pad;
+
+  memset(rec, 0, CATALOG_REC_LEN);
+  hash = hash64(entry->name);
+  len = entry->name_len;
+  memcpy(rec, &hash, 8);
+  memcpy(rec + 8, &entry->size, 8);
+  memcpy(rec + 16, &entry->unit, 8);
+  memcpy(rec + 24, &entry->etag, 8);
+  memcpy(rec + 32, &entry->stamp, 8);
+  memcpy(rec + 40, &entry->flags, 4);
+  memcpy(rec + 44, &len, 2);
+
+  memset(pad, 0, sizeof(pad));
+  n_pad = rec_len(catalog, len) - CATALOG_REC_LEN - catalog->stride - len;
+  fwrite(rec, 1, CATALOG_REC_LEN, fp);
+  for (size_t i = 0; i < catalog->stride; ++i) {
+    fputc(entry->holders != NULL ? entry->holders[i] : 0, fp);
+  }
+  fwrite(entry->name, 1, len, fp);
+  fwrite(pad, 1, n_pad, fp);
+}
+
+// an empty catalog at path, made by a whole listing at listed (0: none)
+static FILE *start(const Catalog *catalog, const char *path, int64_t listed) {
+  char hdr[CATALOG_HDR_LEN];
+  uint32_t u32;
+  FILE *fp;
+
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "[%s] %s: %s\n", __func__, path, strerror(errno));
+    return NULL;
+  }
+
+  memset(hdr, 0, CATALOG_HDR_LEN);
+  u32 = CATALOG_MAGIC;
+  memcpy(hdr, &u32, 4);
+  u32 = CATALOG_VERSION;
+  memcpy(hdr + 4, &u32, 4);
+  u32 = catalog->n_servers;
+  memcpy(hdr + 8, &u32, 4);
+  memcpy(hdr + 16, &listed, 8);
+  fwrite(hdr, 1, CATALOG_HDR_LEN, fp);
+
+  return fp;
+}
+
+// written next to CATALOG_FILE and renamed into place, so a reader maps
+// either the old catalog or the new one
+static int tmp_path(char *tmp, size_t len) {
+  return snprintf(tmp, len, "%s.%d", CATALOG_FILE, getpid()) < (int)len
+             ? 0
+             : -1;
+}
+
+static int finish(FILE *fp, const char *tmp) {
+  if (fclose(fp) == EOF || rename(tmp, CATALOG_FILE) == -1) {
+    fprintf(stderr, "[%s] %s: %s\n", __func__, CATALOG_FILE,
+            strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
+
+// keep only the latest record of each name, dropping a torn tail with the
+// rest. the map still holds the old catalog, so nothing moves under slots
+static void rewrite(const Catalog *catalog) {
+  char tmp[PATH_MAX];
+  CatalogEntry entry;
+  FILE *fp;
+
+  if (tmp_path(tmp, sizeof(tmp)) == -1 ||
+      (fp = start(catalog, tmp, catalog->listed)) == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < catalog->n_slots; ++i) {
+    if (catalog->slots[i] != 0 &&
+        decode(catalog, catalog->slots[i], &entry)) {
+      fwrite(catalog->map + catalog->slots[i], 1,
+             rec_len(catalog, entry.name_len), fp);
+    }
+  }
+
+  finish(fp, tmp);
+}
+
+void catalog_open(Catalog *catalog, const DFCOperation *dfc_op) {
+  CatalogEntry entry;
+  struct stat st;
+  uint32_t magic, version, n_servers;
+  uint64_t *slot, hash;
+  size_t off, n_max;
+  char *map;
+  int fd;
+
+  memset(catalog, 0, sizeof(Catalog));
+  catalog->ttl = dfc_op->catalog_ttl;
+  catalog->n_servers = dfc_op->n_servers;
+  catalog->stride = (dfc_op->n_servers + 7) / 8;
+
+  if (catalog->ttl == 0 || (fd = open(CATALOG_FILE, O_RDONLY)) == -1) {
+    return;
+  }
+
+  if (fstat(fd, &st) == -1 || st.st_size < CATALOG_HDR_LEN ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+          MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  close(fd);
+
+  // records of another set of servers name holders that are not these
+  memcpy(&magic, map, 4);
+  memcpy(&version, map + 4, 4);
+  memcpy(&n_servers, map + 8, 4);
+  if (magic != CATALOG_MAGIC || version != CATALOG_VERSION ||
+      n_servers != catalog->n_servers) {
+    munmap(map, st.st_size);
+    return;
+  }
+  memcpy(&catalog->listed, map + 16, 8);
+  catalog->map = map;
+  catalog->map_len = st.st_size;
+
+  n_max = (catalog->map_len - CATALOG_HDR_LEN) / rec_len(catalog, 1);
+  for (catalog->n_slots = 1024; catalog->n_slots <= 2 * n_max;
+       catalog->n_slots *= 2) {
+  }
+  if ((catalog->slots = calloc(catalog->n_slots, sizeof(uint64_t))) ==
+      NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (off = CATALOG_HDR_LEN;
+       decode(catalog, off, &entry) && intact(catalog, off, &entry);
+       off += rec_len(catalog, entry.name_len)) {
+    memcpy(&hash, map + off, 8);
+    slot = lookup(catalog, entry.name, entry.name_len, hash);
+    catalog->n_live += *slot == 0;
+    *slot = off;
+    catalog->n_records++;
+  }
+
+  // appends after a torn record would never be read
+  if (off < catalog->map_len ||
+      catalog->n_records > 2 * catalog->n_live + CATALOG_SLACK) {
+    rewrite(catalog);
+  }
+}
+
+int catalog_find(const Catalog *catalog, const char *name,
+                 CatalogEntry *entry) {
+  uint64_t off;
+
+  if ((off = latest(catalog, name)) == 0 || !decode(catalog, off, entry)) {
+    return 0;
+  }
+
+  return (uint64_t)(time(NULL) - entry->stamp) <= catalog->ttl;
+}
+
+void catalog_add(Catalog *catalog, const CatalogEntry *entry) {
+  CatalogEntry rec;
+
+  if (catalog->ttl == 0) {
+    return;
+  }
+
+  // a missing or foreign catalog starts over
+  if (catalog->fp == NULL &&
+      (catalog->fp = catalog->map != NULL ? fopen(CATALOG_FILE, "a")
+                                          : start(catalog, CATALOG_FILE, 0)) ==
+          NULL) {
+    fprintf(stderr, "[%s] unable to write %s\n", __func__, CATALOG_FILE);
+    catalog->ttl = 0;
+    return;
+  }
+
+  rec = *entry;
+  rec.stamp = time(NULL);
+  put_record(catalog->fp, catalog, &rec);
+}
+
+void catalog_sync(Catalog *catalog) {
+  if (catalog->fp != NULL) {
+    fflush(catalog->fp);
+  }
+}
+
+int catalog_listed(const Catalog *catalog) {
+  return catalog->map != NULL && catalog->listed > 0 &&
+         (uint64_t)(time(NULL) - catalog->listed) <= catalog->ttl;
+}
+
+// by name, in the byte order list prints in. only records that decoded are
+// sorted, so the checks below never fail
+static int cmp_name(const void *a, const void *b, void *arg) {
+  CatalogEntry x, y;
+  int c;
+
+  if (!decode(arg, *(const uint64_t *)a, &x) ||
+      !decode(arg, *(const uint64_t *)b, &y)) {
+    return 0;
+  }
+  if ((c = memcmp(x.name, y.name,
+                  x.name_len < y.name_len ? x.name_len : y.name_len)) != 0) {
+    return c;
+  }
+
+  return (x.name_len > y.name_len) - (x.name_len < y.name_len);
+}
+
+size_t catalog_print(const Catalog *catalog, const char *prefix) {
+  CatalogEntry entry;
+  uint64_t *order;
+  size_t n, len;
+
+  if ((order = malloc(sizeof(uint64_t) * (catalog->n_live + 1))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  len = strlen(prefix);
+  n = 0;
+  for (size_t i = 0; i < catalog->n_slots; ++i) {
+    if (catalog->slots[i] != 0 &&
+        decode(catalog, catalog->slots[i], &entry) &&
+        entry.name_len >= len && memcmp(entry.name, prefix, len) == 0) {
+      order[n++] = catalog->slots[i];
+    }
+  }
+  qsort_r(order, n, sizeof(uint64_t), cmp_name, (void *)catalog);
+
+  for (size_t i = 0; i < n; ++i) {
+    decode(catalog, order[i], &entry);
+    printf("%.*s%s\n", (int)entry.name_len, entry.name,
+           entry.flags & CATALOG_SHORT ? " (may be incomplete)" : "");
+  }
+  fflush(stdout);
+
+  free(order);
+
+  return n;
+}
+
+void catalog_relist(Catalog *catalog) {
+  char tmp[PATH_MAX];
+
+  if (catalog->ttl == 0 || tmp_path(tmp, sizeof(tmp)) == -1) {
+    return;
+  }
+
+  catalog->listed = time(NULL);
+  catalog->relist = start(catalog, tmp, catalog->listed);
+}
+
+// a file the listing printed, last seen on holders, size bytes long when
+// the listing had to ask (UINT64_MAX otherwise), short when some of its
+// pieces have no copy on a server that answered
+void catalog_relisted(Catalog *catalog, const char *name,
+                      const uint8_t *holders, uint64_t size, int is_short) {
+  CatalogEntry entry;
+  uint64_t off;
+
+  if (catalog->relist == NULL) {
+    return;
+  }
+
+  memset(&entry, 0, sizeof(CatalogEntry));
+  entry.size = UINT64_MAX;
+  entry.stamp = catalog->listed;
+  if ((off = latest(catalog, name)) != 0) {
+    decode(catalog, off, &entry);
+    entry.flags &= ~CATALOG_SHORT;
+  }
+  // a size that moved says the layout recorded is of another file
+  if (size != UINT64_MAX && size != entry.size) {
+    entry.size = size;
+    entry.unit = entry.etag = 0;
+  }
+
+  entry.name = name;
+  entry.name_len = strlen(name);
+  entry.holders = holders;
+  entry.flags |= is_short ? CATALOG_SHORT : 0;
+  put_record(catalog->relist, catalog, &entry);
+}
+
+// the listing is over; it replaces the catalog only when it went through
+void catalog_relist_done(Catalog *catalog, int ok) {
+  char tmp[PATH_MAX];
+
+  if (catalog->relist == NULL) {
+    return;
+  }
+
+  tmp_path(tmp, sizeof(tmp));
+  if (ok) {
+    finish(catalog->relist, tmp);
+  } else {
+    fclose(catalog->relist);
+    unlink(tmp);
+  }
+  catalog->relist = NULL;
+}
+
+void catalog_close(Catalog *catalog) {
+  catalog_relist_done(catalog, 0);
+
+  if (catalog->fp != NULL && fclose(catalog->fp) == EOF) {
+    fprintf(stderr, "[%s] %s: %s\n", __func__, CATALOG_FILE,
+            strerror(errno));
+  }
+  if (catalog->map != NULL) {
+    munmap(catalog->map, catalog->map_len);
+  }
+  free(catalog->slots);
+  memset(catalog, 0, sizeof(Catalog));
+}
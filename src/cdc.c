@@ -0,0 +1,78 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dfc/cdc.h"
+
+// boundaries have to come out the same on every client, so the table is
+// derived from a fixed seed; changing either moves every chunk
+#define CDC_GEAR_SEED 0x9e3779b97f4a7c15ull
+
+static uint64_t gear[256];
+static int gear_ready;
+
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z;
+
+  z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+  return z ^ (z >> 31);
+}
+
+static uint64_t top_bits(int n) { return ~0ull << (64 - n); }
+
+// avg is rounded down to a power of two within [CDC_AVG_MIN, CDC_AVG_MAX]
+void cdc_init(CDCParams *params, size_t avg) {
+  uint64_t state;
+  int bits;
+
+  if (!gear_ready) {
+    state = CDC_GEAR_SEED;
+    for (int i = 0; i < 256; ++i) {
+      gear[i] = splitmix64(&state);
+    }
+    gear_ready = 1;
+  }
+
+  avg = avg < CDC_AVG_MIN ? CDC_AVG_MIN : avg > CDC_AVG_MAX ? CDC_AVG_MAX : avg;
+  for (bits = 0; ((size_t)2 << bits) <= avg; ++bits) {
+  }
+
+  params->avg = (size_t)1 << bits;
+  params->min = params->avg / 4;
+  params->max = params->avg * 4;
+  params->mask_s = top_bits(bits + 2);
+  params->mask_l = top_bits(bits - 2);
+}
+
+// length of the chunk that starts at p, given len bytes from there on
+size_t cdc_cut(const CDCParams *params, const unsigned char *p, size_t len) {
+  uint64_t h;
+  size_t i, normal;
+
+  if (len <= params->min) {
+    return len;
+  }
+  if (len > params->max) {
+    len = params->max;
+  }
+  normal = len < params->avg ? len : params->avg;
+
+  // nothing before min can be a cut, so hashing starts there
+  h = 0;
+  for (i = params->min; i < normal; ++i) {
+    h = (h << 1) + gear[p[i]];
+    if (!(h & params->mask_s)) {
+      return i + 1;
+    }
+  }
+  for (; i < len; ++i) {
+    h = (h << 1) + gear[p[i]];
+    if (!(h & params->mask_l)) {
+      return i + 1;
+    }
+  }
+
+  return len;
+}
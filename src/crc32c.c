@@ -0,0 +1,99 @@
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "dfc/crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78u  // reflected
+
+// slicing-by-8: table[k][b] is the crc of byte b followed by k zero bytes
+static uint32_t crc_table[8][256];
+
+static uint32_t (*crc_impl)(uint32_t, const unsigned char *, size_t);
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t word;
+
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; --len) {
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&word, p, 8);
+    word = htole64(word) ^ crc;
+    crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+          crc_table[5][(word >> 16) & 0xff] ^
+          crc_table[4][(word >> 24) & 0xff] ^
+          crc_table[3][(word >> 32) & 0xff] ^
+          crc_table[2][(word >> 40) & 0xff] ^
+          crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+  }
+
+  for (; len > 0; --len) {
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t crc64, word;
+
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; --len) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+
+  crc64 = crc;
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+
+  for (; len > 0; --len) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+
+  return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+  uint32_t crc;
+
+  for (uint32_t b = 0; b < 256; ++b) {
+    crc = b;
+    for (int k = 0; k < 8; ++k) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc_table[0][b] = crc;
+  }
+
+  for (uint32_t b = 0; b < 256; ++b) {
+    for (int k = 1; k < 8; ++k) {
+      crc_table[k][b] =
+          crc_table[0][crc_table[k - 1][b] & 0xff] ^ (crc_table[k - 1][b] >> 8);
+    }
+  }
+
+  crc_impl = crc32c_sw;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc_impl = crc32c_hw;
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  if (crc_impl == NULL) {
+    crc32c_init();
+  }
+
+  return ~crc_impl(~crc, (const unsigned char *)buf, len);
+}
@@ -0,0 +1,514 @@
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dfc/async.h"
+#include "dfc/cdc.h"
+#include "dfc/dfc_util.h"
+#include "dfc/pool.h"
+#include "dfc/sha256.h"
+#include "dfc/dedup.h"
+
+// digests seen so far, each with where its first chunk starts. open
+// addressing on the digest's leading bytes, which are already uniform
+typedef struct {
+  unsigned char digest[SHA256_LEN];
+  uint64_t offset;
+  int used;
+} DigestSlot;
+
+typedef struct {
+  DigestSlot *slots;
+  size_t cap, n;
+} DigestSet;
+
+static void set_init(DigestSet *set, size_t n) {
+  for (set->cap = 16; set->cap < 2 * n; set->cap *= 2) {
+  }
+  set->n = 0;
+
+  if ((set->slots = calloc(set->cap, sizeof(DigestSlot))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static DigestSlot *set_slot(DigestSlot *slots, size_t cap,
+                            const unsigned char *digest) {
+  uint64_t h;
+  size_t i;
+
+  memcpy(&h, digest, sizeof(h));
+  for (i = h & (cap - 1);
+       slots[i].used && memcmp(slots[i].digest, digest, SHA256_LEN) != 0;
+       i = (i + 1) & (cap - 1)) {
+  }
+
+  return &slots[i];
+}
+
+// the slot of digest, filled with offset when it was not there yet
+static DigestSlot *set_add(DigestSet *set, const unsigned char *digest,
+                           uint64_t offset, int *added) {
+  DigestSlot *slots, *slot;
+
+  // kept at most half full
+  if (2 * (set->n + 1) > set->cap) {
+    if ((slots = calloc(2 * set->cap, sizeof(DigestSlot))) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < set->cap; ++i) {
+      if (set->slots[i].used) {
+        *set_slot(slots, 2 * set->cap, set->slots[i].digest) = set->slots[i];
+      }
+    }
+
+    free(set->slots);
+    set->slots = slots;
+    set->cap *= 2;
+  }
+
+  slot = set_slot(set->slots, set->cap, digest);
+  *added = !slot->used;
+  if (*added) {
+    memcpy(slot->digest, digest, SHA256_LEN);
+    slot->offset = offset;
+    slot->used = 1;
+    set->n++;
+  }
+
+  return slot;
+}
+
+// manifests are big-endian and their fields unaligned
+static uint32_t get32(const char *buf) {
+  uint32_t u32;
+
+  memcpy(&u32, buf, 4);
+
+  return be32toh(u32);
+}
+
+static void put32(char *buf, uint32_t u32) {
+  u32 = htobe32(u32);
+  memcpy(buf, &u32, 4);
+}
+
+static void put64(char *buf, uint64_t u64) {
+  u64 = htobe64(u64);
+  memcpy(buf, &u64, 8);
+}
+
+int dedup_is_chunk(const char *fname) {
+  return strncmp(fname, DEDUP_CHUNK_PREFIX, sizeof(DEDUP_CHUNK_PREFIX) - 1) ==
+         0;
+}
+
+static void chunk_name(const unsigned char *digest, char *fname) {
+  static const char hex[] = "0123456789abcdef";
+  char *p;
+
+  p = stpcpy(fname, DEDUP_CHUNK_PREFIX);
+  for (size_t i = 0; i < SHA256_LEN; ++i) {
+    *p++ = hex[digest[i] >> 4];
+    *p++ = hex[digest[i] & 0xf];
+  }
+  *p = '\0';
+}
+
+// the digest a chunk file is named after, or -1 for any other name
+static int chunk_digest(const char *fname, unsigned char *digest) {
+  unsigned int byte;
+
+  if (!dedup_is_chunk(fname) || strlen(fname) != DEDUP_CHUNK_NAME_LEN) {
+    return -1;
+  }
+
+  fname += sizeof(DEDUP_CHUNK_PREFIX) - 1;
+  for (size_t i = 0; i < SHA256_LEN; ++i) {
+    if (sscanf(fname + 2 * i, "%2x", &byte) != 1) {
+      return -1;
+    }
+    digest[i] = byte;
+  }
+
+  return 0;
+}
+
+// every chunk any connected server lists. a server holding a chunk lists it
+// even when none of its stripe units fell there, so the listings of the
+// servers that are up cover everything that can be fetched
+static void load_known(PutOperation *put_op, DigestSet *known) {
+  unsigned char digest[SHA256_LEN];
+  char *names;
+  size_t len;
+  int added;
+
+  for (size_t i = 0; i < put_op->n_servers; ++i) {
+    if (put_op->sockfds[i] <= 0) {
+      continue;
+    }
+
+    if ((names = list_names(put_op->sockfds[i], &len)) == NULL) {
+      fprintf(stderr,
+              "[ERROR] listing server %zu failed, chunks it holds may be "
+              "sent again\n",
+              i);
+      continue;
+    }
+
+    for (size_t j = 0; j < len; j += strlen(names + j) + 1) {
+      if (chunk_digest(names + j, digest) == 0) {
+        set_add(known, digest, 0, &added);
+      }
+    }
+
+    free(names);
+  }
+}
+
+// put one round of files; returns what put_handle does
+static int put_batch(PutOperation *put_op, FileTransfer *batch,
+                     size_t *n_batch) {
+  PutOperation round;
+  int status;
+
+  if (*n_batch == 0) {
+    return 0;
+  }
+
+  round = *put_op;
+  round.files = batch;
+  round.n_files = *n_batch;
+  status = put_handle(&round);
+
+  memset(batch, 0, sizeof(FileTransfer) * DEDUP_BATCH);
+  *n_batch = 0;
+
+  return status;
+}
+
+static void manifest_grow(char **manifest, size_t *cap, size_t len) {
+  if (len <= *cap) {
+    return;
+  }
+
+  *cap = len > 2 * *cap ? len : 2 * *cap;
+  if ((*manifest = realloc_buf(*manifest, *cap)) == NULL) {
+    exit(EXIT_FAILURE);
+  }
+}
+
+// put every file as a manifest of its chunks, sending only the chunks no
+// server holds yet. chunks go out in rounds of DEDUP_BATCH files; the
+// manifests go last, and only once every chunk round went through, so none
+// of them names a chunk that is not stored. returns -1 when a round failed
+int dedup_put(PutOperation *put_op) {
+  CDCParams params;
+  DigestSet known;
+  FileTransfer *batch, *file, *chunk;
+  unsigned char digest[SHA256_LEN], *map;
+  char *manifest, *entry;
+  size_t n_batch, len_manifest, cap_manifest;
+  uint64_t *at, offset, len, n_chunks, n_new, new_bytes, total_bytes;
+  uint32_t n_entries;
+  int mfd, added, status;
+
+  cdc_init(&params, put_op->dedup_chunk);
+  set_init(&known, 1024);
+  load_known(put_op, &known);
+
+  if ((batch = calloc(DEDUP_BATCH, sizeof(FileTransfer))) == NULL ||
+      (at = calloc(put_op->n_files + 1, sizeof(uint64_t))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  manifest = NULL;
+  n_batch = len_manifest = cap_manifest = 0;
+  n_chunks = n_new = new_bytes = total_bytes = 0;
+  status = 0;
+  for (size_t i = 0; i < put_op->n_files && status == 0; ++i) {
+    file = &put_op->files[i];
+    at[i] = len_manifest;
+    len_manifest += DEDUP_MANIFEST_HDR_LEN;
+    manifest_grow(&manifest, &cap_manifest, len_manifest);
+
+    map = NULL;
+    if (file->file_size > 0) {
+      if ((map = mmap(NULL, file->file_size, PROT_READ, MAP_PRIVATE, file->fd,
+                      0)) == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] mmap %s: %s\n", file->fname, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      madvise(map, file->file_size, MADV_SEQUENTIAL);
+    }
+
+    n_entries = 0;
+    for (offset = 0; offset < file->file_size && status == 0; offset += len) {
+      len = cdc_cut(&params, map + offset, file->file_size - offset);
+      sha256(map + offset, len, digest);
+
+      manifest_grow(&manifest, &cap_manifest, len_manifest + DEDUP_ENTRY_LEN);
+      entry = manifest + len_manifest;
+      put32(entry, len);
+      memcpy(entry + 4, digest, SHA256_LEN);
+      len_manifest += DEDUP_ENTRY_LEN;
+      n_entries++;
+
+      n_chunks++;
+      total_bytes += len;
+      set_add(&known, digest, 0, &added);
+      if (!added) {
+        continue;
+      }
+
+      // a chunk file is a slice of the file being put
+      chunk = &batch[n_batch++];
+      chunk_name(digest, chunk->fname);
+      chunk->fd = file->fd;
+      chunk->base = offset;
+      chunk->file_size = len;
+      n_new++;
+      new_bytes += len;
+
+      if (n_batch == DEDUP_BATCH) {
+        status = put_batch(put_op, batch, &n_batch);
+      }
+    }
+
+    if (map != NULL) {
+      munmap(map, file->file_size);
+    }
+
+    entry = manifest + at[i];
+    put32(entry, DEDUP_MANIFEST_MAGIC);
+    put32(entry + 4, DEDUP_MANIFEST_VERSION);
+    put64(entry + 8, file->file_size);
+    put32(entry + 16, n_entries);
+  }
+  at[put_op->n_files] = len_manifest;
+
+  // the last chunks go out on their own, for the manifests to wait on
+  if (status == 0) {
+    status = put_batch(put_op, batch, &n_batch);
+  }
+  if (status == -1) {
+    fprintf(stderr, "[ERROR] dedup: chunks did not all go through, so no "
+                    "manifest was sent\n");
+    free(manifest);
+    free(at);
+    free(batch);
+    free(known.slots);
+    return -1;
+  }
+
+  // the manifests are put from memory like any file, each a slice of one
+  if ((mfd = memfd_create("dfc-manifests", MFD_CLOEXEC)) == -1 ||
+      pwrite_all(mfd, manifest, len_manifest, 0) == -1) {
+    perror("[ERROR] manifests");
+    exit(EXIT_FAILURE);
+  }
+  free(manifest);
+
+  for (size_t i = 0; i < put_op->n_files && status == 0; ++i) {
+    file = &batch[n_batch++];
+    memcpy(file->fname, put_op->files[i].fname,
+           strlen(put_op->files[i].fname) + 1);
+    file->fd = mfd;
+    file->base = at[i];
+    file->file_size = at[i + 1] - at[i];
+    file->manifest = 1;
+
+    if (n_batch == DEDUP_BATCH) {
+      status = put_batch(put_op, batch, &n_batch);
+    }
+  }
+  if (status == 0) {
+    status = put_batch(put_op, batch, &n_batch);
+  }
+
+  fprintf(stderr,
+          "[INFO] dedup: %" PRIu64 " chunks, %" PRIu64 " new; sent %" PRIu64
+          " of %" PRIu64 " bytes\n",
+          n_chunks, n_new, new_bytes, total_bytes);
+
+  close(mfd);
+  free(at);
+  free(batch);
+  free(known.slots);
+
+  return status;
+}
+
+// fetch a round of chunks into the file they belong to, and check each one
+// against the digest it is named after
+static int get_batch(GetOperation *get_op, FileTransfer *batch, size_t n_batch,
+                     char *buf) {
+  GetOperation round;
+  FileTransfer *chunk;
+  unsigned char want[SHA256_LEN], got[SHA256_LEN];
+  uint64_t len;
+  int status;
+
+  if (n_batch == 0) {
+    return 0;
+  }
+
+  round = *get_op;
+  round.files = batch;
+  round.n_files = n_batch;
+  round.ranged = 0;  // chunks come whole, the file is cut afterwards
+  round.resumed = 0;
+  round.journal = NULL;
+  if (get_fetch(&round) == -1) {
+    return -1;
+  }
+
+  status = 0;
+  for (size_t i = 0; i < n_batch; ++i) {
+    chunk = &batch[i];
+    len = chunk->file_size;
+
+    if (chunk->n_found == 0) {
+      fprintf(stderr, "[ERROR] chunk %s not found\n", chunk->fname);
+      status = -1;
+    } else if (chunk->n_bad > 0 || chunk->n_recv != len) {
+      fprintf(stderr, "[ERROR] chunk %s is incomplete\n", chunk->fname);
+      status = -1;
+    } else if (chunk_digest(chunk->fname, want) == -1 ||
+               pread(chunk->fd, buf, len, chunk->base) != (ssize_t)len ||
+               (sha256(buf, len, got), memcmp(want, got, SHA256_LEN)) != 0) {
+      fprintf(stderr, "[ERROR] chunk %s does not match its digest\n",
+              chunk->fname);
+      status = -1;
+    }
+
+    free(chunk->bad_pieces);
+  }
+
+  memset(batch, 0, sizeof(FileTransfer) * DEDUP_BATCH);
+
+  return status;
+}
+
+// file holds the manifest a get received: fetch each distinct chunk once,
+// straight into its place in the file, then copy the repeats locally
+int dedup_restore(GetOperation *get_op, FileTransfer *file) {
+  DigestSet firsts;
+  DigestSlot *slot;
+  FileTransfer *batch, *chunk;
+  char *manifest, *entry, *buf;
+  uint64_t size, offset, len, max_len;
+  uint32_t n_chunks;
+  size_t n_batch;
+  int status, added;
+
+  if (file->file_size < DEDUP_MANIFEST_HDR_LEN ||
+      (manifest = alloc_buf(file->file_size)) == NULL) {
+    fprintf(stderr, "[ERROR] %s: malformed manifest\n", file->fname);
+    return -1;
+  }
+
+  if (pread(file->fd, manifest, file->file_size, 0) !=
+      (ssize_t)file->file_size) {
+    perror("[ERROR] pread");
+    free(manifest);
+    return -1;
+  }
+
+  size = (uint64_t)get32(manifest + 8) << 32 | get32(manifest + 12);
+  n_chunks = get32(manifest + 16);
+
+  // the lengths have to add up before anything is written
+  max_len = offset = 0;
+  if (get32(manifest) == DEDUP_MANIFEST_MAGIC &&
+      get32(manifest + 4) == DEDUP_MANIFEST_VERSION &&
+      file->file_size ==
+          DEDUP_MANIFEST_HDR_LEN + (uint64_t)n_chunks * DEDUP_ENTRY_LEN) {
+    for (uint32_t i = 0; i < n_chunks; ++i) {
+      entry = manifest + DEDUP_MANIFEST_HDR_LEN + i * DEDUP_ENTRY_LEN;
+      len = get32(entry);
+      max_len = len > max_len ? len : max_len;
+      offset += len;
+    }
+  }
+
+  if (offset != size || (size > 0 && max_len == 0)) {
+    fprintf(stderr, "[ERROR] %s: malformed manifest\n", file->fname);
+    free(manifest);
+    return -1;
+  }
+
+  if ((batch = calloc(DEDUP_BATCH, sizeof(FileTransfer))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  buf = pool_get(max_len);
+  set_init(&firsts, n_chunks);
+
+  status = 0;
+  n_batch = 0;
+  offset = 0;
+  for (uint32_t i = 0; i < n_chunks; ++i, offset += len) {
+    entry = manifest + DEDUP_MANIFEST_HDR_LEN + i * DEDUP_ENTRY_LEN;
+    len = get32(entry);
+    set_add(&firsts, (unsigned char *)entry + 4, offset, &added);
+    if (!added) {
+      continue;
+    }
+
+    chunk = &batch[n_batch++];
+    chunk_name((unsigned char *)entry + 4, chunk->fname);
+    chunk->fd = file->fd;
+    chunk->base = offset;
+
+    if (n_batch == DEDUP_BATCH) {
+      status |= get_batch(get_op, batch, n_batch, buf);
+      n_batch = 0;
+    }
+  }
+  status |= get_batch(get_op, batch, n_batch, buf);
+
+  // repeats of a chunk are copies of where it first landed
+  offset = 0;
+  for (uint32_t i = 0; status == 0 && i < n_chunks; ++i, offset += len) {
+    entry = manifest + DEDUP_MANIFEST_HDR_LEN + i * DEDUP_ENTRY_LEN;
+    len = get32(entry);
+    slot = set_add(&firsts, (unsigned char *)entry + 4, offset, &added);
+    if (slot->offset == offset) {
+      continue;
+    }
+
+    if (pread(file->fd, buf, len, slot->offset) != (ssize_t)len ||
+        pwrite_all(file->fd, buf, len, offset) == -1) {
+      perror("[ERROR] copy chunk");
+      status = -1;
+    }
+  }
+
+  if (status == 0) {
+    fprintf(stderr,
+            "[INFO] %s: rebuilt from %" PRIu32 " chunks (%zu distinct)\n",
+            file->fname, n_chunks, firsts.n);
+    file->file_size = size;
+    file->n_recv = size;
+  }
+
+  free(firsts.slots);
+  free(batch);
+  pool_put(buf, max_len);
+  free(manifest);
+
+  return status == 0 ? 0 : -1;
+}
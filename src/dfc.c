@@ -1,114 +1,577 @@
 #include <errno.h>
-#include <pthread.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "dfc/agent.h"
 #include "dfc/bloom_filter.h"
+#include "dfc/catalog.h"
+#include "dfc/dedup.h"
 #include "dfc/dfc_util.h"
+#include "dfc/erasure.h"
+#include "dfc/hedge.h"
+#include "dfc/journal.h"
 #include "dfc/async.h"
+#include "dfc/place.h"
+#include "dfc/pool.h"
 #include "dfc/sk_util.h"
 #include "dfc/dfc.h"
 
-DFCCommand dfc_cmds[] = {{.cmd = "get", .hash = 0},
+DFCCommand dfc_cmds[] = {{.cmd = "agent", .hash = 0},
+                         {.cmd = "get", .hash = 0},
                          {.cmd = "list", .hash = 0},
                          {.cmd = "put", .hash = 0}};
 
-int run_handler(int argc, char *argv[]) {
-  DFCOperation *dfc_op;
-  unsigned int cmd_hash;
-  pthread_t handler_tid;
+static FileTransfer *init_transfers(int n_fnames, char *fnames[], int for_put,
+                                   size_t *n_files) {
+  FileTransfer *files;
+  struct stat st;
+  int fd;
+
+  if ((files = calloc(n_fnames, sizeof(FileTransfer))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  *n_files = 0;
+  for (int i = 0; i < n_fnames; ++i) {
+    fd = -1;
+    if (for_put) {
+      if ((fd = open(fnames[i], O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        if (errno == ENOENT) {
+          fprintf(stderr, "[ERROR] file %s not found\n", fnames[i]);
+        } else if (errno == EACCES) {
+          fprintf(stderr, "[ERROR] file %s not readable\n", fnames[i]);
+        } else {
+          perror("[ERROR]");
+        }
+
+        if (fd != -1) {
+          close(fd);
+        }
+        continue;
+      }
+
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      files[*n_files].file_size = st.st_size;
+      files[*n_files].mtime =
+          (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    strncpy(files[*n_files].fname, fnames[i], PATH_MAX);
+    files[*n_files].fd = fd;
+    (*n_files)++;
+  }
+
+  if (*n_files == 0) {
+    free(files);
+    return NULL;
+  }
+
+  return files;
+}
+
+static void free_transfers(FileTransfer *files, size_t n_files) {
+  for (size_t i = 0; files != NULL && i < n_files; ++i) {
+    if (files[i].fd != -1 && close(files[i].fd) == -1) {
+      fprintf(stderr, "[%s] failed to close %s: %s\n", __func__,
+              files[i].fname, strerror(errno));
+    }
+    free(files[i].have);
+  }
+
+  free(files);
+}
 
-  if ((dfc_op = read_config()) == NULL) {
+static void free_op(DFCOperation *dfc_op) {
+  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+    free(dfc_op->servers[i]);
+  }
+  free(dfc_op->servers);
+  free(dfc_op->weights);
+
+  free(dfc_op);
+}
+
+// connect only to the servers the get plan needs. a server that turns out to
+// be down is marked and the plan redone around it, which may pull in its
+// neighbours; each round settles at least one server, so this ends
+static int connect_get_plan(DFCOperation *dfc_op, int *sockfds, size_t start,
+                            uint16_t *piece_flags) {
+  uint16_t want[dfc_op->n_servers];
+  size_t n_new;
+
+  for (;;) {
+    if (plan_get(sockfds, dfc_op->n_servers, start, piece_flags) == -1) {
+      return -1;
+    }
+
+    n_new = 0;
+    for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+      want[i] = sockfds[i] == 0 ? piece_flags[i] : 0;
+      n_new += want[i] != 0;
+    }
+
+    if (n_new == 0) {
+      return 0;
+    }
+
+    fill_sk_set(dfc_op, sockfds, want);
+  }
+}
+
+// an erasure-coded get needs every server: each holds data of some stripes.
+// with all of them up, data is enough; otherwise every live server sends its
+// parity too, which files still in adjacent pairs do not mind either
+static int connect_erasure_plan(DFCOperation *dfc_op, int *sockfds,
+                                uint16_t *piece_flags) {
+  uint16_t want[dfc_op->n_servers];
+  size_t n_down;
+
+  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+    want[i] = sockfds[i] == 0;
+  }
+  fill_sk_set(dfc_op, sockfds, want);
+
+  n_down = count_down(sockfds, dfc_op->n_servers);
+
+  if (n_down > dfc_op->ec_m) {
+    fprintf(stderr, "[%s] %zu servers down, erasure %u+%u survives %u\n",
+            __func__, n_down, dfc_op->ec_k, dfc_op->ec_m, dfc_op->ec_m);
     return -1;
   }
 
+  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+    piece_flags[i] = sockfds[i] <= 0 ? 0
+                     : n_down == 0   ? DFC_GET_PIECE_FIRST
+                                     : DFC_GET_PIECE_BOTH;
+  }
+
+  return 0;
+}
+
+// NAMES_FILTER, while it can still be trusted: name_cache is on, and the
+// list it was built from is recent enough
+static BloomFilter *names_load(const DFCOperation *dfc_op) {
+  BloomFilter *names;
+
+  if (dfc_op->name_cache == 0 ||
+      (names = load_bloom_filter(NAMES_FILTER)) == NULL) {
+    return NULL;
+  }
+
+  if ((uint64_t)time(NULL) - names->stamp > dfc_op->name_cache ||
+      names->n_items > names->capacity) {
+    destroy_bloom_filter(names);
+    return NULL;
+  }
+
+  return names;
+}
+
+// drop the names the servers do not have, reporting each as a get would;
+// returns how many are left at the front of fnames
+static int names_drop_missing(const DFCOperation *dfc_op, int n_fnames,
+                              char *fnames[]) {
+  BloomFilter *names;
+  int n;
+
+  if ((names = names_load(dfc_op)) == NULL) {
+    return n_fnames;
+  }
+
+  n = 0;
+  for (int i = 0; i < n_fnames; ++i) {
+    if (check_bloom_filter(names, fnames[i])) {
+      fnames[n++] = fnames[i];
+    } else {
+      fprintf(stderr, "[ERROR] %s not found\n", fnames[i]);
+    }
+  }
+
+  destroy_bloom_filter(names);
+
+  return n;
+}
+
+// files this client put are there now too. a filter that fills up is
+// removed rather than trusted past its rate, until the next list
+static void names_add(const DFCOperation *dfc_op, FileTransfer *files,
+                      size_t n_files) {
+  BloomFilter *names;
+
+  if ((names = names_load(dfc_op)) == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < n_files; ++i) {
+    add_bloom_filter(names, files[i].fname);
+  }
+
+  if (names->n_items > names->capacity) {
+    unlink(NAMES_FILTER);
+  } else {
+    save_bloom_filter(names, NAMES_FILTER);
+  }
+
+  destroy_bloom_filter(names);
+}
+
+// rebuild NAMES_FILTER from the names a whole listing of every connected
+// server printed: a file put while one server was down is still listed by
+// the others
+static void names_rebuild(const ListTally *tally) {
+  BloomFilter *names;
+
+  if ((names = create_bloom_filter(2 * tally->n_hashes + NAMES_FILTER_SLACK,
+                                   NAMES_FILTER_FP)) == NULL) {
+    return;
+  }
+
+  names->stamp = time(NULL);
+  for (size_t i = 0; i < tally->n_hashes; ++i) {
+    add_bloom_filter_hash(names, tally->hashes[i]);
+  }
+
+  save_bloom_filter(names, NAMES_FILTER);
+  destroy_bloom_filter(names);
+}
+
+// record the layout each file of a put is stored in, last seen with the
+// servers that were sent it. before the put (done == 0) its size is not
+// known: a put that dies partway leaves nothing in the catalog to trust
+static void catalog_put(Catalog *catalog, const PutOperation *put_op,
+                        const int *sockfds, const PlaceMap *place, int done) {
+  CatalogEntry entry;
+  const FileTransfer *file;
+  uint8_t holders[(put_op->n_servers + 7) / 8];
+
+  if (catalog->ttl == 0) {
+    return;
+  }
+
+  memset(holders, 0, sizeof(holders));
+  for (size_t j = 0; j < put_op->n_servers; ++j) {
+    holders[j / 8] |= (sockfds[j] > 0) << (j % 8);
+  }
+
+  for (size_t i = 0; i < put_op->n_files; ++i) {
+    file = &put_op->files[i];
+    memset(&entry, 0, sizeof(CatalogEntry));
+    entry.name = file->fname;
+    entry.name_len = strlen(file->fname);
+    entry.size = done ? file->file_size : UINT64_MAX;
+    entry.etag = file->mtime;
+    entry.holders = holders;
+    if (!done) {
+      entry.flags = CATALOG_SHORT;
+    } else if (put_op->dedup_chunk > 0) {
+      entry.flags = CATALOG_MANIFEST;  // cut as its manifest is, not known
+    } else if (put_op->ec_k > 0) {
+      entry.flags =
+          CATALOG_ERASURE | DFC_PIECE_EC(put_op->ec_k, put_op->ec_m);
+      entry.unit = erasure_unit(file->file_size, put_op->ec_k,
+                                put_op->stripe_unit);
+    } else {
+      entry.unit = stripe_unit(file->file_size, place, put_op->stripe_unit);
+    }
+    catalog_add(catalog, &entry);
+  }
+
+  catalog_sync(catalog);
+}
+
+// take --range off:len out of a get's arguments. returns the arguments
+// left, with *ranged set when it was given, or -1 when it is malformed
+static int take_range(int argc, char *argv[], int *ranged, uint64_t *off,
+                      uint64_t *len) {
+  char *end;
+  int n;
+
+  *ranged = 0;
+  *off = *len = 0;
+  n = 0;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--range") != 0) {
+      argv[n++] = argv[i];
+      continue;
+    }
+
+    if (i + 1 == argc || argv[i + 1][0] == '-' ||
+        (*off = strtoull(argv[i + 1], &end, 10), *end != ':') ||
+        end[1] == '-' || (*len = strtoull(end + 1, &end, 10)) == 0 ||
+        *end != '\0') {
+      fprintf(stderr, "[ERROR] --range takes off:len, with len > 0\n");
+      return -1;
+    }
+    *ranged = 1;
+    i++;
+  }
+
+  return n;
+}
+
+// take --max-memory <bytes>[K|M|G] out of the arguments. returns the
+// arguments left, with *budget 0 when it was not given, or -1 when it is
+// malformed
+static int take_budget(int argc, char *argv[], uint64_t *budget) {
+  char *end;
+  int n;
+
+  *budget = 0;
+  n = 0;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--max-memory") != 0) {
+      argv[n++] = argv[i];
+      continue;
+    }
+
+    if (i + 1 == argc || argv[i + 1][0] == '-' ||
+        (*budget = strtoull(argv[i + 1], &end, 10)) == 0 ||
+        (*end != '\0' && end[1] != '\0') ||
+        (*end != '\0' && strchr("KMG", *end) == NULL)) {
+      fprintf(stderr, "[ERROR] --max-memory takes <bytes>[K|M|G], > 0\n");
+      return -1;
+    }
+    *budget <<= *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+    i++;
+  }
+
+  return n;
+}
+
+// take flag out of the arguments; returns the arguments left
+static int take_flag(int argc, char *argv[], const char *flag, int *given) {
+  int n;
+
+  *given = 0;
+  n = 0;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], flag) == 0) {
+      *given = 1;
+    } else {
+      argv[n++] = argv[i];
+    }
+  }
+
+  return n;
+}
+
+// close this CLI's connections and hand a leased set back. every way out of
+// a command once the set is leased comes through here; returns status
+static int finish_op(DFCOperation *dfc_op, int *sockfds, int agent_fd,
+                     Catalog *catalog, int status) {
+  catalog_close(catalog);
+
+  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+    if (sockfds[i] > 0 && close(sockfds[i]) == -1) {
+      fprintf(stderr, "[%s] failed to close sfd=%d: %s\n", __func__, sockfds[i], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "[%s] close sfd=%d success\n", __func__, sockfds[i]);
+  }
+
+  // the agent's copies stay open, at a frame boundary unless a hedged get
+  // cut one off mid-response
+  if (agent_fd != -1) {
+    agent_release(agent_fd, dfc_op->n_cut == 0);
+  }
+
+  free(sockfds);
+  free_op(dfc_op);
+  pool_drain();
+
+  return status;
+}
+
+int run_handler(int argc, char *argv[]) {
+  DFCOperation *dfc_op;
+  unsigned int cmd_hash;
+  int *sockfds, agent_fd, status;
+  PlaceMap place;
+  HedgeLog latency;
+  Journal journal;
+  Catalog catalog;
+  uint64_t range_off, range_len, budget;
+  int ranged, resume, fresh, local;
+
   cmd_hash = hash_djb2(argv[0]);
   argc -= 1;
   argv += 1;
+  argc = take_flag(argc, argv, "--resume", &resume);
+  argc = take_flag(argc, argv, "--fresh", &fresh);
+  if ((argc = take_budget(argc, argv, &budget)) == -1) {
+    return EXIT_FAILURE;
+  }
+  // only a put holds back for room in the pool; a get would take its
+  // pieces whatever the budget said
+  if (budget != 0 && cmd_hash != hash_djb2("put")) {
+    fprintf(stderr, "[ERROR] --max-memory is only for put\n");
+    return EXIT_FAILURE;
+  }
+  pool_budget(budget);
+
+  if (cmd_hash == hash_djb2("agent")) {
+    if ((dfc_op = read_config()) == NULL) {
+      return -1;
+    }
+
+    status = agent_run(dfc_op);
+    free_op(dfc_op);
+
+    return status;
+  }
+
+  // warm connections from a running agent skip reading dfc.conf and
+  // connecting; without one, do both here
+  if ((agent_fd = agent_lease(&dfc_op, &sockfds)) == -1) {
+    if ((dfc_op = read_config()) == NULL) {
+      return -1;
+    }
+
+    if ((sockfds = calloc(dfc_op->n_servers, sizeof(int))) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // a recent whole listing answers list without the servers
+  catalog_open(&catalog, dfc_op);
+  local = cmd_hash == hash_djb2("list") && !fresh && catalog_listed(&catalog);
+
+  // a leased set is connected already
+  if (agent_fd == -1 && cmd_hash != hash_djb2("get") && !local) {
+    fill_sk_set(dfc_op, sockfds, NULL);
+  }
 
-  int sockfds[dfc_op->n_servers];
-  fill_sk_set(dfc_op, sockfds);
   if (cmd_hash == hash_djb2("get")) {
+    if ((argc = take_range(argc, argv, &ranged, &range_off, &range_len)) ==
+        -1) {
+      return finish_op(dfc_op, sockfds, agent_fd, &catalog, EXIT_FAILURE);
+    }
     if (argc == 0) {
       fprintf(stderr, "[ERROR] Expected files\n");
 
-      return EXIT_FAILURE;
+      return finish_op(dfc_op, sockfds, agent_fd, &catalog, EXIT_FAILURE);
+    }
+
+    // names missing from the last listing fail here, without a round trip
+    if ((argc = names_drop_missing(dfc_op, argc, argv)) == 0) {
+      return finish_op(dfc_op, sockfds, agent_fd, &catalog, -1);
     }
 
     strncpy(dfc_op->fname, argv[0], PATH_MAX);
 
     GetOperation get_op;
-    // copy filename into DFCOperation structure, if readable and exists
-    if (adjacent_failure(sockfds, dfc_op->n_servers)) {
+    uint16_t piece_flags[dfc_op->n_servers];
+    if ((dfc_op->ec_k > 0
+             ? connect_erasure_plan(dfc_op, sockfds, piece_flags)
+             : connect_get_plan(dfc_op, sockfds,
+                                place_key(argv[0]) % dfc_op->n_servers,
+                                piece_flags)) == -1) {
       fprintf(stderr, "[%s] get %s failed \n", __func__, dfc_op->fname);
-      for (size_t i = 0; i < dfc_op->n_servers; ++i) {
-        if (sockfds[i] > 0 && close(sockfds[i]) == -1) {  // close connected sockets, if any
-          fprintf(stderr, "[%s] failed to close sfd=%d: %s\n", __func__,
-                  sockfds[i], strerror(errno));
-        }
-      }
 
-      return -1;
+      return finish_op(dfc_op, sockfds, agent_fd, &catalog, -1);
     }
 
+    get_op.files = init_transfers(argc, argv, 0, &get_op.n_files);
+
     if ((get_op.sockfds = malloc(sizeof(int) * dfc_op->n_servers)) == NULL) {
       fprintf(stderr, "[FATAL] out of memory\n");
       exit(EXIT_FAILURE);
     }
 
     for (size_t j = 0; j < dfc_op->n_servers; ++j) {
+      get_op.sockfds[j] = sockfds[j];
       if (sockfds[j] > 0) {
-        get_op.sockfds[j] = sockfds[j];
         set_timeout(get_op.sockfds[j], RCVTIMEO_SEC, RCVTIMEO_USEC);
       }
     }
 
+    get_op.piece_flags = piece_flags;
     get_op.n_servers = dfc_op->n_servers;
-    strncpy(get_op.fname, dfc_op->fname, PATH_MAX);
+    get_op.dfc_op = dfc_op;
+    get_op.ranged = 0;  // get_range sets it for the one call
+    // a ranged get is not journaled: its files hold slices
+    get_op.journal = NULL;
+    get_op.resumed = 0;
+    get_op.catalog = catalog.ttl > 0 ? &catalog : NULL;
+    if (!ranged) {
+      journal_open(&journal, JOURNAL_GET, resume);
+      get_op.journal = &journal;
+      get_op.resumed =
+          journal_resume(&journal, get_op.files, get_op.n_files) > 0;
+    }
 
-    if (pthread_create(&handler_tid, NULL, get_handle, &get_op) < 0) {
-      fprintf(stderr, "[ERROR] could not create thread\n");
-      exit(EXIT_FAILURE);
+    // resumed files are asked of the servers holding their missing units
+    get_op.place = NULL;
+    if (dfc_op->auto_weight || get_op.resumed) {
+      place_init(&place, dfc_op);
+      get_op.place = &place;
+    }
+    // erasure-coded files rebuild around a slow server from parity instead
+    get_op.hedge = NULL;
+    if (dfc_op->hedge && dfc_op->ec_k == 0) {
+      hedge_load(&latency);
+      get_op.hedge = &latency;
+    }
+
+    status = ranged ? get_range(&get_op, range_off, range_len)
+                    : get_handle(&get_op);
+    if (status == -1) {
+      fprintf(stderr, "[ERROR] get failed\n");
+    }
+
+    if (get_op.place != NULL) {
+      if (dfc_op->auto_weight) {
+        place_save_rates(&place);
+      }
+      place_free(&place);
+    }
+    if (get_op.journal != NULL) {
+      journal_close(&journal);
+    }
+    if (get_op.hedge != NULL) {
+      hedge_save(&latency);
+      hedge_free(&latency);
     }
 
-    pthread_join(handler_tid, NULL);
+    // servers a refetch connected to are closed with the rest
+    memcpy(sockfds, get_op.sockfds, sizeof(int) * dfc_op->n_servers);
 
-    // free(get_op.sockfds);
+    free_transfers(get_op.files, get_op.n_files);
+    free(get_op.sockfds);
   } else if (cmd_hash == hash_djb2("put")) {
     if (argc == 0) {
       fprintf(stderr, "[ERROR] Expected files\n");
 
-      return EXIT_FAILURE;
+      return finish_op(dfc_op, sockfds, agent_fd, &catalog, EXIT_FAILURE);
     }
 
     strncpy(dfc_op->fname, argv[0], PATH_MAX);
 
     PutOperation put_op;
 
-    if (access(argv[0], R_OK) == -1) {
-      if (errno == ENOENT) {
-        fprintf(stderr, "[ERROR] file %s not found\n", argv[0]);
-      } else if (errno == EACCES) {
-        fprintf(stderr, "[ERROR] file %s not readable\n", argv[0]);
-      } else {
-        perror("[ERROR]");
-      }
-
-      return -1;
+    // unreadable files are reported and skipped, the rest still go out
+    if ((put_op.files = init_transfers(argc, argv, 1, &put_op.n_files)) ==
+        NULL) {
+      return finish_op(dfc_op, sockfds, agent_fd, &catalog, -1);
     }
 
-    if (adjacent_failure(sockfds, dfc_op->n_servers)) {
+    // pairs lose a unit to two adjacent servers down, a stripe to more than
+    // m servers down
+    if (dfc_op->ec_k > 0 ? count_down(sockfds, dfc_op->n_servers) > dfc_op->ec_m
+                         : adjacent_failure(sockfds, dfc_op->n_servers)) {
       fprintf(stderr, "[%s] put %s failed \n", __func__, dfc_op->fname);
-      for (size_t j = 0; j < dfc_op->n_servers; ++j) {
-        if (sockfds[j] > 0 && close(sockfds[j]) == -1) {  // close connected sockets, if any
-          fprintf(stderr, "[%s] failed to close sfd=%d: %s\n", __func__,
-                  sockfds[j], strerror(errno));
-        }
-      }
-      return -1;
-   }
+      free_transfers(put_op.files, put_op.n_files);
+
+      return finish_op(dfc_op, sockfds, agent_fd, &catalog, -1);
+    }
 
     if ((put_op.sockfds = malloc(sizeof(int) * dfc_op->n_servers)) == NULL) {
       fprintf(stderr, "[FATAL] out of memory\n");
@@ -116,82 +579,91 @@ int run_handler(int argc, char *argv[]) {
     }
 
     for (size_t j = 0; j < dfc_op->n_servers; ++j) {
+      put_op.sockfds[j] = sockfds[j];
       if (sockfds[j] > 0) {
-        put_op.sockfds[j] = sockfds[j];
         set_timeout(put_op.sockfds[j], RCVTIMEO_SEC, RCVTIMEO_USEC);
       }
     }
 
     put_op.n_servers = dfc_op->n_servers;
-    strncpy(put_op.fname, argv[0], PATH_MAX);
-    if (pthread_create(&handler_tid, NULL, put_handle, &put_op) < 0) {
-      fprintf(stderr, "[ERROR] could not create thread\n");
-      exit(EXIT_FAILURE);
+    put_op.stripe_unit = dfc_op->stripe_unit;
+    put_op.compress_level = dfc_op->compress_level;
+    put_op.dedup_chunk = dfc_op->dedup_chunk;
+    put_op.ec_k = dfc_op->ec_k;
+    put_op.ec_m = dfc_op->ec_m;
+    place_init(&place, dfc_op);
+    put_op.place = &place;
+
+    // a resumed put skips the copies the servers confirm an earlier try
+    // left with them
+    journal_open(&journal, JOURNAL_PUT, resume);
+    journal_confirm(&journal, put_op.sockfds, put_op.n_servers);
+    put_op.journal = &journal;
+
+    catalog_put(&catalog, &put_op, sockfds, &place, 0);
+    status = put_op.dedup_chunk > 0 ? dedup_put(&put_op) : put_handle(&put_op);
+    if (status == -1) {
+      fprintf(stderr, "[ERROR] put failed\n");
+      // a frame may have been cut off on some connection, so the set is
+      // not handed back clean
+      dfc_op->n_cut++;
+    } else {
+      names_add(dfc_op, put_op.files, put_op.n_files);
+      catalog_put(&catalog, &put_op, sockfds, &place, 1);
+      journal_discard(&journal);
     }
+    journal_close(&journal);
 
-    pthread_join(handler_tid, NULL);
+    if (dfc_op->auto_weight) {
+      place_save_rates(&place);
+    }
+    place_free(&place);
 
+    free_transfers(put_op.files, put_op.n_files);
     free(put_op.sockfds);
+  } else if (local) {  // list, from the catalog
+    status = 0;
+    catalog_print(&catalog, argc > 0 ? argv[0] : "");
+    fprintf(stderr,
+            "[INFO] listed from %s, %" PRId64 " s old; list --fresh asks "
+            "the servers\n",
+            CATALOG_FILE, (int64_t)time(NULL) - catalog.listed);
   } else {  // list
-    int *list_fd;
-
-    if ((list_fd = malloc(sizeof(int))) == NULL) {
-      fprintf(stderr, "[FATAL] out of memory\n");
-      exit(EXIT_FAILURE);
-    }
-
-    if (adjacent_failure(sockfds, dfc_op->n_servers)) {
-      fprintf(stderr, "[%s] put %s failed \n", __func__, dfc_op->fname);
-      for (size_t j = 0; j < dfc_op->n_servers; ++j) {
-        if (sockfds[j] > 0 && close(sockfds[j]) == -1) {  // close connected sockets, if any
-          fprintf(stderr, "[%s] failed to close sfd=%d: %s\n", __func__,
-                  sockfds[j], strerror(errno));
-        }
-      }
-
-      free(list_fd);
-      return -1;
-    }
-
-    // only need a single connection
-    for (size_t i = 0; i < dfc_op->n_servers; ++i) {
-      if (sockfds[i] > 0) {
-        *list_fd = sockfds[i];
-        set_timeout(*list_fd, RCVTIMEO_SEC, RCVTIMEO_USEC);
-        break;
-      }
+    ListTally tally;
+
+    // only a listing of everything can vouch for the names it lacks, and
+    // it keeps 8 bytes per name to
+    memset(&tally, 0, sizeof(ListTally));
+    tally.want_hashes = dfc_op->name_cache > 0 && argc == 0;
+    tally.layouts = catalog.ttl > 0 ? &catalog : NULL;
+    if (catalog.ttl > 0 && argc == 0) {
+      catalog_relist(&catalog);
+      tally.catalog = &catalog;
     }
 
-    if (pthread_create(&handler_tid, NULL, list_handle, list_fd) < 0) {
-      fprintf(stderr, "[ERROR] could not create thread\n");
-      exit(EXIT_FAILURE);
+    // every server is asked: what the ones that are down hold is reported
+    // missing, rather than failing the listing
+    status = list_handle(dfc_op, sockfds, argc > 0 ? argv[0] : "", &tally);
+    if (status == -1) {
+      fprintf(stderr, "[ERROR] list failed\n");
+    } else if (tally.want_hashes) {
+      names_rebuild(&tally);
     }
-
-    pthread_join(handler_tid, NULL);
-
-    free(list_fd);
+    catalog_relist_done(&catalog, status == 0);
+    free(tally.hashes);
   }
 
-  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
-    if (sockfds[i] > 0 && close(sockfds[i]) == -1) {
-      fprintf(stderr, "[%s] failed to close sfd=%d: %s\n", __func__, sockfds[i], strerror(errno));
-      exit(EXIT_FAILURE);
-    }
-    fprintf(stderr, "[%s] close sfd=%d success\n", __func__, sockfds[i]);
-  }
-
-  for (size_t i = 0; i < MAX_SERVERS; ++i) {
-    free(dfc_op->servers[i]);
-  }
-  free(dfc_op->servers);
-
-  free(dfc_op);
-
-  return 0;
+  // a file that did not make it fails the command, so a script knows to
+  // try again (with --resume)
+  return finish_op(dfc_op, sockfds, agent_fd, &catalog, status);
 }
 
 void usage(const char *program) {
   fprintf(stderr, "usage: %s <command> [filename] ... [filename]\n", program);
+  fprintf(stderr, "       %s get --range off:len <filename> ...\n", program);
+  fprintf(stderr, "       %s get|put --resume <filename> ...\n", program);
+  fprintf(stderr, "       %s put --max-memory <bytes>[K|M|G] ...\n", program);
+  fprintf(stderr, "       %s list [--fresh] [prefix]\n", program);
   fprintf(stderr, "supported commands:\n");
   for (size_t i = 0; i < N_CMD_SUPP; ++i) {
     fprintf(stderr, "  - %s\n", dfc_cmds[i].cmd);
@@ -210,7 +682,9 @@ int main(int argc, char *argv[]) {
   }
 
   // initialize bloom filter and hash table w/ supported commands
-  bf = create_bloom_filter(HASH_LEN);
+  if ((bf = create_bloom_filter(N_CMD_SUPP, CMD_FILTER_FP)) == NULL) {
+    return EXIT_FAILURE;
+  }
   for (size_t i = 0; i < N_CMD_SUPP; ++i) {
     // add to bloom filter (for validation)
     dfc_cmds[i].hash = double_hash(dfc_cmds[i].cmd);
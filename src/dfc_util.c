@@ -1,13 +1,19 @@
 #include <ctype.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "dfc/cdc.h"
 #include "dfc/dfc_util.h"
+#include "dfc/lz.h"
+#include "dfc/place.h"
+#include "dfc/rs.h"
 
 char *alloc_buf(size_t size) {
   char *buf;
@@ -20,26 +26,6 @@ char *alloc_buf(size_t size) {
   return buf;
 }
 
-size_t attach_hdr(char *buf, DFCHeader *dfc_hdr) {
-  size_t len_hdr;
-
-  len_hdr = 0;
-
-  memcpy(buf, dfc_hdr->cmd, sizeof(dfc_hdr->cmd));
-  len_hdr += sizeof(dfc_hdr->cmd);
-
-  memcpy(buf + len_hdr, dfc_hdr->fname, sizeof(dfc_hdr->fname));
-  len_hdr += sizeof(dfc_hdr->fname);
-
-  memcpy(buf + len_hdr, &dfc_hdr->chunk_offset, sizeof(size_t));
-  len_hdr += sizeof(size_t);
-
-  memcpy(buf + len_hdr, &dfc_hdr->file_offset, sizeof(size_t));
-  len_hdr += sizeof(size_t);
-
-  return len_hdr;
-}
-
 int chk_alloc_err(void *mem, const char *allocator, const char *func,
                   int line) {
   if (mem == NULL) {
@@ -50,115 +36,335 @@ int chk_alloc_err(void *mem, const char *allocator, const char *func,
   return 0;
 }
 
-void free_buf(char *buf) {
-  if (buf != NULL) {
-    free(buf);
-  }
-}
+ssize_t decode_hdr(const char *buf, size_t len_buf, DFCHeader *dfc_hdr) {
+  uint32_t magic;
 
-void get_chunk_sizes(size_t file_size, size_t n_chunks, size_t *out) {
-  size_t chunk;
-  size_t sum;
+  if (len_buf < DFC_HDR_PREFIX_LEN) {
+    return -1;
+  }
 
-  // === BEGIN FAILURE MODES ===
-  if (out == NULL) {
-    fprintf(stderr, "[ERROR] 'out' has not been allocated.. exiting\n");
+  memcpy(&magic, buf, 4);
+  if (be32toh(magic) != DFC_HDR_MAGIC) {
+    return -1;
+  }
 
-    exit(EXIT_FAILURE);
+  dfc_hdr->version = (uint8_t)buf[4];
+  dfc_hdr->opcode = (uint8_t)buf[5];
+  memcpy(&dfc_hdr->flags, buf + 6, 2);
+  dfc_hdr->flags = be16toh(dfc_hdr->flags);
+  memcpy(&dfc_hdr->name_len, buf + 8, 2);
+  dfc_hdr->name_len = be16toh(dfc_hdr->name_len);
+  memcpy(&dfc_hdr->req_id, buf + 10, 4);
+  dfc_hdr->req_id = be32toh(dfc_hdr->req_id);
+  memcpy(&dfc_hdr->chunk_offset, buf + 14, 8);
+  dfc_hdr->chunk_offset = be64toh(dfc_hdr->chunk_offset);
+  memcpy(&dfc_hdr->file_offset, buf + 22, 8);
+  dfc_hdr->file_offset = be64toh(dfc_hdr->file_offset);
+
+  if (dfc_hdr->name_len > PATH_MAX ||
+      len_buf < DFC_HDR_PREFIX_LEN + (size_t)dfc_hdr->name_len) {
+    return -1;
   }
 
-  if (file_size == 0 || n_chunks == 0 || n_chunks > file_size) {
-    fprintf(stderr, "[ERROR] cannot partition file.. exiting\n");
-    fprintf(stderr, "[INFO] fsize=%zu, n_chunks=%zu\n", file_size, n_chunks);
+  memcpy(dfc_hdr->fname, buf + DFC_HDR_PREFIX_LEN, dfc_hdr->name_len);
+  dfc_hdr->fname[dfc_hdr->name_len] = '\0';
 
-    exit(EXIT_FAILURE);
-  }
-  // === END FAILURE MODES ===
+  return DFC_HDR_PREFIX_LEN + dfc_hdr->name_len;
+}
 
-  if (n_chunks == 1) {
-    out[0] = file_size;
+void decode_frame_hdr(const char *buf, DFCFrameHeader *frame_hdr) {
+  memcpy(&frame_hdr->magic, buf, 4);
+  frame_hdr->magic = be32toh(frame_hdr->magic);
+  frame_hdr->version = (uint8_t)buf[4];
+  frame_hdr->status = (uint8_t)buf[5];
+  memcpy(&frame_hdr->n_pieces, buf + 6, 2);
+  frame_hdr->n_pieces = be16toh(frame_hdr->n_pieces);
+  memcpy(&frame_hdr->req_id, buf + 8, 4);
+  frame_hdr->req_id = be32toh(frame_hdr->req_id);
+  memcpy(&frame_hdr->file_size, buf + 12, 8);
+  frame_hdr->file_size = be64toh(frame_hdr->file_size);
+  memcpy(&frame_hdr->payload_len, buf + 20, 8);
+  frame_hdr->payload_len = be64toh(frame_hdr->payload_len);
+}
 
-    return;
-  }
+void decode_piece_hdr(const char *buf, DFCPieceHeader *piece_hdr) {
+  memcpy(&piece_hdr->index, buf, 4);
+  piece_hdr->index = be32toh(piece_hdr->index);
+  memcpy(&piece_hdr->flags, buf + 4, 4);
+  piece_hdr->flags = be32toh(piece_hdr->flags);
+  memcpy(&piece_hdr->offset, buf + 8, 8);
+  piece_hdr->offset = be64toh(piece_hdr->offset);
+  memcpy(&piece_hdr->len, buf + 16, 8);
+  piece_hdr->len = be64toh(piece_hdr->len);
+  memcpy(&piece_hdr->crc, buf + 24, 4);
+  piece_hdr->crc = be32toh(piece_hdr->crc);
+}
 
-  if (file_size % n_chunks == 0) {
-    for (size_t i = 0; i < n_chunks; ++i) {
-      out[i] = file_size / n_chunks;
-    }
+size_t encode_hdr(const DFCHeader *dfc_hdr, char *buf) {
+  uint32_t u32;
+  uint16_t u16;
+  uint64_t u64;
+
+  u32 = htobe32(DFC_HDR_MAGIC);
+  memcpy(buf, &u32, 4);
+  buf[4] = (char)dfc_hdr->version;
+  buf[5] = (char)dfc_hdr->opcode;
+  u16 = htobe16(dfc_hdr->flags);
+  memcpy(buf + 6, &u16, 2);
+  u16 = htobe16(dfc_hdr->name_len);
+  memcpy(buf + 8, &u16, 2);
+  u32 = htobe32(dfc_hdr->req_id);
+  memcpy(buf + 10, &u32, 4);
+  u64 = htobe64(dfc_hdr->chunk_offset);
+  memcpy(buf + 14, &u64, 8);
+  u64 = htobe64(dfc_hdr->file_offset);
+  memcpy(buf + 22, &u64, 8);
+  memcpy(buf + DFC_HDR_PREFIX_LEN, dfc_hdr->fname, dfc_hdr->name_len);
+
+  return DFC_HDR_PREFIX_LEN + dfc_hdr->name_len;
+}
 
-    return;
-  }
+size_t encode_frame_hdr(const DFCFrameHeader *frame_hdr, char *buf) {
+  uint32_t u32;
+  uint16_t u16;
+  uint64_t u64;
+
+  u32 = htobe32(frame_hdr->magic);
+  memcpy(buf, &u32, 4);
+  buf[4] = (char)frame_hdr->version;
+  buf[5] = (char)frame_hdr->status;
+  u16 = htobe16(frame_hdr->n_pieces);
+  memcpy(buf + 6, &u16, 2);
+  u32 = htobe32(frame_hdr->req_id);
+  memcpy(buf + 8, &u32, 4);
+  u64 = htobe64(frame_hdr->file_size);
+  memcpy(buf + 12, &u64, 8);
+  u64 = htobe64(frame_hdr->payload_len);
+  memcpy(buf + 20, &u64, 8);
+
+  return DFC_FRAME_HDR_LEN;
+}
 
-  sum = 0;
-  for (chunk = 0; chunk < n_chunks - 1; ++chunk) {
-    out[chunk] = file_size / n_chunks;
-    sum += out[chunk];
-  }
+size_t encode_piece_hdr(const DFCPieceHeader *piece_hdr, char *buf) {
+  uint32_t u32;
+  uint64_t u64;
+
+  u32 = htobe32(piece_hdr->index);
+  memcpy(buf, &u32, 4);
+  u32 = htobe32(piece_hdr->flags);
+  memcpy(buf + 4, &u32, 4);
+  u64 = htobe64(piece_hdr->offset);
+  memcpy(buf + 8, &u64, 8);
+  u64 = htobe64(piece_hdr->len);
+  memcpy(buf + 16, &u64, 8);
+  u32 = htobe32(piece_hdr->crc);
+  memcpy(buf + 24, &u32, 4);
+
+  return DFC_PIECE_HDR_LEN;
+}
 
-  out[chunk] = file_size - sum;
+void free_buf(char *buf) {
+  if (buf != NULL) {
+    free(buf);
+  }
 }
 
-void merge(char *p1, size_t len_p1, char *p2, size_t len_p2, char *out) {
-  memcpy(out, p1, len_p1);
-  memcpy(out + len_p1, p2, len_p2);
+void init_hdr(DFCHeader *dfc_hdr, uint8_t opcode, const char *fname) {
+  memset(dfc_hdr, 0, sizeof(DFCHeader));
+  dfc_hdr->version = DFC_HDR_VERSION;
+  dfc_hdr->opcode = opcode;
+
+  if (fname != NULL) {
+    strncpy(dfc_hdr->fname, fname, PATH_MAX);
+    dfc_hdr->name_len = strlen(dfc_hdr->fname);
+  }
 }
 
+// gcc 12's analyzer loses track of the addresses stored into the servers
+// table and reports each one leaked
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
+// dfc.conf holds one directive per line:
+//   server <name> <host:port> [<weight>]
+//                           (weight: its share of the units relative to the
+//                            others, 1 to PLACE_WEIGHT_MAX, 1 by default)
+//   weights auto|conf       (auto: weigh servers by the throughput they were
+//                            last measured at instead)
+//   stripe_unit <bytes>[K|M] (at most DFC_STRIPE_UNIT_MAX)
+//   compress <level>        (0 turns it off, 1 is fastest, 9 smallest)
+//   dedup <bytes>[K|M]      (average chunk of a dedup put, 0 turns it off)
+//   name_cache <seconds>    (how long a list vouches for missing names)
+//   catalog <seconds>       (how long the local catalog of names and
+//                            layouts is trusted, 0 turns it off)
+//   erasure <k>+<m>         (k data and m parity pieces per stripe instead
+//                            of adjacent pairs, 0 turns it off)
+//   hedge on|off            (get: ask the twins of a server slow to answer
+//                            as well; adjacent pairs only)
 DFCOperation *read_config() {
-  char line[CONF_MAXLINE + 1];
+  char line[CONF_MAXLINE + 1], key[CONF_MAXLINE + 1], arg[CONF_MAXLINE + 1];
   FILE *fp;
-  size_t n_cols, addr_offset, n_servers;
+  size_t n_servers, cap;
   DFCOperation *dfc_op;
+  char **servers, *end;
+  uint32_t *weights, weight;
+
+  if ((fp = fopen(DFC_CONF, "r")) == NULL) {
+    fprintf(stderr, "[ERROR] unable to open %s\n", DFC_CONF);
+
+    return NULL;
+  }
 
   if ((dfc_op = (DFCOperation *)malloc(sizeof(DFCOperation))) == NULL) {
     fprintf(stderr, "[FATAL] out of memory\n");
     exit(EXIT_FAILURE);
   }
 
-  if ((dfc_op->servers = (char **)malloc(sizeof(char *) * MAX_SERVERS)) ==
-      NULL) {
-    fprintf(stderr, "[ERORR] out of memory\n");
+  // size the server tables to the file, one copy of each address
+  cap = 0;
+  while (fgets(line, CONF_MAXLINE, fp) != NULL) {
+    cap += sscanf(line, "%1024s", key) == 1 && strcmp(key, "server") == 0;
+  }
+  rewind(fp);
 
+  if ((servers = malloc(sizeof(char *) * (cap + 1))) == NULL ||
+      (weights = malloc(sizeof(uint32_t) * (cap + 1))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
     exit(EXIT_FAILURE);
   }
+  n_servers = 0;
+  dfc_op->auto_weight = 0;
+  dfc_op->stripe_unit = DFC_STRIPE_UNIT_DEFAULT;
+  dfc_op->compress_level = 0;
+  dfc_op->dedup_chunk = 0;
+  dfc_op->name_cache = 0;
+  dfc_op->catalog_ttl = 0;
+  dfc_op->ec_k = dfc_op->ec_m = 0;
+  dfc_op->hedge = 0;
+  dfc_op->n_cut = 0;
 
-  for (size_t i = 0; i < MAX_SERVERS; ++i) {
-    if ((dfc_op->servers[i] = (char *)alloc_buf(CONF_MAXLINE)) == NULL) {
-      fprintf(stderr, "[ERROR] out of memory\n");
-
-      exit(EXIT_FAILURE);
+  while (fgets(line, CONF_MAXLINE, fp) != NULL) {
+    if (sscanf(line, "%1024s", key) != 1 || key[0] == '#') {
+      continue;
     }
-  }
 
-  if ((fp = fopen(DFC_CONF, "r")) == NULL) {
-    fprintf(stderr, "[ERROR] unable to open %s\n", DFC_CONF);
+    if (strcmp(key, "server") == 0) {
+      if (sscanf(line, "%*s %*s %1023s", arg) != 1) {
+        fprintf(stderr, "[%s] malformed server line: %s", __func__, line);
+        continue;
+      }
 
-    return NULL;
-  }
+      if (sscanf(line, "%*s %*s %*s %" SCNu32, &weight) != 1) {
+        weight = 1;
+      } else if (weight == 0 || weight > PLACE_WEIGHT_MAX) {
+        fprintf(stderr, "[%s] weight outside [1, %d], using 1: %s", __func__,
+                PLACE_WEIGHT_MAX, line);
+        weight = 1;
+      }
 
-  n_servers = 0;
-  n_cols = 0;
-  addr_offset = 0;
+      if (n_servers == cap) {  // the file grew since it was counted
+        continue;
+      }
+      weights[n_servers] = weight;
 
-  while (fgets(line, CONF_MAXLINE, fp) != NULL) {
-    line[strlen(line) - 1] = '\0';
-    while (n_cols < 2) {
-      if (line[addr_offset] == ' ') {
-        n_cols++;
+      if ((servers[n_servers] = strdup(arg)) == NULL) {
+        fprintf(stderr, "[FATAL] out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+      n_servers++;
+    } else if (strcmp(key, "weights") == 0) {
+      if (sscanf(line, "%*s %1024s", arg) != 1 ||
+          (strcmp(arg, "auto") != 0 && strcmp(arg, "conf") != 0)) {
+        fprintf(stderr, "[%s] malformed weights: %s", __func__, line);
+        continue;
+      }
+      dfc_op->auto_weight = strcmp(arg, "auto") == 0;
+    } else if (strcmp(key, "stripe_unit") == 0) {
+      if (sscanf(line, "%*s %1024s", arg) != 1 ||
+          (dfc_op->stripe_unit = strtoull(arg, &end, 10)) == 0) {
+        fprintf(stderr, "[%s] malformed stripe_unit: %s", __func__, line);
+        dfc_op->stripe_unit = DFC_STRIPE_UNIT_DEFAULT;
+        continue;
       }
 
-      addr_offset++;
-    }
+      if (*end == 'K' || *end == 'k') {
+        dfc_op->stripe_unit *= 1024;
+      } else if (*end == 'M' || *end == 'm') {
+        dfc_op->stripe_unit *= 1024 * 1024;
+      }
 
-    strncpy(dfc_op->servers[n_servers], line + addr_offset, CONF_MAXLINE);
-    n_servers++;
-  }
+      if (dfc_op->stripe_unit > DFC_STRIPE_UNIT_MAX) {
+        fprintf(stderr, "[%s] stripe_unit above %d: %s", __func__,
+                DFC_STRIPE_UNIT_MAX, line);
+        dfc_op->stripe_unit = DFC_STRIPE_UNIT_DEFAULT;
+      }
+    } else if (strcmp(key, "compress") == 0) {
+      if (sscanf(line, "%*s %d", &dfc_op->compress_level) != 1 ||
+          dfc_op->compress_level < 0 ||
+          dfc_op->compress_level > LZ_LEVEL_MAX) {
+        fprintf(stderr, "[%s] malformed compress: %s", __func__, line);
+        dfc_op->compress_level = 0;
+      }
+    } else if (strcmp(key, "dedup") == 0) {
+      if (sscanf(line, "%*s %1024s", arg) != 1) {
+        fprintf(stderr, "[%s] malformed dedup: %s", __func__, line);
+        continue;
+      }
 
-  if (n_servers == 0) {
-    for (size_t i = 0; i < MAX_SERVERS; ++i) {
-      free(dfc_op->servers[i]);
+      dfc_op->dedup_chunk = strtoull(arg, &end, 10);
+      if (*end == 'K' || *end == 'k') {
+        dfc_op->dedup_chunk *= 1024;
+      } else if (*end == 'M' || *end == 'm') {
+        dfc_op->dedup_chunk *= 1024 * 1024;
+      }
+
+      if (dfc_op->dedup_chunk != 0 && (dfc_op->dedup_chunk < CDC_AVG_MIN ||
+                                       dfc_op->dedup_chunk > CDC_AVG_MAX)) {
+        fprintf(stderr, "[%s] dedup chunk outside [%d, %d]: %s", __func__,
+                CDC_AVG_MIN, CDC_AVG_MAX, line);
+        dfc_op->dedup_chunk = 0;
+      }
+    } else if (strcmp(key, "hedge") == 0) {
+      if (sscanf(line, "%*s %1024s", arg) != 1 ||
+          (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)) {
+        fprintf(stderr, "[%s] malformed hedge: %s", __func__, line);
+        continue;
+      }
+      dfc_op->hedge = strcmp(arg, "on") == 0;
+    } else if (strcmp(key, "name_cache") == 0) {
+      if (sscanf(line, "%*s %" SCNu32, &dfc_op->name_cache) != 1) {
+        fprintf(stderr, "[%s] malformed name_cache: %s", __func__, line);
+        dfc_op->name_cache = 0;
+      }
+    } else if (strcmp(key, "catalog") == 0) {
+      if (sscanf(line, "%*s %" SCNu32, &dfc_op->catalog_ttl) != 1) {
+        fprintf(stderr, "[%s] malformed catalog: %s", __func__, line);
+        dfc_op->catalog_ttl = 0;
+      }
+    } else if (strcmp(key, "erasure") == 0) {
+      unsigned int k, m;
+
+      if (sscanf(line, "%*s %u+%u", &k, &m) != 2) {
+        if (sscanf(line, "%*s %u", &k) != 1 || k != 0) {
+          fprintf(stderr, "[%s] malformed erasure: %s", __func__, line);
+        }
+        dfc_op->ec_k = dfc_op->ec_m = 0;
+        continue;
+      }
+
+      if (k == 0 || m == 0 || k + m > RS_SHARDS_MAX) {
+        fprintf(stderr, "[%s] erasure needs k, m > 0 and k + m <= %d: %s",
+                __func__, RS_SHARDS_MAX, line);
+        continue;
+      }
+      dfc_op->ec_k = k;
+      dfc_op->ec_m = m;
     }
+  }
 
-    free(dfc_op->servers);
+  if (n_servers == 0) {
+    free(servers);
+    free(weights);
+    free(dfc_op);
     fclose(fp);
 
     return NULL;
@@ -166,51 +372,41 @@ DFCOperation *read_config() {
 
   fclose(fp);
 
+  // each server holds at most one piece of a stripe
+  if (dfc_op->ec_k + dfc_op->ec_m > n_servers) {
+    fprintf(stderr,
+            "[%s] erasure %u+%u needs %u servers, turning it off\n", __func__,
+            dfc_op->ec_k, dfc_op->ec_m, dfc_op->ec_k + dfc_op->ec_m);
+    dfc_op->ec_k = dfc_op->ec_m = 0;
+  }
+
+  dfc_op->servers = servers;
+  dfc_op->weights = weights;
   dfc_op->n_servers = n_servers;
 
   return dfc_op;
 }
+#pragma GCC diagnostic pop
+
+ssize_t pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+  ssize_t nb_written;
+  size_t total_nb_written;
+
+  total_nb_written = 0;
+  while (total_nb_written < len) {
+    if ((nb_written = pwrite(fd, buf + total_nb_written, len - total_nb_written,
+                             offset + total_nb_written)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
 
-char *read_file(const char *fpath, ssize_t *bytes_read) {
-  char *out_buf;
-  int fd;
-  struct stat st;
-
-  if ((fd = open(fpath, O_RDONLY)) == -1) {
-    fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, fpath, strerror(errno));
-    return NULL;
-  }
-
-  if (stat(fpath, &st) < 0) {
-    if (close(fd) == -1) {
-      fprintf(stderr, "[%s] failed to stat %s: %s\n", __func__, fpath, strerror(errno));
-      exit(EXIT_FAILURE);
-    }
-    return NULL;
-  }
-
-  if ((out_buf = alloc_buf(st.st_size)) == NULL) {
-    fprintf(stderr, "[%s] out of memory\n", __func__);
-    exit(EXIT_FAILURE);
-  }
-
-  if ((*bytes_read = read(fd, out_buf, st.st_size)) < (ssize_t)st.st_size) {
-    if (close(fd) == -1) {
-      fprintf(stderr, "[%s] failed to close %s: %s\n", __func__, fpath, strerror(errno));
-      exit(EXIT_FAILURE);
+      return -1;
     }
 
-    free(out_buf);
-
-    return NULL;
-  }
-
-  if (close(fd) == -1) {
-    fprintf(stderr, "[%s] failed to close %s: %s\n", __func__, fpath, strerror(errno));
-    exit(EXIT_FAILURE);
+    total_nb_written += nb_written;
   }
 
-  return out_buf;
+  return total_nb_written;
 }
 
 ssize_t read_until(char *haystack, size_t len_haystack, char end, char *sink,
@@ -251,38 +447,75 @@ char *realloc_buf(char *buf, size_t size) {
   return buf;
 }
 
-char **split_file(char *file_contents, size_t *chunk_sizes, size_t n_chunks) {
-  char **chunks;
-  size_t offset;
-
-  chunks = (char **)alloc_buf(sizeof(char *) * n_chunks);
-  if (chk_alloc_err(chunks, "malloc", __func__, __LINE__ - 1) == -1) {
-    fprintf(stderr, "[ERROR] out of memory\n");
-
-    return NULL;
-  }
-
-  offset = 0;
-  for (size_t i = 0; i < n_chunks; ++i) {
-    if ((chunks[i] = alloc_buf(chunk_sizes[i])) == NULL) {
-      fprintf(stderr, "[ERROR] out of memory\n");
+static double elapsed_ms(const struct timespec *start,
+                         const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e3 +
+         (end->tv_nsec - start->tv_nsec) / 1e6;
+}
 
-      return NULL;
+void print_transfer_stats(const char *op, FileTransfer *files, size_t n_files,
+                          const struct timespec *start,
+                          const struct timespec *end) {
+  uint64_t total_bytes;
+  size_t n_done;
+  double total_ms;
+
+  total_bytes = 0;
+  n_done = 0;
+  for (size_t i = 0; i < n_files; ++i) {
+    if (files[i].end.tv_sec == 0 && files[i].end.tv_nsec == 0) {
+      continue;
     }
 
-    memcpy(chunks[i], file_contents + offset, chunk_sizes[i]);
-
-    offset += chunk_sizes[i];
+    fprintf(stderr, "[INFO] %s %s: %lu bytes in %.3f ms\n", op, files[i].fname,
+            (unsigned long)files[i].file_size, elapsed_ms(start, &files[i].end));
+    total_bytes += files[i].file_size;
+    n_done++;
   }
 
-  return chunks;
+  total_ms = elapsed_ms(start, end);
+  fprintf(stderr, "[INFO] %s: %zu/%zu files, %lu bytes in %.3f ms (%.2f MiB/s)\n",
+          op, n_done, n_files, (unsigned long)total_bytes, total_ms,
+          total_ms > 0 ? total_bytes / (1024.0 * 1024.0) / (total_ms / 1e3) : 0);
+}
+
+void print_frame_header(DFCFrameHeader *frame_hdr) {
+  fputs("DFCFrameHeader {\n", stderr);
+  fprintf(stderr, "  version: %u\n", frame_hdr->version);
+  fprintf(stderr, "  status: %u\n", frame_hdr->status);
+  fprintf(stderr, "  n_pieces: %u\n", frame_hdr->n_pieces);
+  fprintf(stderr, "  req_id: %u\n", frame_hdr->req_id);
+  fprintf(stderr, "  file_size: %lu\n", (unsigned long)frame_hdr->file_size);
+  fprintf(stderr, "  payload_len: %lu\n",
+          (unsigned long)frame_hdr->payload_len);
+  fputs("}\n", stderr);
 }
 
 void print_header(DFCHeader *dfc_hdr) {
   fputs("DFCHeader {\n", stderr);
-  fprintf(stderr, "  cmd: %s\n", dfc_hdr->cmd);
-  fprintf(stderr, "  filename: %s\n", dfc_hdr->fname);
-  fprintf(stderr, "  chunk_offset: %zu\n", dfc_hdr->chunk_offset);
-  fprintf(stderr, "  file_offset: %zu\n", dfc_hdr->file_offset);
+  fprintf(stderr, "  version: %u\n", dfc_hdr->version);
+  fprintf(stderr, "  opcode: %u\n", dfc_hdr->opcode);
+  fprintf(stderr, "  flags: 0x%x\n", dfc_hdr->flags);
+  fprintf(stderr, "  req_id: %u\n", dfc_hdr->req_id);
+  fprintf(stderr, "  filename: %.*s\n", dfc_hdr->name_len, dfc_hdr->fname);
+  fprintf(stderr, "  chunk_offset: %lu\n", (unsigned long)dfc_hdr->chunk_offset);
+  fprintf(stderr, "  file_offset: %lu\n", (unsigned long)dfc_hdr->file_offset);
   fputs("}\n", stderr);
 }
+
+// the stripe unit a file is actually cut with: the configured one, grown
+// just enough that no server's frame needs more pieces than n_pieces holds
+uint64_t stripe_unit(uint64_t file_size, const PlaceMap *place,
+                     uint64_t unit) {
+  uint64_t max_units;
+
+  // each server holds two groups, which get at most max_pair / n_slots of
+  // the units on average; half the room is left for the spread of hashed
+  // placement
+  max_units = place->n_slots * (UINT16_MAX / 2) / place->max_pair;
+  if ((file_size + unit - 1) / unit > max_units) {
+    unit = (file_size + max_units - 1) / max_units;
+  }
+
+  return unit;
+}
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dfc/dfc_util.h"
+#include "dfc/place.h"
+#include "dfc/pool.h"
+#include "dfc/rs.h"
+#include "dfc/erasure.h"
+
+static uint64_t unit_len(uint64_t file_size, uint64_t unit, uint64_t u) {
+  if (u * unit >= file_size) {
+    return 0;
+  }
+
+  return file_size - u * unit < unit ? file_size - u * unit : unit;
+}
+
+// which piece of stripe s server srv holds, or -1 for none
+static int shard_of(const ServerTask *task, size_t srv, uint64_t s) {
+  size_t n, j;
+
+  n = task->n_servers;
+  j = (srv + n - place_group(task->place, task->file_key, s)) % n;
+
+  return j < (size_t)task->ec_k + task->ec_m ? (int)j : -1;
+}
+
+static int get_bit(const uint8_t *bits, uint64_t i) {
+  return bits[i / 8] >> (i % 8) & 1;
+}
+
+static void set_bit(uint8_t *bits, uint64_t i, int on) {
+  if (on) {
+    bits[i / 8] |= 1 << (i % 8);
+  } else {
+    bits[i / 8] &= ~(1 << (i % 8));
+  }
+}
+
+// the stripe unit an erasure-coded piece was cut with, which its offset and
+// index give away. 0 when they do not add up
+static uint64_t piece_unit(const DFCPieceHeader *piece_hdr, uint8_t k,
+                           uint8_t m) {
+  uint64_t at;
+
+  // the unit (or stripe) number the offset is a multiple of
+  at = piece_hdr->flags & DFC_PIECE_SECOND ? piece_hdr->index / m * k
+                                           : piece_hdr->index;
+  if (at > 0) {
+    return piece_hdr->offset % at == 0 ? piece_hdr->offset / at : 0;
+  }
+
+  // in the first stripe a piece is as long as a unit, unless the whole file
+  // fits in one
+  return piece_hdr->offset == 0 ? piece_hdr->len : 0;
+}
+
+// the stripe unit a file is cut with: the configured one, grown just enough
+// that no server's frame needs more pieces than n_pieces holds. a server
+// holds at most one piece per stripe
+uint64_t erasure_unit(uint64_t file_size, uint8_t k, uint64_t unit) {
+  uint64_t max_units;
+
+  max_units = (uint64_t)k * UINT16_MAX;
+  if ((file_size + unit - 1) / unit > max_units) {
+    unit = (file_size + max_units - 1) / max_units;
+  }
+
+  return unit;
+}
+
+// put: how many pieces of the file server srv holds, and how many bytes
+uint64_t erasure_count(const ServerTask *task, const FileTransfer *file,
+                       uint64_t unit, size_t srv, uint64_t *n_bytes) {
+  uint64_t n_units, n_stripes, n_pieces, u;
+  int j;
+
+  n_units = (file->file_size + unit - 1) / unit;
+  n_stripes = (n_units + task->ec_k - 1) / task->ec_k;
+
+  n_pieces = *n_bytes = 0;
+  for (uint64_t s = 0; s < n_stripes; ++s) {
+    if ((j = shard_of(task, srv, s)) == -1) {
+      continue;
+    }
+
+    u = s * task->ec_k + (j < task->ec_k ? j : 0);
+    if (j < task->ec_k && u >= n_units) {
+      continue;
+    }
+    n_pieces++;
+    *n_bytes += unit_len(file->file_size, unit, u);
+  }
+
+  return n_pieces;
+}
+
+// put: server srv's next piece of the file, from stripe task->next_unit on.
+// a data piece is read as it is; a parity piece is computed from its stripe,
+// read whole into a scratch buffer. returns the piece's bytes in a pool
+// buffer of their own, or NULL when the file came up short
+char *erasure_next(ServerTask *task, FileTransfer *file, size_t srv,
+                   DFCPieceHeader *piece_hdr) {
+  const uint8_t *data[task->ec_k];
+  uint64_t unit, n_units, s, u, len, plen;
+  char *buf, *stripe;
+  int j;
+
+  unit = task->file_unit;
+  n_units = (file->file_size + unit - 1) / unit;
+
+  for (;; task->next_unit++) {
+    s = task->next_unit;
+    if ((j = shard_of(task, srv, s)) != -1 &&
+        (j >= task->ec_k || s * task->ec_k + j < n_units)) {
+      break;
+    }
+  }
+  task->next_unit++;
+
+  piece_hdr->flags =
+      DFC_PIECE_ERASURE | DFC_PIECE_EC(task->ec_k, task->ec_m);
+  if (j < task->ec_k) {
+    u = s * task->ec_k + j;
+    piece_hdr->index = u;
+    piece_hdr->offset = u * unit;
+    piece_hdr->len = unit_len(file->file_size, unit, u);
+
+    buf = pool_get(piece_hdr->len);
+    if (pread(file->fd, buf, piece_hdr->len,
+              file->base + piece_hdr->offset) != (ssize_t)piece_hdr->len) {
+      pool_put(buf, piece_hdr->len);
+      return NULL;
+    }
+
+    return buf;
+  }
+
+  // the stripe is only needed for this call, so every connection takes
+  // the same pool buffer in turn
+  plen = unit_len(file->file_size, unit, s * task->ec_k);
+  stripe = pool_get(task->ec_k * plen);
+  for (int i = 0; i < task->ec_k; ++i) {
+    u = s * task->ec_k + i;
+    len = unit_len(file->file_size, unit, u);
+    if (pread(file->fd, stripe + i * plen, len, file->base + u * unit) !=
+        (ssize_t)len) {
+      pool_put(stripe, task->ec_k * plen);
+      return NULL;
+    }
+    memset(stripe + i * plen + len, 0, plen - len);
+    data[i] = (const uint8_t *)stripe + i * plen;
+  }
+
+  buf = pool_get(plen);
+  rs_encode(task->ec_k, j - task->ec_k, data, (uint8_t *)buf, plen);
+  pool_put(stripe, task->ec_k * plen);
+
+  piece_hdr->index = s * task->ec_m + (j - task->ec_k);
+  piece_hdr->flags |= DFC_PIECE_SECOND;
+  piece_hdr->offset = s * task->ec_k * unit;
+  piece_hdr->len = plen;
+
+  return buf;
+}
+
+// get: note an erasure-coded piece on its way, and say where it goes: data
+// to the file, parity to the file's region of the spool. returns the fd to
+// write it to with *base added to its offset, or -1 to drop it. the piece
+// counts for its stripe only once erasure_piece_done has it
+int erasure_on_piece(ErasureSpool *spool, FileTransfer *file,
+                     const DFCPieceHeader *piece_hdr, off_t *base) {
+  ErasureRx *ec;
+  uint8_t k, m;
+  uint64_t unit, slot;
+
+  k = DFC_PIECE_EC_K(piece_hdr->flags);
+  m = DFC_PIECE_EC_M(piece_hdr->flags);
+  if (k == 0 || m == 0 || k + m > RS_SHARDS_MAX ||
+      piece_hdr->flags & DFC_PIECE_COMPRESSED) {
+    return -1;
+  }
+
+  if ((unit = piece_unit(piece_hdr, k, m)) == 0) {
+    return -1;
+  }
+
+  if ((ec = file->ec) == NULL) {
+    if ((ec = calloc(1, sizeof(ErasureRx))) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    ec->k = k;
+    ec->m = m;
+    ec->unit = unit;
+    ec->n_units = (file->file_size + unit - 1) / unit;
+    ec->n_stripes = (ec->n_units + k - 1) / k;
+    if ((ec->data = calloc((ec->n_units + ec->n_stripes * m) / 8 + 2, 1)) ==
+        NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    ec->parity = ec->data + ec->n_units / 8 + 1;
+    file->ec = ec;
+  } else if (ec->k != k || ec->m != m || ec->unit != unit) {
+    fprintf(stderr, "[ERROR] %s: servers disagree on its erasure code\n",
+            file->fname);
+    return -1;
+  }
+
+  if (!(piece_hdr->flags & DFC_PIECE_SECOND)) {
+    if (piece_hdr->index >= ec->n_units) {
+      return -1;
+    }
+    *base = file->base;
+    return file->fd;
+  }
+
+  if (piece_hdr->index >= ec->n_stripes * m) {
+    return -1;
+  }
+
+  if (spool->fd == -1 &&
+      (spool->fd = open(".", O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
+    perror("open");
+    return -1;
+  }
+
+  // each file gets a region of the spool for its parity, written sparsely:
+  // piece r of stripe s sits s * m + r units into it
+  if (ec->spool_at == 0) {
+    ec->spool_at = spool->end + 1;
+    spool->end = ec->spool_at + ec->n_stripes * m * unit;
+  }
+
+  slot = ec->spool_at + piece_hdr->index * unit;
+  *base = (off_t)slot - (off_t)piece_hdr->offset;
+
+  return spool->fd;
+}
+
+// get: a piece passed its checksum and is in place. one that failed it, or
+// was cut short, is never marked, so its stripe does without it
+void erasure_piece_done(FileTransfer *file, const DFCPieceHeader *piece_hdr) {
+  ErasureRx *ec = file->ec;
+
+  if (ec != NULL) {
+    set_bit(piece_hdr->flags & DFC_PIECE_SECOND ? ec->parity : ec->data,
+            piece_hdr->index, 1);
+  }
+}
+
+// get: rebuild every data unit that did not arrive from the other pieces of
+// its stripe. sets n_recv to the file bytes now in place, and returns -1
+// when a stripe is short of pieces (asking for parity may still help)
+int erasure_restore(ErasureSpool *spool, FileTransfer *file) {
+  ErasureRx *ec = file->ec;
+  uint8_t *shards[RS_SHARDS_MAX], present[RS_SHARDS_MAX];
+  uint64_t unit, n_units, u, len, plen, n_rebuilt;
+  char *buf;
+  int status;
+
+  unit = ec->unit;
+  n_units = ec->n_units;
+
+  buf = NULL;
+  n_rebuilt = 0;
+  status = 0;
+  for (uint64_t s = 0; s < ec->n_stripes && status == 0; ++s) {
+    int n_missing = 0;
+
+    for (int j = 0; j < ec->k; ++j) {
+      u = s * ec->k + j;
+      present[j] = u >= n_units || get_bit(ec->data, u);
+      n_missing += !present[j];
+    }
+    if (n_missing == 0) {
+      continue;
+    }
+
+    if (buf == NULL) {
+      buf = pool_get(((size_t)ec->k + ec->m) * unit);
+    }
+
+    plen = unit_len(file->file_size, unit, s * ec->k);
+    for (int j = 0; j < ec->k + ec->m; ++j) {
+      shards[j] = (uint8_t *)buf + j * plen;
+      if (j >= ec->k) {
+        u = s * ec->m + j - ec->k;
+        present[j] = get_bit(ec->parity, u);
+        if (present[j] && pread(spool->fd, shards[j], plen,
+                                ec->spool_at + u * unit) != (ssize_t)plen) {
+          present[j] = 0;
+        }
+        continue;
+      }
+
+      u = s * ec->k + j;
+      len = present[j] ? unit_len(file->file_size, unit, u) : 0;
+      if (len > 0 && pread(file->fd, shards[j], len,
+                           file->base + u * unit) != (ssize_t)len) {
+        present[j] = 0;
+        len = 0;
+      }
+      memset(shards[j] + len, 0, plen - len);
+    }
+
+    if (rs_reconstruct(ec->k, ec->m, shards, present, plen) == -1) {
+      status = -1;
+      break;
+    }
+
+    for (int j = 0; j < ec->k; ++j) {
+      u = s * ec->k + j;
+      if (present[j] || (len = unit_len(file->file_size, unit, u)) == 0) {
+        continue;
+      }
+
+      if (pwrite(file->fd, shards[j], len, file->base + u * unit) !=
+          (ssize_t)len) {
+        perror("pwrite");
+        status = -1;
+        break;
+      }
+      set_bit(ec->data, u, 1);
+      n_rebuilt++;
+    }
+  }
+  pool_put(buf, ((size_t)ec->k + ec->m) * unit);
+
+  file->n_recv = 0;
+  for (u = 0; u < n_units; ++u) {
+    if (get_bit(ec->data, u)) {
+      file->n_recv += unit_len(file->file_size, unit, u);
+    }
+  }
+
+  if (n_rebuilt > 0) {
+    fprintf(stderr, "[INFO] %s: rebuilt %" PRIu64 " pieces from parity\n",
+            file->fname, n_rebuilt);
+  }
+
+  return status;
+}
+
+void erasure_free(FileTransfer *file) {
+  if (file->ec == NULL) {
+    return;
+  }
+
+  free(file->ec->data);
+  free(file->ec);
+  file->ec = NULL;
+}
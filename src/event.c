@@ -0,0 +1,643 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "dfc/crc32c.h"
+#include "dfc/dfc_util.h"
+#include "dfc/event.h"
+#include "dfc/lz.h"
+#include "dfc/pool.h"
+#include "dfc/uring.h"
+
+void ev_tx_drop(DFCConn *conn) {
+  for (; conn->tx_head < conn->tx_tail; ++conn->tx_head) {
+    pool_put(conn->tx[conn->tx_head].buf, conn->tx[conn->tx_head].len);
+  }
+}
+
+// stop driving the connection: nothing more is sent or awaited on it
+static void drop_conn(DFCConn *conn) {
+  conn->failed = 1;
+  conn->n_expected = 0;
+  // a send still in flight reads the queued buffers in place; the backend
+  // drops them once it completes
+  if (!conn->tx_busy) {
+    ev_tx_drop(conn);
+  }
+  if (conn->epfd != -1) {
+    epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+  }
+  conn->events = 0;
+}
+
+void ev_fail(DFCConn *conn, const char *why) {
+  fprintf(stderr, "[ERROR] sfd=%d (server %zu): %s\n", conn->sockfd,
+          conn->srv_id, why);
+
+  drop_conn(conn);
+}
+
+// the rest of what the peer owes is not wanted. a response cut short leaves
+// the stream nowhere near a frame boundary, so the socket is shut down (for
+// every copy of it) and is only good for closing
+void ev_cancel(DFCConn *conn) {
+  shutdown(conn->sockfd, SHUT_RDWR);
+  conn->cancelled = 1;
+  drop_conn(conn);
+}
+
+// watch for input only while responses are owed, and for output only while
+// something is queued
+static void update_interest(DFCConn *conn) {
+  struct epoll_event ev;
+  unsigned int events;
+
+  if (conn->failed || conn->epfd == -1) {
+    return;
+  }
+
+  events = 0;
+  if (conn->n_expected > 0) {
+    events |= EPOLLIN;
+  }
+  if (conn->tx_head < conn->tx_tail) {
+    events |= EPOLLOUT;
+  }
+
+  if (events == conn->events) {
+    return;
+  }
+
+  ev.events = events;
+  ev.data.ptr = conn;
+  if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->sockfd, &ev) == -1) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+
+  conn->events = events;
+}
+
+static TxItem *tx_push(DFCConn *conn) {
+  TxItem *tx;
+
+  // reclaim the consumed prefix before growing
+  if (conn->tx_head == conn->tx_tail) {
+    conn->tx_head = conn->tx_tail = 0;
+  }
+
+  if (conn->tx_tail == conn->tx_cap) {
+    conn->tx_cap = conn->tx_cap == 0 ? 16 : conn->tx_cap * 2;
+    if ((tx = realloc(conn->tx, sizeof(TxItem) * conn->tx_cap)) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    conn->tx = tx;
+  }
+
+  tx = &conn->tx[conn->tx_tail++];
+  memset(tx, 0, sizeof(TxItem));
+
+  return tx;
+}
+
+DFCConn *ev_add_conn(DFCEventLoop *loop, int sockfd, size_t srv_id,
+                     const DFCConnHandler *handler, void *ctx) {
+  DFCConn *conn;
+  struct epoll_event ev;
+
+  if (loop->n_conns == loop->max_conns) {
+    fprintf(stderr, "[%s] event loop is full\n", __func__);
+    return NULL;
+  }
+
+  conn = &loop->conns[loop->n_conns];
+  memset(conn, 0, sizeof(DFCConn));
+  conn->epfd = loop->epfd;
+  conn->sockfd = sockfd;
+  conn->srv_id = srv_id;
+  conn->handler = handler;
+  conn->ctx = ctx;
+  conn->rx_state = RX_FRAME_HDR;
+  conn->rx_fd = -1;
+  conn->rx_piece_fd = -1;
+
+  // io_uring polls blocking sockets itself, and would hand EAGAIN back to us
+  // for non-blocking ones
+  if (loop->epfd == -1) {
+    loop->n_conns++;
+    return conn;
+  }
+
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+  ev.events = 0;
+  ev.data.ptr = conn;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+    perror("epoll_ctl");
+    return NULL;
+  }
+
+  loop->n_conns++;
+
+  return conn;
+}
+
+void ev_destroy(DFCEventLoop *loop) {
+  for (size_t i = 0; i < loop->n_conns; ++i) {
+    // only a ring that broke leaves a send in flight: its buffers are
+    // leaked rather than handed out again under it
+    if (!loop->conns[i].tx_busy) {
+      ev_tx_drop(&loop->conns[i]);
+    }
+
+    free(loop->conns[i].tx);
+    pool_put(loop->conns[i].rx_buf, EV_RXCHUNK);
+    pool_put(loop->conns[i].rx_zbuf, loop->conns[i].piece_hdr.len);
+
+    // sockets stay open for the caller, but blocking again
+    if (loop->epfd != -1) {
+      fcntl(loop->conns[i].sockfd, F_SETFL,
+            fcntl(loop->conns[i].sockfd, F_GETFL) & ~O_NONBLOCK);
+    }
+  }
+
+  free(loop->conns);
+  if (loop->epfd != -1) {
+    close(loop->epfd);
+  }
+  uring_destroy(loop->uring);
+}
+
+void ev_expect(DFCConn *conn, size_t n_frames) {
+  conn->n_expected += n_frames;
+  update_interest(conn);
+}
+
+int ev_init(DFCEventLoop *loop, size_t max_conns, int timeout_ms) {
+  const char *backend;
+
+  loop->epfd = -1;
+  loop->uring = NULL;
+
+  // io_uring is opt-in; anything it cannot set up falls back to epoll
+  if ((backend = getenv(URING_ENV)) != NULL && strcmp(backend, "uring") == 0 &&
+      (loop->uring = uring_init(max_conns)) == NULL) {
+    fprintf(stderr, "[INFO] io_uring unavailable, using epoll\n");
+  }
+
+  if (loop->uring == NULL &&
+      (loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  if ((loop->conns = calloc(max_conns, sizeof(DFCConn))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  loop->n_conns = 0;
+  loop->max_conns = max_conns;
+  loop->timeout_ms = timeout_ms;
+  loop->tick_ms = timeout_ms;
+  loop->on_tick = NULL;
+  loop->tick_ctx = NULL;
+
+  return 0;
+}
+
+void ev_set_tick(DFCEventLoop *loop, int tick_ms,
+                 void (*on_tick)(DFCEventLoop *, void *), void *ctx) {
+  loop->tick_ms = tick_ms < loop->timeout_ms ? tick_ms : loop->timeout_ms;
+  loop->on_tick = on_tick;
+  loop->tick_ctx = ctx;
+}
+
+void ev_queue_buf(DFCConn *conn, const char *buf, size_t len, void *tag) {
+  char *copy;
+
+  copy = pool_get(len);
+  memcpy(copy, buf, len);
+
+  ev_queue_owned(conn, copy, len, tag);
+}
+
+// like ev_queue_buf, for a pool buffer of len bytes the connection takes
+// over and gives back once it is sent
+void ev_queue_owned(DFCConn *conn, char *buf, size_t len, void *tag) {
+  TxItem *tx;
+
+  tx = tx_push(conn);
+  tx->buf = buf;
+  tx->len = len;
+  tx->tag = tag;
+
+  update_interest(conn);
+}
+
+void ev_tx_advance(DFCConn *conn, size_t nb_sent) {
+  TxItem *tx;
+
+  tx = &conn->tx[conn->tx_head];
+  if ((tx->done += nb_sent) < tx->len) {
+    return;
+  }
+
+  // item fully sent
+  pool_put(tx->buf, tx->len);
+  tx->buf = NULL;
+  conn->tx_head++;
+
+  if (tx->tag != NULL && conn->handler->on_sent != NULL) {
+    conn->handler->on_sent(conn, tx->tag);
+  }
+}
+
+static void handle_writable(DFCConn *conn) {
+  TxItem *tx;
+  ssize_t nb_sent;
+  size_t budget;
+
+  budget = EV_FAIR_SHARE;
+  while (conn->tx_head < conn->tx_tail && budget > 0) {
+    tx = &conn->tx[conn->tx_head];
+
+    if (tx->done == tx->len) {  // empty item
+      ev_tx_advance(conn, 0);
+      continue;
+    }
+
+    nb_sent = send(conn->sockfd, tx->buf + tx->done, tx->len - tx->done,
+                   MSG_NOSIGNAL);
+    if (nb_sent == -1) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return;
+      }
+
+      ev_fail(conn, strerror(errno));
+      return;
+    }
+
+    budget = (size_t)nb_sent < budget ? budget - nb_sent : 0;
+    ev_tx_advance(conn, nb_sent);
+  }
+}
+
+static void frame_done(DFCConn *conn) {
+  conn->rx_state = RX_FRAME_HDR;
+  conn->rx_hdr_have = 0;
+  conn->rx_fd = -1;
+  conn->n_expected--;
+
+  if (conn->handler->on_frame_done != NULL) {
+    conn->handler->on_frame_done(conn, &conn->frame_hdr);
+  }
+}
+
+// move to whatever follows the current piece: the next piece header, the
+// listing, or the end of the frame
+static void next_section(DFCConn *conn) {
+  if (conn->pieces_left > 0) {
+    conn->rx_state = RX_PIECE_HDR;
+    conn->rx_hdr_have = 0;
+  } else if (conn->payload_left > 0) {
+    conn->rx_state = RX_PAYLOAD;
+  } else {
+    frame_done(conn);
+  }
+}
+
+static int rx_frame_hdr(DFCConn *conn) {
+  uint64_t pieces_len;
+
+  decode_frame_hdr(conn->rx_hdr, &conn->frame_hdr);
+  if (conn->frame_hdr.magic != DFC_FRAME_MAGIC ||
+      conn->frame_hdr.version != DFC_FRAME_VERSION) {
+    ev_fail(conn, "malformed frame");
+    return -1;
+  }
+
+  pieces_len = (uint64_t)conn->frame_hdr.n_pieces * DFC_PIECE_HDR_LEN;
+  if (pieces_len > conn->frame_hdr.payload_len) {
+    ev_fail(conn, "malformed frame");
+    return -1;
+  }
+
+  conn->pieces_left = conn->frame_hdr.n_pieces;
+  // listing bytes: whatever the payload holds beyond the pieces, which are
+  // subtracted as their headers arrive
+  conn->payload_left = conn->frame_hdr.payload_len - pieces_len;
+  conn->rx_fd = -1;
+  conn->rx_base = 0;
+  conn->rx_file_bytes = 0;
+
+  // a handler may fail the connection over what the header says
+  if (conn->handler->on_frame != NULL) {
+    conn->rx_fd = conn->handler->on_frame(conn, &conn->frame_hdr);
+    if (conn->failed) {
+      return -1;
+    }
+  }
+
+  next_section(conn);
+
+  return 0;
+}
+
+static int rx_piece_hdr(DFCConn *conn) {
+  decode_piece_hdr(conn->rx_hdr, &conn->piece_hdr);
+
+  // a compressed piece is gathered whole, so it is held to a unit, and
+  // checked against the file once it is inflated
+  if (conn->piece_hdr.len > conn->payload_left ||
+      conn->piece_hdr.offset > conn->frame_hdr.file_size ||
+      (conn->piece_hdr.flags & DFC_PIECE_COMPRESSED
+           ? conn->piece_hdr.len > DFC_STRIPE_UNIT_MAX
+           : conn->piece_hdr.len >
+                 conn->frame_hdr.file_size - conn->piece_hdr.offset)) {
+    ev_fail(conn, "piece lies outside the file");
+    return -1;
+  }
+
+  conn->pieces_left--;
+  conn->payload_left -= conn->piece_hdr.len;
+  conn->piece_left = conn->piece_hdr.len;
+  conn->rx_crc = 0;
+
+  conn->rx_piece_fd = conn->rx_fd;
+  if (conn->rx_fd != -1 && conn->handler->on_piece != NULL &&
+      !conn->handler->on_piece(conn, &conn->piece_hdr)) {
+    conn->rx_piece_fd = -1;
+  }
+
+  if (conn->rx_piece_fd != -1 &&
+      conn->piece_hdr.flags & DFC_PIECE_COMPRESSED && conn->piece_left > 0) {
+    conn->rx_zbuf = pool_get(conn->piece_left);
+  }
+
+  if (conn->piece_left > 0) {
+    conn->rx_state = RX_PIECE_DATA;
+  } else {
+    next_section(conn);
+  }
+
+  return 0;
+}
+
+// a gathered compressed piece: inflate it and write it where it belongs.
+// returns the raw length, -1 when the block does not inflate, or -2 when the
+// write failed the connection
+static ssize_t rx_inflate(DFCConn *conn) {
+  char *raw;
+  ssize_t len_raw;
+
+  len_raw = lz_raw_len(conn->rx_zbuf, conn->piece_hdr.len);
+  if (len_raw == -1 || len_raw > DFC_STRIPE_UNIT_MAX ||
+      (uint64_t)len_raw >
+          conn->frame_hdr.file_size - conn->piece_hdr.offset) {
+    return -1;
+  }
+
+  raw = pool_get(len_raw);
+
+  if (lz_decompress(conn->rx_zbuf, conn->piece_hdr.len, raw, len_raw) !=
+      len_raw) {
+    pool_put(raw, len_raw);
+    return -1;
+  }
+
+  if (pwrite_all(conn->rx_piece_fd, raw, len_raw,
+                 conn->rx_base + conn->piece_hdr.offset) == -1) {
+    pool_put(raw, len_raw);
+    ev_fail(conn, strerror(errno));
+    return -2;
+  }
+
+  pool_put(raw, len_raw);
+
+  return len_raw;
+}
+
+// the last byte of a piece is in: check it against the sender's checksum
+// before it counts. a bad piece has already reached the file unless it was
+// compressed, so it is up to the handler to have it sent again
+static void rx_piece_done(DFCConn *conn) {
+  ssize_t len_raw;
+
+  if (conn->rx_piece_fd == -1) {
+    return;
+  }
+
+  len_raw = -1;
+  if (conn->rx_crc == conn->piece_hdr.crc) {
+    len_raw = conn->rx_zbuf != NULL ? rx_inflate(conn)
+                                    : (ssize_t)conn->piece_hdr.len;
+  }
+
+  pool_put(conn->rx_zbuf, conn->piece_hdr.len);
+  conn->rx_zbuf = NULL;
+
+  if (len_raw == -2) {
+    return;
+  } else if (len_raw != -1) {
+    conn->rx_file_bytes += len_raw;
+    if (conn->handler->on_piece_done != NULL) {
+      conn->handler->on_piece_done(conn, &conn->piece_hdr, (uint64_t)len_raw);
+    }
+  } else if (conn->handler->on_bad_piece != NULL) {
+    conn->handler->on_bad_piece(conn, &conn->piece_hdr);
+  }
+}
+
+// whether piece bytes are headed for the file exactly as they arrive, which
+// lets a backend write them without handing them back first
+int ev_rx_direct(DFCConn *conn) {
+  return conn->rx_state == RX_PIECE_DATA && conn->rx_piece_fd != -1 &&
+         conn->rx_zbuf == NULL;
+}
+
+size_t ev_rx_want(DFCConn *conn, char *data_buf, size_t len_data_buf,
+                  char **buf) {
+  size_t hdr_len;
+
+  switch (conn->rx_state) {
+    case RX_FRAME_HDR:
+    case RX_PIECE_HDR:
+      hdr_len = conn->rx_state == RX_FRAME_HDR ? DFC_FRAME_HDR_LEN
+                                               : DFC_PIECE_HDR_LEN;
+      *buf = conn->rx_hdr + conn->rx_hdr_have;
+      return hdr_len - conn->rx_hdr_have;
+    case RX_PIECE_DATA:
+      *buf = conn->rx_zbuf != NULL
+                 ? conn->rx_zbuf + conn->piece_hdr.len - conn->piece_left
+                 : data_buf;
+      return conn->piece_left < len_data_buf ? conn->piece_left : len_data_buf;
+    case RX_PAYLOAD:
+    default:
+      *buf = data_buf;
+      return conn->payload_left < len_data_buf ? conn->payload_left
+                                               : len_data_buf;
+  }
+}
+
+off_t ev_rx_offset(DFCConn *conn) {
+  return conn->rx_base + conn->piece_hdr.offset + conn->piece_hdr.len -
+         conn->piece_left;
+}
+
+void ev_rx_advance(DFCConn *conn, const char *data, size_t nb_recv,
+                   int on_disk) {
+  switch (conn->rx_state) {
+    case RX_FRAME_HDR:
+      if ((conn->rx_hdr_have += nb_recv) == DFC_FRAME_HDR_LEN) {
+        rx_frame_hdr(conn);
+      }
+      break;
+    case RX_PIECE_HDR:
+      if ((conn->rx_hdr_have += nb_recv) == DFC_PIECE_HDR_LEN) {
+        rx_piece_hdr(conn);
+      }
+      break;
+    case RX_PIECE_DATA:
+      if (conn->rx_piece_fd == -1) {
+        if ((conn->piece_left -= nb_recv) == 0) {
+          next_section(conn);
+        }
+        break;
+      }
+
+      // checksummed while the bytes are still in cache from the receive
+      conn->rx_crc = crc32c(conn->rx_crc, data, nb_recv);
+
+      // a backend may already have written the bytes to their offset, and
+      // compressed ones were received straight into rx_zbuf
+      if (!on_disk && conn->rx_zbuf == NULL &&
+          pwrite_all(conn->rx_piece_fd, data, nb_recv, ev_rx_offset(conn)) ==
+              -1) {
+        ev_fail(conn, strerror(errno));
+        return;
+      }
+
+      if ((conn->piece_left -= nb_recv) == 0) {
+        rx_piece_done(conn);
+        if (!conn->failed) {
+          next_section(conn);
+        }
+      }
+      break;
+    case RX_PAYLOAD:
+      if (conn->handler->on_payload != NULL) {
+        conn->handler->on_payload(conn, data, nb_recv);
+      }
+
+      if ((conn->payload_left -= nb_recv) == 0) {
+        frame_done(conn);
+      }
+      break;
+  }
+}
+
+static void handle_readable(DFCConn *conn) {
+  ssize_t nb_recv;
+  size_t want, budget;
+  char *buf;
+
+  if (conn->rx_buf == NULL) {
+    conn->rx_buf = pool_get(EV_RXCHUNK);
+  }
+
+  budget = EV_FAIR_SHARE;
+  while (conn->n_expected > 0 && budget > 0 && !conn->failed) {
+    want = ev_rx_want(conn, conn->rx_buf, EV_RXCHUNK, &buf);
+    if ((nb_recv = recv(conn->sockfd, buf, want, 0)) == -1) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return;
+      }
+
+      ev_fail(conn, strerror(errno));
+      return;
+    }
+
+    if (nb_recv == 0) {
+      ev_fail(conn, "connection closed mid-response");
+      return;
+    }
+
+    budget = (size_t)nb_recv < budget ? budget - nb_recv : 0;
+    ev_rx_advance(conn, buf, nb_recv, 0);
+  }
+}
+
+int ev_run(DFCEventLoop *loop) {
+  struct epoll_event events[EV_MAX_EVENTS];
+  DFCConn *conn;
+  int n_ready, n_active, n_failed, idle_ms;
+
+  if (loop->uring != NULL) {
+    return uring_run(loop);
+  }
+
+  idle_ms = 0;
+  for (;;) {
+    n_active = n_failed = 0;
+    for (size_t i = 0; i < loop->n_conns; ++i) {
+      conn = &loop->conns[i];
+      update_interest(conn);
+      n_failed += conn->failed && !conn->cancelled;
+      n_active += conn->events != 0;
+    }
+
+    if (n_active == 0) {
+      return n_failed > 0 ? -1 : 0;
+    }
+
+    if ((n_ready = epoll_wait(loop->epfd, events, EV_MAX_EVENTS,
+                              loop->tick_ms)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      perror("epoll_wait");
+      return -1;
+    }
+
+    // nothing moved on any socket for a whole timeout period
+    idle_ms = n_ready == 0 ? idle_ms + loop->tick_ms : 0;
+    if (idle_ms >= loop->timeout_ms) {
+      for (size_t i = 0; i < loop->n_conns; ++i) {
+        if (loop->conns[i].events != 0) {
+          ev_fail(&loop->conns[i], "timed out");
+        }
+      }
+      idle_ms = 0;
+    }
+
+    for (int i = 0; i < n_ready; ++i) {
+      conn = (DFCConn *)events[i].data.ptr;
+
+      if (events[i].events & (EPOLLERR | EPOLLHUP) &&
+          !(events[i].events & EPOLLIN)) {
+        ev_fail(conn, "connection lost");
+        continue;
+      }
+
+      if (events[i].events & EPOLLOUT) {
+        handle_writable(conn);
+      }
+
+      if (events[i].events & EPOLLIN && !conn->failed) {
+        handle_readable(conn);
+      }
+    }
+
+    if (loop->on_tick != NULL) {
+      loop->on_tick(loop, loop->tick_ctx);
+    }
+  }
+}
@@ -0,0 +1,84 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfc/hedge.h"
+
+void hedge_load(HedgeLog *log) {
+  FILE *fp;
+  uint32_t us;
+
+  memset(log, 0, sizeof(HedgeLog));
+  if ((log->us = malloc(sizeof(uint32_t) * HEDGE_SAMPLES)) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((fp = fopen(HEDGE_LATENCY, "r")) == NULL) {
+    return;
+  }
+
+  // oldest first, so the ring ends up where the last operation left it
+  while (fscanf(fp, "%" SCNu32, &us) == 1) {
+    hedge_add(log, us);
+  }
+  log->n_new = 0;
+
+  fclose(fp);
+}
+
+void hedge_add(HedgeLog *log, uint64_t us) {
+  log->us[log->next] = us < UINT32_MAX ? (uint32_t)us : UINT32_MAX;
+  log->next = (log->next + 1) % HEDGE_SAMPLES;
+  log->n += log->n < HEDGE_SAMPLES;
+  log->n_new++;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+uint64_t hedge_deadline(const HedgeLog *log) {
+  uint32_t sorted[HEDGE_SAMPLES];
+  uint64_t ns;
+
+  if (log->n < HEDGE_MIN_SAMPLES) {
+    return 0;
+  }
+
+  memcpy(sorted, log->us, sizeof(uint32_t) * log->n);
+  qsort(sorted, log->n, sizeof(uint32_t), cmp_u32);
+
+  ns = (uint64_t)sorted[(log->n - 1) * HEDGE_PERCENTILE / 100] * 1000;
+
+  return ns > HEDGE_MIN_MS * 1000000ull ? ns : HEDGE_MIN_MS * 1000000ull;
+}
+
+void hedge_save(const HedgeLog *log) {
+  FILE *fp;
+  size_t at;
+
+  if (log->n_new == 0) {
+    return;
+  }
+
+  if ((fp = fopen(HEDGE_LATENCY ".tmp", "w")) == NULL) {
+    fprintf(stderr, "[%s] unable to write %s\n", __func__, HEDGE_LATENCY);
+    return;
+  }
+
+  at = log->n < HEDGE_SAMPLES ? 0 : log->next;
+  for (size_t i = 0; i < log->n; ++i) {
+    fprintf(fp, "%" PRIu32 "\n", log->us[(at + i) % HEDGE_SAMPLES]);
+  }
+
+  if (fclose(fp) == EOF || rename(HEDGE_LATENCY ".tmp", HEDGE_LATENCY) == -1) {
+    fprintf(stderr, "[%s] unable to write %s\n", __func__, HEDGE_LATENCY);
+  }
+}
+
+void hedge_free(HedgeLog *log) { free(log->us); }
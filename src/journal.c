@@ -0,0 +1,343 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dfc/async.h"
+#include "dfc/journal.h"
+
+// by file, then server (put) or piece (get)
+static int cmp_entry(const void *a, const void *b) {
+  const JournalEntry *x = a, *y = b;
+  int c;
+
+  if ((c = strcmp(x->fname, y->fname)) != 0) {
+    return c;
+  } else if (x->srv != y->srv) {
+    return x->srv < y->srv ? -1 : 1;
+  }
+
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+static void add_entry(Journal *journal, JournalEntry *entry, size_t *cap) {
+  JournalEntry *entries;
+
+  if (journal->n_entries == *cap) {
+    *cap = *cap > 0 ? 2 * *cap : 64;
+    if ((entries = realloc(journal->entries, sizeof(JournalEntry) * *cap)) ==
+        NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    journal->entries = entries;
+  }
+
+  journal->entries[journal->n_entries++] = *entry;
+}
+
+// the entries a try left. a line cut short by the try dying is skipped, as
+// its name may be too
+static void load(Journal *journal) {
+  JournalEntry entry;
+  char line[PATH_MAX + 128], *nl;
+  FILE *fp;
+  size_t cap;
+  int n;
+
+  if ((fp = fopen(journal->path, "r")) == NULL) {
+    return;
+  }
+
+  cap = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if ((nl = strchr(line, '\n')) == NULL) {
+      continue;
+    }
+    *nl = '\0';
+
+    memset(&entry, 0, sizeof(JournalEntry));
+    n = 0;
+    if (sscanf(line, "put %" SCNu32 " %" SCNu64 " %" SCNd64 " %n", &entry.srv,
+               &entry.size, &entry.mtime, &n) != 3 &&
+        sscanf(line,
+               "get %" SCNu32 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %n",
+               &entry.index, &entry.offset, &entry.len, &entry.size,
+               &n) != 4) {
+      continue;
+    }
+    if (n == 0 || line[n] == '\0') {
+      continue;
+    }
+
+    if ((entry.fname = strdup(line + n)) == NULL) {
+      fprintf(stderr, "[FATAL] out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    add_entry(journal, &entry, &cap);
+  }
+
+  fclose(fp);
+
+  qsort(journal->entries, journal->n_entries, sizeof(JournalEntry),
+        cmp_entry);
+}
+
+void journal_open(Journal *journal, const char *path, int resume) {
+  memset(journal, 0, sizeof(Journal));
+  journal->path = path;
+
+  if (resume) {
+    load(journal);
+  }
+
+  if ((journal->fp = fopen(path, resume ? "a" : "w")) == NULL) {
+    fprintf(stderr, "[%s] unable to write %s\n", __func__, path);
+  }
+}
+
+// each entry goes out as it is made: the try may die at any point
+void journal_put(Journal *journal, const FileTransfer *file, size_t srv) {
+  // a manifest is cheap to send again, and changes with its chunks
+  if (journal->fp == NULL || file->manifest) {
+    return;
+  }
+
+  fprintf(journal->fp, "put %zu %" PRIu64 " %" PRId64 " %s\n", srv,
+          file->file_size, file->mtime, file->fname);
+  fflush(journal->fp);
+}
+
+void journal_piece(Journal *journal, const FileTransfer *file,
+                   const DFCPieceHeader *piece_hdr, uint64_t len) {
+  if (journal->fp == NULL) {
+    return;
+  }
+
+  fprintf(journal->fp,
+          "get %" PRIu32 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n",
+          piece_hdr->index, piece_hdr->offset, len, file->file_size,
+          file->fname);
+  fflush(journal->fp);
+}
+
+// the first entry of the file, or of the file on server srv when srv is not
+// SIZE_MAX; n_entries when there is none
+static size_t find(const Journal *journal, const char *fname, size_t srv) {
+  size_t lo, hi, mid;
+  int c;
+
+  lo = 0;
+  hi = journal->n_entries;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if ((c = strcmp(journal->entries[mid].fname, fname)) == 0 &&
+        srv != SIZE_MAX) {
+      c = journal->entries[mid].srv < srv ? -1 : 0;
+    }
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo == journal->n_entries ||
+      strcmp(journal->entries[lo].fname, fname) != 0 ||
+      (srv != SIZE_MAX && journal->entries[lo].srv != srv)) {
+    return journal->n_entries;
+  }
+
+  return lo;
+}
+
+// a frame is journaled once its last byte is on its way, which says nothing
+// of the server having stored it whole: an entry is kept only when the
+// server has the file stored with the size the entry says
+void journal_confirm(Journal *journal, const int *sockfds, size_t n_servers) {
+  char **fnames;
+  uint64_t *sizes;
+  size_t *at, n;
+
+  if (journal->n_entries == 0) {
+    return;
+  }
+
+  if ((fnames = malloc(sizeof(char *) * journal->n_entries)) == NULL ||
+      (sizes = malloc(sizeof(uint64_t) * journal->n_entries)) == NULL ||
+      (at = malloc(sizeof(size_t) * journal->n_entries)) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t srv = 0; srv < n_servers; ++srv) {
+    n = 0;
+    for (size_t i = 0; i < journal->n_entries; ++i) {
+      if (journal->entries[i].srv == srv) {
+        fnames[n] = journal->entries[i].fname;
+        at[n++] = i;
+      }
+    }
+    if (n == 0) {
+      continue;
+    }
+
+    if (sockfds[srv] <= 0 ||
+        stored_sizes(sockfds[srv], fnames, n, sizes) == -1) {
+      for (size_t j = 0; j < n; ++j) {
+        sizes[j] = UINT64_MAX;
+      }
+    }
+
+    // an entry gone unconfirmed is marked with a size no file has
+    for (size_t j = 0; j < n; ++j) {
+      if (sizes[j] != journal->entries[at[j]].size) {
+        journal->entries[at[j]].size = UINT64_MAX;
+      }
+    }
+  }
+
+  // the servers past n_servers are not in the operation
+  n = 0;
+  for (size_t i = 0; i < journal->n_entries; ++i) {
+    if (journal->entries[i].srv < n_servers &&
+        journal->entries[i].size != UINT64_MAX) {
+      journal->entries[n++] = journal->entries[i];
+    } else {
+      free(journal->entries[i].fname);
+    }
+  }
+  journal->n_entries = n;
+
+  free(fnames);
+  free(sizes);
+  free(at);
+}
+
+int journal_stored(const Journal *journal, const FileTransfer *file,
+                   size_t srv) {
+  const JournalEntry *entry;
+
+  for (size_t at = find(journal, file->fname, srv); at < journal->n_entries;
+       ++at) {
+    entry = &journal->entries[at];
+    if (entry->srv != srv || strcmp(entry->fname, file->fname) != 0) {
+      break;
+    }
+    if (entry->size == file->file_size && entry->mtime == file->mtime) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// the units file holds from its entries [lo, hi), all of which must agree
+// on its size and unit; -1 when they do not
+static int resume_file(Journal *journal, FileTransfer *file, size_t lo,
+                       size_t hi) {
+  JournalEntry *entry;
+  struct stat st;
+  uint64_t size, unit, n_units, n_recv;
+
+  size = journal->entries[lo].size;
+  unit = 0;
+  for (size_t i = lo; i < hi; ++i) {
+    entry = &journal->entries[i];
+    if (entry->size != size) {
+      return -1;
+    } else if (entry->index > 0) {
+      unit = entry->offset / entry->index;
+    } else if (unit == 0) {
+      unit = entry->len;  // the first unit is whole unless it is the file
+    }
+  }
+
+  if (size == 0 || unit == 0 || stat(file->fname, &st) == -1 ||
+      (uint64_t)st.st_size != size) {
+    return -1;
+  }
+
+  n_units = (size + unit - 1) / unit;
+  if ((file->have = calloc(n_units, 1)) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  n_recv = 0;
+  for (size_t i = lo; i < hi; ++i) {
+    entry = &journal->entries[i];
+    if (entry->index >= n_units || entry->offset != entry->index * unit ||
+        entry->len != (size - entry->offset < unit ? size - entry->offset
+                                                   : unit)) {
+      free(file->have);
+      file->have = NULL;
+      return -1;
+    }
+
+    if (!file->have[entry->index]) {
+      file->have[entry->index] = 1;
+      n_recv += entry->len;
+    }
+  }
+
+  file->file_size = size;
+  file->unit = unit;
+  file->n_units = n_units;
+  file->n_recv = n_recv;
+
+  return 0;
+}
+
+size_t journal_resume(Journal *journal, FileTransfer *files, size_t n_files) {
+  size_t n_resumed, lo, hi;
+
+  n_resumed = 0;
+  for (size_t i = 0; i < n_files; ++i) {
+    if ((lo = find(journal, files[i].fname, SIZE_MAX)) ==
+        journal->n_entries) {
+      continue;
+    }
+    for (hi = lo; hi < journal->n_entries &&
+                  strcmp(journal->entries[hi].fname, files[i].fname) == 0;
+         ++hi) {
+    }
+
+    if (resume_file(journal, &files[i], lo, hi) == -1) {
+      fprintf(stderr, "[INFO] %s does not match its journal, fetching it all\n",
+              files[i].fname);
+      continue;
+    }
+
+    fprintf(stderr,
+            "[INFO] %s: resuming with %" PRIu64 " of %" PRIu64 " bytes\n",
+            files[i].fname, files[i].n_recv, files[i].file_size);
+    n_resumed++;
+  }
+
+  return n_resumed;
+}
+
+void journal_discard(Journal *journal) {
+  if (journal->fp != NULL) {
+    fclose(journal->fp);
+    journal->fp = NULL;
+  }
+
+  unlink(journal->path);
+}
+
+void journal_close(Journal *journal) {
+  if (journal->fp != NULL) {
+    fclose(journal->fp);
+  }
+
+  for (size_t i = 0; i < journal->n_entries; ++i) {
+    free(journal->entries[i].fname);
+  }
+  free(journal->entries);
+  memset(journal, 0, sizeof(Journal));
+}
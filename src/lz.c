@@ -0,0 +1,300 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfc/lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_WINDOW (64 * 1024)  // offsets fit in two bytes
+#define LZ_HASH_LOG 16
+#define LZ_VARINT_MAX 10
+
+// match finder: head holds the last position seen for each hash, chain links
+// every position in the window to the previous one with the same hash.
+// positions are stored plus one, so zero is an empty slot
+typedef struct {
+  uint32_t head[1 << LZ_HASH_LOG];
+  uint32_t chain[LZ_WINDOW];
+} LZTables;
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+
+  return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static size_t match_len(const unsigned char *a, const unsigned char *b,
+                        const unsigned char *end) {
+  const unsigned char *start = b;
+
+  while (b < end && *a == *b) {
+    a++;
+    b++;
+  }
+
+  return b - start;
+}
+
+static unsigned char *put_ext(unsigned char *op, size_t len) {
+  for (len -= 15; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = (unsigned char)len;
+
+  return op;
+}
+
+// one sequence, or NULL when it does not fit before oend
+static unsigned char *put_seq(unsigned char *op, unsigned char *oend,
+                              const unsigned char *lit, size_t n_lit,
+                              size_t offset, size_t n_match) {
+  unsigned char *token;
+
+  if ((size_t)(oend - op) <
+      1 + n_lit / 255 + 1 + n_lit + 2 + n_match / 255 + 1) {
+    return NULL;
+  }
+
+  token = op++;
+  *token = (n_lit < 15 ? n_lit : 15) << 4;
+  if (n_lit >= 15) {
+    op = put_ext(op, n_lit);
+  }
+  memcpy(op, lit, n_lit);
+  op += n_lit;
+
+  if (n_match == 0) {  // the closing literals
+    return op;
+  }
+
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  n_match -= LZ_MIN_MATCH;
+  *token |= n_match < 15 ? n_match : 15;
+  if (n_match >= 15) {
+    op = put_ext(op, n_match);
+  }
+
+  return op;
+}
+
+// worst case: every byte a literal
+size_t lz_bound(size_t len) { return LZ_VARINT_MAX + 1 + len / 255 + 1 + len; }
+
+// compress src into dst; returns the compressed length, or -1 when it does
+// not fit in cap (which callers use to give up on data that does not shrink).
+// level trades speed for ratio: 1 takes the first candidate and speeds up
+// over data without matches, higher levels walk 2^(level-1) candidates
+ssize_t lz_compress(const char *src, size_t len, char *dst, size_t cap,
+                    int level) {
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *end = in + len;
+  unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+  LZTables *t;
+  size_t pos, anchor, best_len, best_off, n, misses, cand, next;
+  uint32_t h;
+  int depth;
+
+  if (level < 1) {
+    level = 1;
+  } else if (level > LZ_LEVEL_MAX) {
+    level = LZ_LEVEL_MAX;
+  }
+
+  if (cap < LZ_VARINT_MAX || len >= UINT32_MAX) {
+    return -1;
+  }
+  for (n = len; n >= 0x80; n >>= 7) {
+    *op++ = (n & 0x7f) | 0x80;
+  }
+  *op++ = n;
+
+  if ((t = malloc(sizeof(LZTables))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(t->head, 0, sizeof(t->head));
+
+  pos = anchor = misses = 0;
+  while (len >= LZ_MIN_MATCH && pos <= len - LZ_MIN_MATCH) {
+    h = hash4(read32(in + pos));
+
+    best_len = best_off = 0;
+    depth = 1 << (level - 1);
+    for (cand = t->head[h]; cand != 0 && pos + 1 - cand < LZ_WINDOW;
+         cand = next) {
+      if (read32(in + cand - 1) == read32(in + pos) &&
+          (n = match_len(in + cand - 1, in + pos, end)) > best_len) {
+        best_len = n;
+        best_off = pos + 1 - cand;
+      }
+
+      // stop at the end of the budget, or where the slot was reused
+      next = t->chain[(cand - 1) % LZ_WINDOW];
+      if (--depth == 0 || next >= cand) {
+        break;
+      }
+    }
+
+    t->chain[pos % LZ_WINDOW] = t->head[h];
+    t->head[h] = pos + 1;
+
+    if (best_len < LZ_MIN_MATCH) {
+      // level 1 strides through data that keeps missing
+      pos += level == 1 ? 1 + (misses++ >> 5) : 1;
+      continue;
+    }
+
+    if ((op = put_seq(op, oend, in + anchor, pos - anchor, best_off,
+                      best_len)) == NULL) {
+      free(t);
+      return -1;
+    }
+
+    // deeper levels index the positions a match skips over
+    for (n = pos + 1; level > 1 && n < pos + best_len &&
+                      n <= len - LZ_MIN_MATCH;
+         ++n) {
+      h = hash4(read32(in + n));
+      t->chain[n % LZ_WINDOW] = t->head[h];
+      t->head[h] = n + 1;
+    }
+
+    pos += best_len;
+    anchor = pos;
+    misses = 0;
+  }
+
+  free(t);
+
+  if ((op = put_seq(op, oend, in + anchor, len - anchor, 0, 0)) == NULL) {
+    return -1;
+  }
+
+  return (char *)op - dst;
+}
+
+// the raw length a block inflates to, or -1 when the header is malformed
+ssize_t lz_raw_len(const char *src, size_t len) {
+  const unsigned char *in = (const unsigned char *)src;
+  uint64_t raw;
+
+  raw = 0;
+  for (size_t i = 0; i < len && i < LZ_VARINT_MAX; ++i) {
+    raw |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+    if (!(in[i] & 0x80)) {
+      return raw > SSIZE_MAX ? -1 : (ssize_t)raw;
+    }
+  }
+
+  return -1;
+}
+
+static int get_ext(const unsigned char **ip, const unsigned char *iend,
+                   size_t *len) {
+  unsigned char b;
+
+  do {
+    if (*ip == iend) {
+      return -1;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+
+  return 0;
+}
+
+// inflate a block into dst; returns the raw length, or -1 when the block is
+// malformed or does not fit in cap
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap) {
+  const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+  unsigned char *op = (unsigned char *)dst, *oend, *match;
+  size_t n_lit, n_match, offset;
+  ssize_t raw;
+
+  if ((raw = lz_raw_len(src, len)) == -1 || (size_t)raw > cap) {
+    return -1;
+  }
+  while (*ip++ & 0x80) {
+  }
+  oend = op + raw;
+
+  while (ip < iend) {
+    n_lit = *ip >> 4;
+    n_match = (*ip++ & 0xf) + LZ_MIN_MATCH;
+
+    if (n_lit == 15 && get_ext(&ip, iend, &n_lit) == -1) {
+      return -1;
+    }
+    if (n_lit > (size_t)(iend - ip) || n_lit > (size_t)(oend - op)) {
+      return -1;
+    }
+    memcpy(op, ip, n_lit);
+    ip += n_lit;
+    op += n_lit;
+
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    offset = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+
+    if (n_match == 15 + LZ_MIN_MATCH && get_ext(&ip, iend, &n_match) == -1) {
+      return -1;
+    }
+    if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst) ||
+        n_match > (size_t)(oend - op)) {
+      return -1;
+    }
+
+    // overlapping matches repeat the bytes they are still writing
+    match = op - offset;
+    if (offset >= n_match) {
+      memcpy(op, match, n_match);
+      op += n_match;
+    } else {
+      while (n_match-- > 0) {
+        *op++ = *match++;
+      }
+    }
+  }
+
+  return op == oend ? raw : -1;
+}
+
+// whether len bytes look worth compressing: a few slices spread across them
+// are compressed at level 1, and they have to shrink by at least an eighth
+int lz_worth(const char *src, size_t len) {
+  char sample[LZ_SAMPLE_LEN], packed[LZ_SAMPLE_LEN];
+  size_t n_sample, slice;
+  ssize_t n_packed;
+
+  if (len <= LZ_SAMPLE_LEN) {
+    memcpy(sample, src, len);
+    n_sample = len;
+  } else {
+    slice = LZ_SAMPLE_LEN / LZ_SAMPLE_SLICES;
+    for (size_t i = 0; i < LZ_SAMPLE_SLICES; ++i) {
+      memcpy(sample + i * slice,
+             src + (len - slice) / (LZ_SAMPLE_SLICES - 1) * i, slice);
+    }
+    n_sample = LZ_SAMPLE_LEN;
+  }
+
+  n_packed = lz_compress(sample, n_sample, packed, n_sample - n_sample / 8, 1);
+
+  return n_packed != -1;
+}
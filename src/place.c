@@ -0,0 +1,210 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfc/bloom_filter.h"
+#include "dfc/place.h"
+
+#define PLACE_AUTO_STEPS 16  // auto weights run 1 to this: coarse, so that
+                             // noise in the measurements moves nothing
+
+uint64_t place_key(const char *fname) { return hash64(fname); }
+
+// splitmix64's finalizer: consecutive units of a file get unrelated seeds
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+
+  return x;
+}
+
+// Lamping and Veach's jump consistent hash: the seed drives a pseudo-random
+// walk over bucket numbers, each jump landing where the key would move to if
+// there were that many buckets; the last jump below n is the bucket
+static uint64_t jump(uint64_t seed, uint64_t n) {
+  int64_t b, j;
+
+  b = -1;
+  j = 0;
+  while (j < (int64_t)n) {
+    b = j;
+    seed = seed * 2862933555777941757ull + 1;
+    j = (int64_t)((double)(b + 1) *
+                  ((double)(1ll << 31) / (double)((seed >> 33) + 1)));
+  }
+
+  return (uint64_t)b;
+}
+
+size_t place_group(const PlaceMap *place, uint64_t key, uint64_t u) {
+  uint64_t slot;
+  size_t lo, hi, mid;
+
+  slot = jump(mix(key + u * 0x9e3779b97f4a7c15ull), place->n_slots);
+  if (place->ends == NULL) {
+    return (size_t)slot;
+  }
+
+  // the first group whose slots end past it
+  lo = 0;
+  hi = place->n - 1;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (place->ends[mid] > slot) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return lo;
+}
+
+// bytes per second each server was last measured at, 0 for never
+static void load_rates(double *rates, size_t n) {
+  FILE *fp;
+  size_t i;
+  double rate;
+
+  memset(rates, 0, sizeof(double) * n);
+  if ((fp = fopen(PLACE_RATES, "r")) == NULL) {
+    return;
+  }
+
+  while (fscanf(fp, "%zu %lf", &i, &rate) == 2) {
+    if (i < n && rate > 0) {
+      rates[i] = rate;
+    }
+  }
+
+  fclose(fp);
+}
+
+// weights in proportion to measured throughput; servers not measured yet
+// weigh as much as the average one that was
+static void auto_weights(uint64_t *weights, size_t n) {
+  double rates[n], max, sum;
+  size_t n_rated;
+  uint64_t step;
+
+  load_rates(rates, n);
+
+  max = sum = 0;
+  n_rated = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (rates[i] > 0) {
+      max = rates[i] > max ? rates[i] : max;
+      sum += rates[i];
+      n_rated++;
+    }
+  }
+
+  if (n_rated == 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    step = (uint64_t)((rates[i] > 0 ? rates[i] : sum / n_rated) / max *
+                          PLACE_AUTO_STEPS +
+                      0.5);
+    weights[i] = step > 0 ? step : 1;
+  }
+}
+
+void place_init(PlaceMap *place, const DFCOperation *dfc_op) {
+  uint64_t weights[dfc_op->n_servers], pair;
+  size_t n;
+  int equal;
+
+  n = dfc_op->n_servers;
+  for (size_t i = 0; i < n; ++i) {
+    weights[i] = dfc_op->weights != NULL ? dfc_op->weights[i] : 1;
+  }
+  if (dfc_op->auto_weight) {
+    auto_weights(weights, n);
+  }
+
+  memset(place, 0, sizeof(PlaceMap));
+  place->n = n;
+
+  if ((place->moved = calloc(n, sizeof(uint64_t))) == NULL ||
+      (place->busy_ns = calloc(n, sizeof(uint64_t))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // equal weights are plain jump hashing over the servers
+  equal = 1;
+  for (size_t i = 1; i < n; ++i) {
+    equal &= weights[i] == weights[0];
+  }
+  if (equal) {
+    place->n_slots = n;
+    place->max_pair = n > 1 ? 2 : 1;
+    return;
+  }
+
+  if ((place->ends = malloc(sizeof(uint64_t) * n)) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // server g holds groups g and g + 1
+  for (size_t g = 0; g < n; ++g) {
+    place->n_slots += weights[g];
+    place->ends[g] = place->n_slots;
+
+    pair = weights[g] + (n > 1 ? weights[(g + 1) % n] : 0);
+    place->max_pair = pair > place->max_pair ? pair : place->max_pair;
+  }
+}
+
+void place_free(PlaceMap *place) {
+  free(place->ends);
+  free(place->moved);
+  free(place->busy_ns);
+}
+
+void place_save_rates(const PlaceMap *place) {
+  double rates[place->n], sample;
+  FILE *fp;
+  int changed;
+
+  load_rates(rates, place->n);
+
+  // a moving average, so one slow operation does not rearrange the cluster
+  changed = 0;
+  for (size_t i = 0; i < place->n; ++i) {
+    if (place->moved[i] < PLACE_RATE_MIN_BYTES || place->busy_ns[i] == 0) {
+      continue;
+    }
+
+    sample = (double)place->moved[i] * 1e9 / (double)place->busy_ns[i];
+    rates[i] = rates[i] > 0 ? 0.75 * rates[i] + 0.25 * sample : sample;
+    changed = 1;
+  }
+
+  if (!changed) {
+    return;
+  }
+
+  if ((fp = fopen(PLACE_RATES ".tmp", "w")) == NULL) {
+    fprintf(stderr, "[%s] unable to write %s\n", __func__, PLACE_RATES);
+    return;
+  }
+
+  for (size_t i = 0; i < place->n; ++i) {
+    if (rates[i] > 0) {
+      fprintf(fp, "%zu %.0f\n", i, rates[i]);
+    }
+  }
+
+  if (fclose(fp) == EOF || rename(PLACE_RATES ".tmp", PLACE_RATES) == -1) {
+    fprintf(stderr, "[%s] unable to write %s\n", __func__, PLACE_RATES);
+  }
+}
@@ -0,0 +1,102 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfc/pool.h"
+
+static BufPool pool;
+
+// the smallest class whose buffers hold len bytes
+static size_t class_of(size_t len) {
+  size_t c;
+
+  for (c = 0; c + 1 < POOL_CLASSES && (size_t)POOL_PAGE << c < len; ++c) {
+  }
+
+  return c;
+}
+
+char *pool_get(size_t len) {
+  char *buf;
+  size_t c, size;
+
+  c = class_of(len);
+  size = (size_t)POOL_PAGE << c;
+  if (len > size) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((buf = pool.free[c]) != NULL) {
+    memcpy(&pool.free[c], buf, sizeof(char *));
+    pool.cached -= size;
+  } else if (posix_memalign((void **)&buf, POOL_PAGE, size) != 0) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pool.in_use += size;
+  pool.peak = pool.in_use > pool.peak ? pool.in_use : pool.peak;
+
+  return buf;
+}
+
+void pool_put(char *buf, size_t len) {
+  size_t c, size;
+
+  if (buf == NULL) {
+    return;
+  }
+
+  c = class_of(len);
+  size = (size_t)POOL_PAGE << c;
+  pool.in_use -= size;
+
+  // kept only while the cache and what is in use stay in bounds
+  if (pool.cached + size > POOL_CACHE_MAX ||
+      (pool.budget > 0 && pool.in_use + pool.cached + size > pool.budget)) {
+    free(buf);
+    return;
+  }
+
+  memcpy(buf, &pool.free[c], sizeof(char *));
+  pool.free[c] = buf;
+  pool.cached += size;
+}
+
+void pool_budget(uint64_t budget) {
+  pool.budget = budget;
+}
+
+size_t pool_size(size_t len) {
+  return (size_t)POOL_PAGE << class_of(len);
+}
+
+int pool_room(size_t size) {
+  if (pool.budget == 0 || pool.in_use + size <= pool.budget) {
+    return 1;
+  }
+
+  pool.n_waits++;
+  return 0;
+}
+
+void pool_drain(void) {
+  char *buf;
+
+  for (size_t c = 0; c < POOL_CLASSES; ++c) {
+    while ((buf = pool.free[c]) != NULL) {
+      memcpy(&pool.free[c], buf, sizeof(char *));
+      free(buf);
+    }
+  }
+  pool.cached = 0;
+
+  if (pool.budget > 0) {
+    fprintf(stderr,
+            "[INFO] buffers peaked at %" PRIu64 " of %" PRIu64
+            " bytes allowed; work waited for them %zu times\n",
+            pool.peak, pool.budget, pool.n_waits);
+  }
+}
@@ -0,0 +1,250 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "dfc/rs.h"
+
+#define GF_POLY 0x11d  // x^8 + x^4 + x^3 + x^2 + 1
+
+// log and antilog tables; exp is doubled so a sum of two logs needs no mod
+static uint8_t gf_exp[2 * 255];
+static uint8_t gf_log[256];
+
+static void (*mul_add_impl)(const uint8_t *, const uint8_t *, const uint8_t *,
+                            uint8_t *, size_t);
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+  return a == 0 || b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) { return gf_exp[255 - gf_log[a]]; }
+
+// the parity coefficients: row r of a Cauchy matrix over the points k + r
+// (parity) and j (data). every square submatrix of a Cauchy matrix is
+// invertible, which is what lets any k shards stand in for the data
+static uint8_t cauchy(int k, int r, int j) {
+  return gf_inv((uint8_t)((k + r) ^ j));
+}
+
+// c * s is lo[s & 15] ^ hi[s >> 4], since multiplying by c is linear: the
+// split tables are what a byte shuffle can look up 16 or 32 lanes at a time
+static void mul_add_sw(const uint8_t *lo, const uint8_t *hi, const uint8_t *src,
+                       uint8_t *dst, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] ^= lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+  }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3"))) static void mul_add_ssse3(
+    const uint8_t *lo, const uint8_t *hi, const uint8_t *src, uint8_t *dst,
+    size_t len) {
+  __m128i tlo, thi, mask, s, p;
+  size_t i;
+
+  tlo = _mm_loadu_si128((const __m128i *)lo);
+  thi = _mm_loadu_si128((const __m128i *)hi);
+  mask = _mm_set1_epi8(0xf);
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    s = _mm_loadu_si128((const __m128i *)(src + i));
+    p = _mm_xor_si128(
+        _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask)),
+        _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+    p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(dst + i)));
+    _mm_storeu_si128((__m128i *)(dst + i), p);
+  }
+
+  mul_add_sw(lo, hi, src + i, dst + i, len - i);
+}
+
+__attribute__((target("avx2"))) static void mul_add_avx2(
+    const uint8_t *lo, const uint8_t *hi, const uint8_t *src, uint8_t *dst,
+    size_t len) {
+  __m256i tlo, thi, mask, s, p;
+  size_t i;
+
+  tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+  thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+  mask = _mm256_set1_epi8(0xf);
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    s = _mm256_loadu_si256((const __m256i *)(src + i));
+    p = _mm256_xor_si256(
+        _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask)),
+        _mm256_shuffle_epi8(thi,
+                            _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+    p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst + i)));
+    _mm256_storeu_si256((__m256i *)(dst + i), p);
+  }
+
+  mul_add_sw(lo, hi, src + i, dst + i, len - i);
+}
+#endif
+
+static void gf_init(void) {
+  unsigned int x;
+
+  x = 1;
+  for (int i = 0; i < 255; ++i) {
+    gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+    gf_log[x] = (uint8_t)i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= GF_POLY;
+    }
+  }
+
+  mul_add_impl = mul_add_sw;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    mul_add_impl = mul_add_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    mul_add_impl = mul_add_ssse3;
+  }
+#endif
+}
+
+void gf_mul_add(uint8_t c, const uint8_t *src, uint8_t *dst, size_t len) {
+  uint8_t lo[16], hi[16];
+
+  if (mul_add_impl == NULL) {
+    gf_init();
+  }
+
+  if (c == 0) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < 16; ++i) {
+    lo[i] = gf_mul(c, i);
+    hi[i] = gf_mul(c, i << 4);
+  }
+
+  mul_add_impl(lo, hi, src, dst, len);
+}
+
+void rs_encode(int k, int r, const uint8_t *const *data, uint8_t *parity,
+               size_t len) {
+  if (mul_add_impl == NULL) {
+    gf_init();
+  }
+
+  memset(parity, 0, len);
+  for (int j = 0; j < k; ++j) {
+    gf_mul_add(cauchy(k, r, j), data[j], parity, len);
+  }
+}
+
+// invert the n x n matrix a in place by Gauss-Jordan elimination; returns -1
+// when it is singular
+static int gf_invert(uint8_t *a, int n) {
+  uint8_t inv[n * n], t, c;
+  int p;
+
+  memset(inv, 0, sizeof(inv));
+  for (int i = 0; i < n; ++i) {
+    inv[i * n + i] = 1;
+  }
+
+  for (int col = 0; col < n; ++col) {
+    for (p = col; p < n && a[p * n + col] == 0; ++p) {
+    }
+    if (p == n) {
+      return -1;
+    }
+
+    for (int j = 0; p != col && j < n; ++j) {
+      t = a[p * n + j];
+      a[p * n + j] = a[col * n + j];
+      a[col * n + j] = t;
+      t = inv[p * n + j];
+      inv[p * n + j] = inv[col * n + j];
+      inv[col * n + j] = t;
+    }
+
+    c = gf_inv(a[col * n + col]);
+    for (int j = 0; j < n; ++j) {
+      a[col * n + j] = gf_mul(a[col * n + j], c);
+      inv[col * n + j] = gf_mul(inv[col * n + j], c);
+    }
+
+    for (int i = 0; i < n; ++i) {
+      if (i == col || (c = a[i * n + col]) == 0) {
+        continue;
+      }
+      for (int j = 0; j < n; ++j) {
+        a[i * n + j] ^= gf_mul(c, a[col * n + j]);
+        inv[i * n + j] ^= gf_mul(c, inv[col * n + j]);
+      }
+    }
+  }
+
+  memcpy(a, inv, sizeof(inv));
+
+  return 0;
+}
+
+int rs_reconstruct(int k, int m, uint8_t **shards, const uint8_t *present,
+                   size_t len) {
+  uint8_t a[k * k];
+  int rows[k], n, n_missing;
+
+  if (mul_add_impl == NULL) {
+    gf_init();
+  }
+
+  // the present data shards first: their rows of the code are the identity,
+  // so the fewer parity rows taken, the less there is to multiply
+  n = n_missing = 0;
+  for (int j = 0; j < k; ++j) {
+    if (present[j]) {
+      rows[n++] = j;
+    } else {
+      n_missing++;
+    }
+  }
+  for (int r = 0; r < m && n < k; ++r) {
+    if (present[k + r]) {
+      rows[n++] = k + r;
+    }
+  }
+
+  if (n_missing == 0) {
+    return 0;
+  } else if (n < k) {
+    return -1;
+  }
+
+  memset(a, 0, sizeof(a));
+  for (int i = 0; i < k; ++i) {
+    if (rows[i] < k) {
+      a[i * k + rows[i]] = 1;
+      continue;
+    }
+    for (int j = 0; j < k; ++j) {
+      a[i * k + j] = cauchy(k, rows[i] - k, j);
+    }
+  }
+
+  if (gf_invert(a, k) == -1) {
+    return -1;
+  }
+
+  // data shard j is row j of the inverse applied to the shards taken
+  for (int j = 0; j < k; ++j) {
+    if (present[j]) {
+      continue;
+    }
+
+    memset(shards[j], 0, len);
+    for (int i = 0; i < k; ++i) {
+      gf_mul_add(a[j * k + i], shards[rows[i]], shards[j], len);
+    }
+  }
+
+  return 0;
+}
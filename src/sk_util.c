@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
@@ -5,12 +7,16 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dfc/types.h"
@@ -27,184 +33,512 @@ int adjacent_failure(int *sockfds, size_t len) {
   return 0;
 }
 
-int connection_sockfd(const char *hostname, const char *port) {
-  struct addrinfo hints, *srv_entries, *srv_entry;
-  int sockfd, addrinfo_status;
+size_t count_down(const int *sockfds, size_t len) {
+  size_t n_down;
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
+  n_down = 0;
+  for (size_t i = 0; i < len; ++i) {
+    n_down += sockfds[i] == -1;
+  }
 
-  if ((addrinfo_status = getaddrinfo(hostname, port, &hints, &srv_entries)) <
-      0) {
-    fprintf(stderr, "[ERROR] getaddrinfo: %s\n", gai_strerror(addrinfo_status));
+  return n_down;
+}
 
-    return -1;
+ssize_t dfc_send(int sockfd, char *send_buf, size_t len_send_buf) {
+  ssize_t nb_sent;
+
+  if ((nb_sent = send(sockfd, send_buf, len_send_buf, 0)) < 0) {
+    perror("send");
   }
 
-  // loop through results of call to getaddrinfo
-  for (srv_entry = srv_entries; srv_entry != NULL;
-       srv_entry = srv_entry->ai_next) {
-    // create socket through which server communication will be facililated
-    if ((sockfd = socket(srv_entry->ai_family, srv_entry->ai_socktype,
-                         srv_entry->ai_protocol)) < 0) {
-      perror("socket");
-      continue;
-    }
+  return nb_sent;
+}
 
-    fcntl(sockfd, F_SETFL, O_NONBLOCK);
+// one server's way through the connect stage: resolve (on a thread unless
+// the address is numeric), then race connects to its addresses until one
+// wins or the server's own deadline passes
+typedef enum {
+  CONN_RESOLVING,
+  CONN_CONNECTING,
+  CONN_DONE,
+} ConnStage;
+
+// handed to a resolver thread. whoever lets go last frees it: the thread
+// if the stage gave up waiting, the stage otherwise
+typedef struct {
+  pthread_mutex_t lock;
+  char host[DFC_SERVER_NAME_MAX + 1];
+  char port[MAX_PORT_DIGITS + 1];
+  struct addrinfo *addrs;
+  int status;
+  int finished, abandoned;
+  int notify_fd;
+  size_t srv_id;
+} ResolveJob;
+
+typedef struct {
+  ConnStage stage;
+  char host[DFC_SERVER_NAME_MAX + 1];
+  char port[MAX_PORT_DIGITS + 1];
+  ResolveJob *job;
+  struct addrinfo *addrs;
+  struct addrinfo *next[2];  // next untried address per family (v6, v4)
+  int fds[CONNECT_MAX_ADDRS];
+  int families[CONNECT_MAX_ADDRS];
+  size_t n_fds;
+  struct timespec start, deadline;
+} ConnAttempt;
+
+static double ms_since(const struct timespec *t) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
 
-    if (connect(sockfd, srv_entry->ai_addr, srv_entry->ai_addrlen) == -1) {
-      if (errno != EINPROGRESS) {
-        perror("connect");
-        close(sockfd);
-        continue;
-      }
-    }
+static void deadline_in(struct timespec *deadline, long sec) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += sec;
+}
 
-    break;
+// host:port, or [v6 literal]:port
+static int split_server(const char *server, char *host, char *port) {
+  const char *colon;
+  size_t len_host;
+
+  if (server[0] == '[') {
+    if ((colon = strstr(server, "]:")) == NULL) {
+      return -1;
+    }
+    server++;
+    len_host = colon - server;
+    colon++;
+  } else {
+    if ((colon = strrchr(server, ':')) == NULL) {
+      return -1;
+    }
+    len_host = colon - server;
   }
 
-  if (srv_entry == NULL) {
-    freeaddrinfo(srv_entries);
+  if (len_host == 0 || len_host > DFC_SERVER_NAME_MAX ||
+      strlen(colon + 1) == 0 || strlen(colon + 1) > MAX_PORT_DIGITS) {
     return -1;
   }
 
-  freeaddrinfo(srv_entries);
+  memcpy(host, server, len_host);
+  host[len_host] = '\0';
+  strcpy(port, colon + 1);
 
-  return sockfd;
+  return 0;
 }
 
-char *dfc_recv(int sockfd, ssize_t *nb_recv) {
-  char *recv_buf;
-  size_t total_nb_recv, num_reallocs, bytes_alloced, realloc_sz;
+static void *resolve_thread(void *arg) {
+  ResolveJob *job = (ResolveJob *)arg;
+  struct addrinfo hints;
+  size_t srv_id;
+  int abandoned;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  job->status = getaddrinfo(job->host, job->port, &hints, &job->addrs);
+
+  pthread_mutex_lock(&job->lock);
+  if (!(abandoned = job->abandoned)) {
+    job->finished = 1;
+    // the stage is still polling, so the pipe is still open
+    srv_id = job->srv_id;
+    if (write(job->notify_fd, &srv_id, sizeof(srv_id)) == -1) {
+      perror("write");
+    }
+  }
+  pthread_mutex_unlock(&job->lock);
 
-  if ((recv_buf = alloc_buf(RCVCHUNK)) == NULL) {
-    fprintf(stderr, "failed to allocate receive buffer (%s:%d)", __func__,
-            __LINE__ - 1);
-    return NULL;
+  if (abandoned) {
+    if (job->status == 0) {
+      freeaddrinfo(job->addrs);
+    }
+    pthread_mutex_destroy(&job->lock);
+    free(job);
   }
 
-  bytes_alloced = RCVCHUNK;
+  return NULL;
+}
 
-  total_nb_recv = realloc_sz = num_reallocs = 0;
-  while ((*nb_recv = recv(sockfd, recv_buf + total_nb_recv, RCVCHUNK, 0)) >
-         0) {
-    total_nb_recv += *nb_recv;
+// stop waiting for a resolver; frees the job if it already finished
+static void abandon_job(ResolveJob *job) {
+  int finished;
 
-    if (total_nb_recv + RCVCHUNK >= bytes_alloced) {
-      realloc_sz = bytes_alloced * 2;
-      if ((recv_buf = realloc_buf(recv_buf, realloc_sz)) == NULL) {
-        fprintf(stderr, "[FATAL] out of memory: attempted realloc size = %zu\n",
-                realloc_sz);
-        free(recv_buf);  // free old buffer
+  pthread_mutex_lock(&job->lock);
+  job->abandoned = 1;
+  finished = job->finished;
+  pthread_mutex_unlock(&job->lock);
 
-        exit(EXIT_FAILURE);
-      }
+  if (finished) {
+    if (job->status == 0) {
+      freeaddrinfo(job->addrs);
     }
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+  }
+}
 
-    bytes_alloced = realloc_sz;
-    num_reallocs++;
+static void start_resolve(ConnAttempt *att, size_t srv_id, int notify_fd) {
+  struct addrinfo hints;
+  pthread_attr_t attr;
+  pthread_t tid;
+  ResolveJob *job;
+
+  clock_gettime(CLOCK_MONOTONIC, &att->start);
+  deadline_in(&att->deadline, RESOLVETIMEO_SEC);
+  att->stage = CONN_RESOLVING;
+
+  // numeric addresses need no lookup, and no thread
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST;
+  if (getaddrinfo(att->host, att->port, &hints, &att->addrs) == 0) {
+    att->job = NULL;
+    return;
   }
+  att->addrs = NULL;
 
-  *nb_recv = total_nb_recv;
+  if ((job = calloc(1, sizeof(ResolveJob))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init(&job->lock, NULL);
+  strcpy(job->host, att->host);
+  strcpy(job->port, att->port);
+  job->notify_fd = notify_fd;
+  job->srv_id = srv_id;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, resolve_thread, job) != 0) {
+    fprintf(stderr, "[%s] pthread_create failed\n", __func__);
+    exit(EXIT_FAILURE);
+  }
+  pthread_attr_destroy(&attr);
 
-  if (total_nb_recv == 0) {  // timeout
-    perror("recv");
-    free(recv_buf);
+  att->job = job;
+}
 
-    return NULL;
+static void close_attempts(ConnAttempt *att, int keep) {
+  for (size_t j = 0; j < att->n_fds; ++j) {
+    if (att->fds[j] != -1 && att->fds[j] != keep) {
+      close(att->fds[j]);
+    }
+    att->fds[j] = -1;
   }
+}
 
-  return recv_buf;
+// settle the server on fd, or on -1 for the reason why
+static void finish(ConnAttempt *att, int *sockfd, int fd, const char *why) {
+  att->stage = CONN_DONE;
+  close_attempts(att, fd);
+  if (att->addrs != NULL) {
+    freeaddrinfo(att->addrs);
+    att->addrs = NULL;
+  }
+
+  *sockfd = fd;
+  if (why != NULL) {
+    fprintf(stderr, "[ERROR] %s:%s %s after %.1f ms\n", att->host, att->port,
+            why, ms_since(&att->start));
+  }
 }
 
-ssize_t dfc_send(int sockfd, char *send_buf, size_t len_send_buf) {
-  ssize_t nb_sent;
+// start a connect to every resolved address, alternating families so a
+// broken v6 (or v4) path costs nothing but the losing socket
+static void start_connects(ConnAttempt *att, int *sockfd) {
+  struct addrinfo *ai;
+  int fd, family;
 
-  if ((nb_sent = send(sockfd, send_buf, len_send_buf, 0)) < 0) {
-    perror("send");
+  att->stage = CONN_CONNECTING;
+  deadline_in(&att->deadline, CONNECTTIMEO_SEC);
+
+  att->next[0] = att->next[1] = NULL;
+  for (ai = att->addrs; ai != NULL; ai = ai->ai_next) {
+    family = ai->ai_family == AF_INET6 ? 0 : 1;
+    if (att->next[family] == NULL) {
+      att->next[family] = ai;
+    }
   }
 
-  return nb_sent;
+  att->n_fds = 0;
+  for (family = 0; att->n_fds < CONNECT_MAX_ADDRS &&
+                   (att->next[0] != NULL || att->next[1] != NULL);
+       family ^= 1) {
+    if ((ai = att->next[family]) == NULL) {
+      continue;
+    }
+
+    // advance to the next address of the same family
+    do {
+      att->next[family] = att->next[family]->ai_next;
+    } while (att->next[family] != NULL &&
+             (att->next[family]->ai_family == AF_INET6 ? 0 : 1) != family);
+
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+                     ai->ai_protocol)) == -1) {
+      continue;
+    }
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 &&
+        errno != EINPROGRESS) {
+      close(fd);
+      continue;
+    }
+
+    att->families[att->n_fds] = ai->ai_family;
+    att->fds[att->n_fds++] = fd;
+  }
+
+  if (att->n_fds == 0) {
+    finish(att, sockfd, -1, "refused");
+  }
 }
 
-void fill_sk_set(DFCOperation *dfc_op, int *sockfds) {
-  char hostname[DFC_SERVER_NAME_MAX + 1], port[MAX_PORT_DIGITS + 1];
-  ssize_t port_offset;
-  fd_set writefds;
-  struct timeval timeout;
-  int sel_res;
+static void on_connected(ConnAttempt *att, size_t j, int *sockfd) {
+  int fd, nodelay;
+
+  fd = att->fds[j];
+
+  // the event loop decides blocking mode for itself
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 
+  // pipelined requests are small writes that must not wait on the ack of
+  // the previous one
+  nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  fprintf(stderr, "[INFO] %s:%s connected in %.1f ms (%s, sfd=%d)\n",
+          att->host, att->port, ms_since(&att->start),
+          att->families[j] == AF_INET6 ? "IPv6" : "IPv4", fd);
+
+  finish(att, sockfd, fd, NULL);
+}
+
+// connect to the servers selected by want (all of them when NULL); slots of
+// servers left out keep whatever the caller put there. every server is
+// resolved and connected at the same time under its own deadline, so the
+// stage takes as long as the slowest server rather than the sum of them
+void fill_sk_set(DFCOperation *dfc_op, int *sockfds, const uint16_t *want) {
+  ConnAttempt atts[dfc_op->n_servers];
+  struct pollfd pfds[1 + dfc_op->n_servers * CONNECT_MAX_ADDRS];
+  size_t owner[1 + dfc_op->n_servers * CONNECT_MAX_ADDRS];
+  size_t n_pending, srv_id;
+  nfds_t n_pfds;
+  int notify[2], so_error, timeout_ms, left_ms;
+  socklen_t len;
+
+  if (pipe2(notify, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+
+  n_pending = 0;
   for (size_t i = 0; i < dfc_op->n_servers; ++i) {
-    // extract hostname
-    port_offset = 0;
-    if ((port_offset = read_until(dfc_op->servers[i], DFC_SERVER_NAME_MAX, ':',
-                                  hostname, DFC_SERVER_NAME_MAX)) == -1) {
+    atts[i].stage = CONN_DONE;
+    atts[i].n_fds = 0;
+    atts[i].addrs = NULL;
+    atts[i].job = NULL;
+    if (want != NULL && want[i] == 0) {
+      continue;
+    }
+
+    if (split_server(dfc_op->servers[i], atts[i].host, atts[i].port) == -1) {
       fprintf(stderr, "[%s] error in configuration for server %zu.. exiting\n",
               __func__, i);
 
       exit(EXIT_FAILURE);
     }
 
-    // extract port
-    if (read_until(dfc_op->servers[i] + port_offset, MAX_PORT_DIGITS, '\0',
-                   port, MAX_PORT_DIGITS) == -1) {
-      fprintf(stderr, "[%s] error in configuration for server %zu.. exiting\n",
-              __func__, i);
+    start_resolve(&atts[i], i, notify[1]);
+    if (atts[i].job == NULL) {
+      start_connects(&atts[i], &sockfds[i]);
+    }
+    n_pending += atts[i].stage != CONN_DONE;
+  }
+
+  while (n_pending > 0) {
+    pfds[0].fd = notify[0];
+    pfds[0].events = POLLIN;
+    n_pfds = 1;
+    timeout_ms = -1;
+    for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+      if (atts[i].stage == CONN_DONE) {
+        continue;
+      }
+
+      // the nearest deadline bounds the wait
+      left_ms = -ms_since(&atts[i].deadline);
+      left_ms = left_ms > 0 ? left_ms + 1 : 0;
+      if (timeout_ms == -1 || left_ms < timeout_ms) {
+        timeout_ms = left_ms;
+      }
+
+      for (size_t j = 0; j < atts[i].n_fds; ++j) {
+        if (atts[i].fds[j] != -1) {
+          pfds[n_pfds].fd = atts[i].fds[j];
+          pfds[n_pfds].events = POLLOUT;
+          owner[n_pfds++] = i * CONNECT_MAX_ADDRS + j;
+        }
+      }
+    }
 
+    if (poll(pfds, n_pfds, timeout_ms) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      perror("poll");
       exit(EXIT_FAILURE);
     }
 
-    if ((sockfds[i] = connection_sockfd(hostname, port)) == -1) {
-      perror("connect");
-      fprintf(stderr,
-              "[ERROR] connection attempt to server %zu(%s:%s) failed\n", i,
-              hostname, port);
-      continue;
+    // lookups that came back
+    if (pfds[0].revents & POLLIN) {
+      while (read(notify[0], &srv_id, sizeof(srv_id)) == sizeof(srv_id)) {
+        ResolveJob *job = atts[srv_id].job;
+
+        // timed out (and let go of) before we got to it
+        if (job == NULL) {
+          continue;
+        }
+        atts[srv_id].job = NULL;
+        if (job->status != 0) {
+          fprintf(stderr, "[ERROR] getaddrinfo %s: %s\n", job->host,
+                  gai_strerror(job->status));
+          abandon_job(job);
+          finish(&atts[srv_id], &sockfds[srv_id], -1, "did not resolve");
+          n_pending--;
+          continue;
+        }
+
+        atts[srv_id].addrs = job->addrs;
+        job->status = -1;  // the addresses are ours now
+        abandon_job(job);
+
+        start_connects(&atts[srv_id], &sockfds[srv_id]);
+        n_pending -= atts[srv_id].stage == CONN_DONE;
+      }
     }
-  }
 
-  FD_ZERO(&writefds);
-  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
-    FD_SET(sockfds[i], &writefds);
+    // connects that finished, either way
+    for (nfds_t k = 1; k < n_pfds; ++k) {
+      ConnAttempt *att = &atts[owner[k] / CONNECT_MAX_ADDRS];
+      size_t j = owner[k] % CONNECT_MAX_ADDRS;
+
+      if (pfds[k].revents == 0 || att->stage == CONN_DONE) {
+        continue;
+      }
+
+      len = sizeof(so_error);
+      if (getsockopt(att->fds[j], SOL_SOCKET, SO_ERROR, &so_error, &len) ==
+              -1 ||
+          so_error != 0) {
+        close(att->fds[j]);
+        att->fds[j] = -1;
+
+        // the race is lost only once every address has failed
+        size_t n_open = 0;
+        for (size_t m = 0; m < att->n_fds; ++m) {
+          n_open += att->fds[m] != -1;
+        }
+        if (n_open == 0) {
+          finish(att, &sockfds[owner[k] / CONNECT_MAX_ADDRS], -1,
+                 strerror(so_error));
+          n_pending--;
+        }
+        continue;
+      }
+
+      on_connected(att, j, &sockfds[owner[k] / CONNECT_MAX_ADDRS]);
+      n_pending--;
+    }
+
+    // servers out of time
+    for (size_t i = 0; i < dfc_op->n_servers; ++i) {
+      if (atts[i].stage == CONN_DONE || ms_since(&atts[i].deadline) < 0) {
+        continue;
+      }
+
+      if (atts[i].job != NULL) {
+        abandon_job(atts[i].job);
+        atts[i].job = NULL;
+      }
+      finish(&atts[i], &sockfds[i], -1,
+             atts[i].stage == CONN_RESOLVING ? "lookup timed out"
+                                             : "connect timed out");
+      n_pending--;
+    }
   }
-  timeout.tv_sec = CONNECTTIMEO_SEC;
-  timeout.tv_usec = CONNECTTIMEO_USEC;
 
-  for (size_t i = 0; i < dfc_op->n_servers; ++i) {
-    if ((sel_res = select(sockfds[dfc_op->n_servers - 1] + 1, NULL, &writefds,
-                          NULL, &timeout)) > 1) {
-      int so_error;
-      socklen_t len = sizeof(so_error);
-
-      getsockopt(sockfds[i], SOL_SOCKET, SO_ERROR, &so_error, &len);
-
-      if (so_error == 0) {
-        // clear non-blocking flag, if set, leads to incomplete sends/writes
-        // when file is too large for socket buffer
-        int flags = fcntl(sockfds[i], F_GETFL);
-        flags &= ~O_NONBLOCK;
-        fcntl(sockfds[i], F_SETFL, flags);
-#ifdef DEBUG
-        fprintf(stderr, "[INFO] %s(sfd=%d) is open\n", dfc_op->servers[i],
-                sockfds[i]);
-        fflush(stderr);
-#endif
-      } else if (so_error == ECONNREFUSED) {
-#ifdef DEBUG
-        fprintf(stderr, "[ERROR] (%s) %s\n", dfc_op->servers[i],
-                strerror(so_error));
-        fflush(stderr);
-#endif
-        sockfds[i] = -1;
-      } else {
-        perror("connect");
-
-        exit(EXIT_FAILURE);
+  close(notify[0]);
+  close(notify[1]);
+}
+
+// choose which live servers to ask for which pieces. server i stores pieces
+// i and i + 1, so every piece has two holders and about half the servers
+// cover the file. sockfds[i] == -1 marks a server known to be down; anything
+// else is a candidate. each rotation of the cover is tried from start (which
+// spreads load across files) and the one using the fewest servers wins.
+// returns the number of servers in the plan, or -1 when some piece has no
+// live holder
+ssize_t plan_get(const int *sockfds, size_t n_servers, size_t start,
+                 uint16_t *piece_flags) {
+  uint16_t flags[n_servers];
+  int covered[n_servers];
+  size_t piece, prev, next, n_used, best;
+
+  best = n_servers + 1;
+  for (size_t r = 0; r < n_servers; ++r) {
+    memset(flags, 0, sizeof(flags));
+    memset(covered, 0, sizeof(covered));
+    n_used = 0;
+
+    for (size_t k = 0; k < n_servers && n_used < best; ++k) {
+      piece = (start + r + k) % n_servers;
+      if (covered[piece]) {
+        continue;
+      }
+
+      // prefer the server holding the piece first, which also covers the
+      // one after it
+      if (sockfds[piece] != -1) {
+        flags[piece] |= DFC_GET_PIECE_FIRST;
+        covered[piece] = 1;
+
+        next = (piece + 1) % n_servers;
+        if (!covered[next]) {
+          flags[piece] |= DFC_GET_PIECE_SECOND;
+          covered[next] = 1;
+        }
+        n_used++;
+        continue;
+      }
+
+      // degraded: the left neighbour holds it second
+      prev = (piece + n_servers - 1) % n_servers;
+      if (sockfds[prev] == -1) {
+        return -1;
       }
+
+      n_used += flags[prev] == 0;
+      flags[prev] |= DFC_GET_PIECE_SECOND;
+      covered[piece] = 1;
+    }
+
+    if (n_used < best) {
+      best = n_used;
+      memcpy(piece_flags, flags, sizeof(flags));
     }
   }
+
+  return (ssize_t)best;
 }
 
 void set_timeout(int sockfd, long tv_sec, long tv_usec) {
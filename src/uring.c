@@ -0,0 +1,594 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dfc/event.h"
+#include "dfc/uring.h"
+
+// what a completion belongs to, stored in the low byte of user_data next to
+// the connection index
+enum {
+  OP_RECV = 1,     // header / listing / dropped piece bytes
+  OP_RECV_LINKED,  // piece bytes, followed by OP_WRITE
+  OP_WRITE,        // piece bytes to their final file offset
+  OP_SEND,
+};
+
+// tried in order: completions only run when we ask for them, then cheaper
+// task work, then whatever the kernel supports
+static const unsigned int setup_flags[] = {
+    IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_COOP_TASKRUN,
+    0,
+};
+
+typedef struct {
+  size_t rx_pending, tx_pending;  // sqes in flight per direction
+  size_t rx_want, rx_got;
+  char *rx_addr;  // where ev_rx_want asked for the bytes to land
+  struct iovec tx_iov[URING_TX_IOV];  // read by the kernel until it completes
+  struct msghdr tx_msg;
+  int shut;
+} UringSlot;
+
+struct DFCUring {
+  int fd;
+  unsigned int sq_entries;
+
+  void *ring;
+  size_t len_ring;
+  struct io_uring_sqe *sqes;
+  size_t len_sqes;
+
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned int sq_local_tail;
+  unsigned int n_queued;
+
+  // two registered buffers per connection: rx at 2 * i, tx at 2 * i + 1,
+  // where small queued items are gathered
+  char *bufs;
+  size_t len_bufs;
+
+  UringSlot *slots;
+  size_t max_conns;
+
+  size_t n_enter, n_sqes;
+};
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned int to_submit,
+                           unsigned int min_complete, unsigned int flags,
+                           void *arg, size_t len_arg) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, len_arg);
+}
+
+static int sys_uring_register(int fd, unsigned int opcode, void *arg,
+                              unsigned int n_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, n_args);
+}
+
+static char *rx_buf(DFCUring *u, size_t i) {
+  return u->bufs + 2 * i * URING_BUFSZ;
+}
+
+static char *tx_buf(DFCUring *u, size_t i) {
+  return u->bufs + (2 * i + 1) * URING_BUFSZ;
+}
+
+void uring_destroy(DFCUring *u) {
+  if (u == NULL) {
+    return;
+  }
+
+  // closing the ring drops the registered buffers and files with it
+  if (u->fd != -1) {
+    close(u->fd);
+  }
+  if (u->sqes != NULL) {
+    munmap(u->sqes, u->len_sqes);
+  }
+  if (u->ring != NULL) {
+    munmap(u->ring, u->len_ring);
+  }
+  if (u->bufs != NULL) {
+    munmap(u->bufs, u->len_bufs);
+  }
+
+  free(u->slots);
+  free(u);
+}
+
+// returns NULL when the kernel cannot give us what the backend relies on, so
+// that the caller can stay on epoll
+DFCUring *uring_init(size_t max_conns) {
+  struct io_uring_params p;
+  struct iovec *iov;
+  DFCUring *u;
+  unsigned int entries;
+  size_t len_sq, len_cq;
+
+  if ((u = calloc(1, sizeof(DFCUring))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  u->fd = -1;
+  u->max_conns = max_conns;
+
+  if ((u->slots = calloc(max_conns, sizeof(UringSlot))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  entries = URING_SQES_PER_CONN * (max_conns > 0 ? max_conns : 1);
+
+  // older kernels reject the newer flags with EINVAL
+  for (size_t i = 0; i < sizeof(setup_flags) / sizeof(setup_flags[0]); ++i) {
+    memset(&p, 0, sizeof(p));
+    p.flags = setup_flags[i];
+    if ((u->fd = sys_uring_setup(entries, &p)) != -1 || errno != EINVAL) {
+      break;
+    }
+  }
+
+  if (u->fd == -1) {
+    fprintf(stderr, "[%s] io_uring_setup: %s\n", __func__, strerror(errno));
+    uring_destroy(u);
+    return NULL;
+  }
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    fprintf(stderr, "[%s] kernel io_uring lacks required features\n",
+            __func__);
+    uring_destroy(u);
+    return NULL;
+  }
+
+  len_sq = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  len_cq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->len_ring = len_sq > len_cq ? len_sq : len_cq;
+  u->len_sqes = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  if ((u->ring = mmap(NULL, u->len_ring, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING)) ==
+      MAP_FAILED) {
+    u->ring = NULL;
+    perror("mmap");
+    uring_destroy(u);
+    return NULL;
+  }
+
+  if ((u->sqes = mmap(NULL, u->len_sqes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES)) ==
+      MAP_FAILED) {
+    u->sqes = NULL;
+    perror("mmap");
+    uring_destroy(u);
+    return NULL;
+  }
+
+  u->sq_entries = p.sq_entries;
+  u->sq_head = (unsigned int *)((char *)u->ring + p.sq_off.head);
+  u->sq_tail = (unsigned int *)((char *)u->ring + p.sq_off.tail);
+  u->sq_mask = (unsigned int *)((char *)u->ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned int *)((char *)u->ring + p.sq_off.array);
+  u->cq_head = (unsigned int *)((char *)u->ring + p.cq_off.head);
+  u->cq_tail = (unsigned int *)((char *)u->ring + p.cq_off.tail);
+  u->cq_mask = (unsigned int *)((char *)u->ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((char *)u->ring + p.cq_off.cqes);
+  u->sq_local_tail = *u->sq_tail;
+
+  // sqe slots are handed out in ring order, so the indirection is identity
+  for (unsigned int i = 0; i < p.sq_entries; ++i) {
+    u->sq_array[i] = i;
+  }
+
+  u->len_bufs = 2 * max_conns * URING_BUFSZ;
+  if ((u->bufs = mmap(NULL, u->len_bufs, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+    u->bufs = NULL;
+    perror("mmap");
+    uring_destroy(u);
+    return NULL;
+  }
+
+  if ((iov = calloc(2 * max_conns, sizeof(struct iovec))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < 2 * max_conns; ++i) {
+    iov[i].iov_base = u->bufs + i * URING_BUFSZ;
+    iov[i].iov_len = URING_BUFSZ;
+  }
+
+  // pinned once here instead of on every file read/write
+  if (sys_uring_register(u->fd, IORING_REGISTER_BUFFERS, iov,
+                         2 * max_conns) == -1) {
+    fprintf(stderr, "[%s] register buffers: %s\n", __func__, strerror(errno));
+    free(iov);
+    uring_destroy(u);
+    return NULL;
+  }
+
+  free(iov);
+
+  return u;
+}
+
+static struct io_uring_sqe *get_sqe(DFCUring *u, size_t conn_idx, int op) {
+  struct io_uring_sqe *sqe;
+
+  // every connection holds at most URING_SQES_PER_CONN sqes in flight, and
+  // the ring is sized for that, so this never wraps onto a live entry
+  sqe = &u->sqes[u->sq_local_tail & *u->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->user_data = ((uint64_t)conn_idx << 8) | (uint64_t)op;
+
+  u->sq_local_tail++;
+  u->n_queued++;
+
+  return sqe;
+}
+
+static void prep_rx(DFCUring *u, DFCConn *conn, size_t i) {
+  struct io_uring_sqe *sqe;
+  UringSlot *slot;
+  char *buf;
+
+  slot = &u->slots[i];
+  slot->rx_want = ev_rx_want(conn, rx_buf(u, i), URING_BUFSZ, &buf);
+  slot->rx_got = 0;
+  slot->rx_addr = buf;
+
+  if (!ev_rx_direct(conn)) {
+    sqe = get_sqe(u, i, OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = (int)i;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)slot->rx_want;
+    slot->rx_pending = 1;
+    return;
+  }
+
+  // piece bytes go socket -> registered buffer -> file offset without coming
+  // back to userspace in between. a short receive breaks the link and the
+  // bytes that did arrive are written by ev_rx_advance instead
+  sqe = get_sqe(u, i, OP_RECV_LINKED);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+  sqe->fd = (int)i;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)slot->rx_want;
+  sqe->msg_flags = MSG_WAITALL;
+
+  sqe = get_sqe(u, i, OP_WRITE);
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = conn->rx_piece_fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)slot->rx_want;
+  sqe->off = (uint64_t)ev_rx_offset(conn);
+  sqe->buf_index = (uint16_t)(2 * i);
+
+  slot->rx_pending = 2;
+}
+
+// send straight from the queued buffers, up to URING_TX_IOV of them at once.
+// small items (request headers, piece headers) are copied next to each other
+// into the tx buffer instead, so a run of them takes one iovec. the buffers
+// stay queued until the send completes. a connection that fails drops them
+// sooner, but its socket is shut down, so what the kernel still reads goes
+// nowhere
+static void prep_tx(DFCUring *u, DFCConn *conn, size_t i) {
+  struct io_uring_sqe *sqe;
+  struct iovec *iov;
+  UringSlot *slot;
+  TxItem *tx;
+  size_t len, take, n_iov;
+  char *buf, *from;
+
+  slot = &u->slots[i];
+  buf = tx_buf(u, i);
+  iov = slot->tx_iov;
+
+  len = n_iov = 0;
+  for (size_t j = conn->tx_head; j < conn->tx_tail && n_iov < URING_TX_IOV;
+       ++j) {
+    tx = &conn->tx[j];
+    from = tx->buf + tx->done;
+    take = tx->len - tx->done;
+
+    if (take > URING_TX_COPY) {
+      iov[n_iov].iov_base = from;
+      iov[n_iov++].iov_len = take;
+      continue;
+    }
+
+    if (len + take > URING_BUFSZ) {
+      break;
+    }
+
+    // the copy joins the previous iovec when that one ends where it starts
+    memcpy(buf + len, from, take);
+    if (n_iov > 0 &&
+        (char *)iov[n_iov - 1].iov_base + iov[n_iov - 1].iov_len == buf + len) {
+      iov[n_iov - 1].iov_len += take;
+    } else {
+      iov[n_iov].iov_base = buf + len;
+      iov[n_iov++].iov_len = take;
+    }
+    len += take;
+  }
+  slot->tx_pending = 1;
+  conn->tx_busy = 1;
+
+  memset(&slot->tx_msg, 0, sizeof(struct msghdr));
+  slot->tx_msg.msg_iov = iov;
+  slot->tx_msg.msg_iovlen = n_iov;
+
+  sqe = get_sqe(u, i, OP_SEND);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = (int)i;
+  sqe->addr = (uint64_t)(uintptr_t)&slot->tx_msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+}
+
+// spread a completed send over the queued items it covered
+static void tx_complete(DFCConn *conn, size_t nb_sent) {
+  TxItem *tx;
+  size_t take;
+
+  while (nb_sent > 0 && conn->tx_head < conn->tx_tail && !conn->failed) {
+    tx = &conn->tx[conn->tx_head];
+    take = tx->len - tx->done < nb_sent ? tx->len - tx->done : nb_sent;
+    nb_sent -= take;
+    ev_tx_advance(conn, take);
+  }
+}
+
+static void handle_cqe(DFCUring *u, DFCEventLoop *loop,
+                       const struct io_uring_cqe *cqe) {
+  DFCConn *conn;
+  UringSlot *slot;
+  size_t i;
+  int op, res;
+
+  i = (size_t)(cqe->user_data >> 8);
+  op = (int)(cqe->user_data & 0xff);
+  res = cqe->res;
+  conn = &loop->conns[i];
+  slot = &u->slots[i];
+
+  if (op == OP_SEND) {
+    slot->tx_pending--;
+    conn->tx_busy = 0;
+    // failed while the send was reading them: the buffers are free now
+    if (conn->failed) {
+      ev_tx_drop(conn);
+    }
+  } else {
+    slot->rx_pending--;
+  }
+
+  // a failed link cancels the rest of the chain; the head already reported
+  if (conn->failed || res == -ECANCELED) {
+    return;
+  }
+
+  switch (op) {
+    case OP_RECV:
+    case OP_RECV_LINKED:
+      if (res <= 0) {
+        ev_fail(conn, res == 0 ? "connection closed mid-response"
+                               : strerror(-res));
+        return;
+      }
+
+      slot->rx_got = (size_t)res;
+      if (op == OP_RECV || slot->rx_got < slot->rx_want) {
+        ev_rx_advance(conn, slot->rx_addr, slot->rx_got, 0);
+      }
+      break;
+    case OP_WRITE:
+      // only a full receive leaves the write to us
+      if (slot->rx_got != slot->rx_want) {
+        break;
+      }
+
+      if (res < 0 || (size_t)res != slot->rx_want) {
+        ev_fail(conn, res < 0 ? strerror(-res) : "short write");
+        return;
+      }
+
+      ev_rx_advance(conn, slot->rx_addr, slot->rx_want, 1);
+      break;
+    case OP_SEND:
+      if (res <= 0) {
+        ev_fail(conn, res == 0 ? "connection lost" : strerror(-res));
+        return;
+      }
+
+      tx_complete(conn, (size_t)res);
+      break;
+  }
+}
+
+static int register_sockets(DFCUring *u, DFCEventLoop *loop) {
+  int *fds;
+  int rc;
+
+  if ((fds = calloc(loop->n_conns, sizeof(int))) == NULL) {
+    fprintf(stderr, "[FATAL] out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < loop->n_conns; ++i) {
+    fds[i] = loop->conns[i].sockfd;
+  }
+
+  // fixed files skip the fd table lookup and refcount on every operation
+  rc = sys_uring_register(u->fd, IORING_REGISTER_FILES, fds,
+                          (unsigned int)loop->n_conns);
+  if (rc == -1) {
+    fprintf(stderr, "[%s] register files: %s\n", __func__, strerror(errno));
+  }
+
+  free(fds);
+
+  return rc;
+}
+
+int uring_run(DFCEventLoop *loop) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  DFCUring *u;
+  DFCConn *conn;
+  UringSlot *slot;
+  unsigned int head, tail;
+  size_t n_pending;
+  int n_active, n_failed, idle_ms, rc;
+
+  u = loop->uring;
+  if (loop->n_conns == 0) {
+    return 0;
+  }
+
+  if (register_sockets(u, loop) == -1) {
+    return -1;
+  }
+
+  ts.tv_sec = loop->tick_ms / 1000;
+  ts.tv_nsec = (loop->tick_ms % 1000) * 1000000L;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uint64_t)(uintptr_t)&ts;
+
+  idle_ms = 0;
+  for (;;) {
+    n_active = n_failed = 0;
+    n_pending = 0;
+
+    // queue the next step of every idle direction on every connection, then
+    // hand the whole batch to the kernel in one call
+    for (size_t i = 0; i < loop->n_conns; ++i) {
+      conn = &loop->conns[i];
+      slot = &u->slots[i];
+
+      if (conn->failed) {
+        n_failed += !conn->cancelled;
+
+        // wake whatever still waits on the socket so the ring drains
+        if (slot->rx_pending + slot->tx_pending > 0 && !slot->shut) {
+          shutdown(conn->sockfd, SHUT_RDWR);
+          slot->shut = 1;
+        }
+
+        n_pending += slot->rx_pending + slot->tx_pending;
+        continue;
+      }
+
+      if (slot->tx_pending == 0) {
+        while (conn->tx_head < conn->tx_tail &&
+               conn->tx[conn->tx_head].done == conn->tx[conn->tx_head].len) {
+          ev_tx_advance(conn, 0);
+        }
+
+        if (conn->tx_head < conn->tx_tail) {
+          prep_tx(u, conn, i);
+        }
+      }
+
+      if (slot->rx_pending == 0 && conn->n_expected > 0) {
+        prep_rx(u, conn, i);
+      }
+
+      n_active += conn->n_expected > 0 || conn->tx_head < conn->tx_tail;
+      n_pending += slot->rx_pending + slot->tx_pending;
+    }
+
+    if (n_pending == 0) {
+      if (n_active == 0) {
+        break;
+      }
+      continue;
+    }
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+    rc = sys_uring_enter(u->fd, u->n_queued, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                         sizeof(arg));
+    u->n_enter++;
+    if (rc >= 0) {
+      u->n_sqes += (size_t)rc;
+      u->n_queued -= (unsigned int)rc;
+    } else if (errno == ETIME) {
+      // nothing completed on any socket for a whole timeout period
+      if ((idle_ms += loop->tick_ms) >= loop->timeout_ms) {
+        for (size_t i = 0; i < loop->n_conns; ++i) {
+          slot = &u->slots[i];
+          if (!loop->conns[i].failed &&
+              slot->rx_pending + slot->tx_pending > 0) {
+            ev_fail(&loop->conns[i], "timed out");
+          }
+        }
+        idle_ms = 0;
+      }
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      // the ring is no good any more, and neither is what it was driving
+      perror("io_uring_enter");
+      for (size_t i = 0; i < loop->n_conns; ++i) {
+        if (!loop->conns[i].failed) {
+          ev_fail(&loop->conns[i], "io_uring_enter failed");
+        }
+      }
+      n_failed++;
+      break;
+    }
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    if (head != tail) {
+      idle_ms = 0;
+    }
+    for (; head != tail; ++head) {
+      handle_cqe(u, loop, &u->cqes[head & *u->cq_mask]);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    if (loop->on_tick != NULL) {
+      loop->on_tick(loop, loop->tick_ctx);
+    }
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "[INFO] io_uring: %zu sqes in %zu enters\n", u->n_sqes,
+          u->n_enter);
+  fflush(stderr);
+#endif
+
+  sys_uring_register(u->fd, IORING_UNREGISTER_FILES, NULL, 0);
+
+  return n_failed > 0 ? -1 : 0;
+}